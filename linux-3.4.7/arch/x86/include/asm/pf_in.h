@@ -31,9 +31,24 @@ enum reason_type {
 	OTHERS	/* Other instructions can not intercept */
 };
 
+/* decoded instruction, as cached by users of the fault path */
+struct ins_desc {
+	enum reason_type type;
+	unsigned char mem_width;	/* bytes accessed in memory */
+	unsigned char reg_width;	/* bytes of register operand */
+	unsigned char reg;		/* register operand (mod/rm ident) */
+	unsigned char rex;		/* REX prefix present */
+	unsigned char len;		/* MOV store length, 0 otherwise */
+	unsigned long imm;		/* immediate operand */
+};
+
 enum reason_type get_ins_type(unsigned long ins_addr);
 unsigned int get_ins_mem_width(unsigned long ins_addr);
 unsigned long get_ins_reg_val(unsigned long ins_addr, struct pt_regs *regs);
 unsigned long get_ins_imm_val(unsigned long ins_addr);
+unsigned int get_ins_len(unsigned long ins_addr);
+int get_ins_desc(unsigned long ins_addr, struct ins_desc *desc);
+unsigned long get_ins_desc_reg_val(const struct ins_desc *desc,
+				   struct pt_regs *regs);
 
 #endif /* __PF_H_ */
@@ -29,54 +29,70 @@
 #include <linux/module.h>
 #include "pf_in.h"
 
-#ifdef __i386__
-/* IA32 Manual 3, 2-1 */
-static unsigned char prefix_codes[] = {
-	0xF0, 0xF2, 0xF3, 0x2E, 0x36, 0x3E, 0x26, 0x64,
-	0x65, 0x66, 0x67
+/*
+ * Opcode and prefix classification is table driven: one lookup per
+ * byte, instead of scanning per-class opcode arrays.
+ */
+
+/* operand width classes, resolved against the prefixes at hand */
+enum {
+	W_NONE = 0,	/* not a known memory access */
+	W_8,		/* 8 bit only */
+	W_16,		/* 16 bit only */
+	W_16_32,	/* 16 or 32 bit */
+	W_16_64		/* 16, 32 or 64 bit */
 };
-/* IA32 Manual 3, 3-432*/
-static unsigned int reg_rop[] = {
-	0x8A, 0x8B, 0xB60F, 0xB70F, 0xBE0F, 0xBF0F
+
+struct opcode_desc {
+	unsigned char type;		/* enum reason_type */
+	unsigned char reg_width;	/* register operand width class */
+	unsigned char mem_width;	/* memory operand width class */
 };
-static unsigned int reg_wop[] = { 0x88, 0x89, 0xAA, 0xAB };
-static unsigned int imm_wop[] = { 0xC6, 0xC7 };
-/* IA32 Manual 3, 3-432*/
-static unsigned int rw8[] = { 0x88, 0x8A, 0xC6, 0xAA };
-static unsigned int rw32[] = {
-	0x89, 0x8B, 0xC7, 0xB60F, 0xB70F, 0xBE0F, 0xBF0F, 0xAB
+
+#define OP(t, r, m) { .type = (t), .reg_width = (r), .mem_width = (m) }
+/* two byte opcodes (0x0F xx) live at 0x100 + xx */
+#define OP_0F(b) (0x100 + (b))
+
+/* IA32 Manual 3, 3-432; AMD64 Manual 3, Appendix A */
+static const struct opcode_desc opcode_table[0x200] = {
+	[0x88]		= OP(REG_WRITE, W_8, W_8),
+	[0x89]		= OP(REG_WRITE, W_16_64, W_16_64),
+	[0x8A]		= OP(REG_READ, W_8, W_8),
+	[0x8B]		= OP(REG_READ, W_16_64, W_16_64),
+	[0xAA]		= OP(REG_WRITE, W_8, W_8),
+	[0xAB]		= OP(REG_WRITE, W_16_64, W_16_64),
+	[0xC6]		= OP(IMM_WRITE, W_8, W_8),
+	/* imm16/32 (the "register" width), sign-extended under REX.W */
+	[0xC7]		= OP(IMM_WRITE, W_16_32, W_16_64),
+	[OP_0F(0xB6)]	= OP(REG_READ, W_16_64, W_8),
+	[OP_0F(0xB7)]	= OP(REG_READ, W_16_64, W_16),
+	[OP_0F(0xBE)]	= OP(REG_READ, W_16_64, W_8),
+	[OP_0F(0xBF)]	= OP(REG_READ, W_16_64, W_16),
 };
-static unsigned int mw8[] = { 0x88, 0x8A, 0xC6, 0xB60F, 0xBE0F, 0xAA };
-static unsigned int mw16[] = { 0xB70F, 0xBF0F };
-static unsigned int mw32[] = { 0x89, 0x8B, 0xC7, 0xAB };
-static unsigned int mw64[] = {};
-#else /* not __i386__ */
-static unsigned char prefix_codes[] = {
-	0x66, 0x67, 0x2E, 0x3E, 0x26, 0x64, 0x65, 0x36,
-	0xF0, 0xF3, 0xF2,
+#undef OP
+
+/* prefix byte classes */
+#define PF_PREFIX	0x01
+#define PF_SHORTED	0x02	/* operand size override */
+#define PF_ENLARGED	0x04	/* REX.W */
+#define PF_REXR		0x08	/* REX.R */
+#define PF_REX		0x10	/* any REX */
+
+/* IA32 Manual 3, 2-1 */
+static const unsigned char prefix_table[0x100] = {
+	[0xF0] = PF_PREFIX, [0xF2] = PF_PREFIX, [0xF3] = PF_PREFIX,
+	[0x2E] = PF_PREFIX, [0x36] = PF_PREFIX, [0x3E] = PF_PREFIX,
+	[0x26] = PF_PREFIX, [0x64] = PF_PREFIX, [0x65] = PF_PREFIX,
+	[0x66] = PF_PREFIX | PF_SHORTED,
+	[0x67] = PF_PREFIX,
+#ifdef __amd64__
 	/* REX Prefixes */
-	0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
-	0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f
-};
-/* AMD64 Manual 3, Appendix A*/
-static unsigned int reg_rop[] = {
-	0x8A, 0x8B, 0xB60F, 0xB70F, 0xBE0F, 0xBF0F
-};
-static unsigned int reg_wop[] = { 0x88, 0x89, 0xAA, 0xAB };
-static unsigned int imm_wop[] = { 0xC6, 0xC7 };
-static unsigned int rw8[] = { 0xC6, 0x88, 0x8A, 0xAA };
-static unsigned int rw32[] = {
-	0xC7, 0x89, 0x8B, 0xB60F, 0xB70F, 0xBE0F, 0xBF0F, 0xAB
+	[0x40 ... 0x43] = PF_PREFIX | PF_REX,
+	[0x44 ... 0x47] = PF_PREFIX | PF_REX | PF_REXR,
+	[0x48 ... 0x4B] = PF_PREFIX | PF_REX | PF_ENLARGED,
+	[0x4C ... 0x4F] = PF_PREFIX | PF_REX | PF_ENLARGED | PF_REXR,
+#endif
 };
-/* 8 bit only */
-static unsigned int mw8[] = { 0xC6, 0x88, 0x8A, 0xB60F, 0xBE0F, 0xAA };
-/* 16 bit only */
-static unsigned int mw16[] = { 0xB70F, 0xBF0F };
-/* 16 or 32 bit */
-static unsigned int mw32[] = { 0xC7 };
-/* 16, 32 or 64 bit */
-static unsigned int mw64[] = { 0x89, 0x8B, 0xAB };
-#endif /* not __i386__ */
 
 struct prefix_bits {
 	unsigned shorted:1;
@@ -87,30 +103,16 @@ struct prefix_bits {
 
 static int skip_prefix(unsigned char *addr, struct prefix_bits *prf)
 {
-	int i;
 	unsigned char *p = addr;
-	prf->shorted = 0;
-	prf->enlarged = 0;
-	prf->rexr = 0;
-	prf->rex = 0;
-
-restart:
-	for (i = 0; i < ARRAY_SIZE(prefix_codes); i++) {
-		if (*p == prefix_codes[i]) {
-			if (*p == 0x66)
-				prf->shorted = 1;
-#ifdef __amd64__
-			if ((*p & 0xf8) == 0x48)
-				prf->enlarged = 1;
-			if ((*p & 0xf4) == 0x44)
-				prf->rexr = 1;
-			if ((*p & 0xf0) == 0x40)
-				prf->rex = 1;
-#endif
-			p++;
-			goto restart;
-		}
-	}
+	unsigned char bits = 0;
+
+	while (prefix_table[*p] & PF_PREFIX)
+		bits |= prefix_table[*p++];
+
+	prf->shorted = !!(bits & PF_SHORTED);
+	prf->enlarged = !!(bits & PF_ENLARGED);
+	prf->rexr = !!(bits & PF_REXR);
+	prf->rex = !!(bits & PF_REX);
 
 	return (p - addr);
 }
@@ -131,56 +133,61 @@ static int get_opcode(unsigned char *addr, unsigned int *opcode)
 	return len;
 }
 
-#define CHECK_OP_TYPE(opcode, array, type) \
-	for (i = 0; i < ARRAY_SIZE(array); i++) { \
-		if (array[i] == opcode) { \
-			rv = type; \
-			goto exit; \
-		} \
+/* descriptor of an opcode as returned by get_opcode */
+static const struct opcode_desc *get_opcode_desc(unsigned int opcode)
+{
+	if (opcode > 0xFF)
+		return &opcode_table[OP_0F(opcode >> 8)];
+	return &opcode_table[opcode];
+}
+
+static unsigned int width_of(unsigned char class, struct prefix_bits *prf)
+{
+	switch (class) {
+	case W_8:
+		return 1;
+	case W_16:
+		return 2;
+	/* REX.W wins over an operand size prefix */
+	case W_16_32:
+		return (prf->shorted && !prf->enlarged) ? 2 : 4;
+	case W_16_64:
+		return prf->enlarged ? 8 : (prf->shorted ? 2 : 4);
+	default:
+		return 0;
 	}
+}
 
 enum reason_type get_ins_type(unsigned long ins_addr)
 {
 	unsigned int opcode;
 	unsigned char *p;
 	struct prefix_bits prf;
-	int i;
-	enum reason_type rv = OTHERS;
+	const struct opcode_desc *d;
 
 	p = (unsigned char *)ins_addr;
 	p += skip_prefix(p, &prf);
 	p += get_opcode(p, &opcode);
 
-	CHECK_OP_TYPE(opcode, reg_rop, REG_READ);
-	CHECK_OP_TYPE(opcode, reg_wop, REG_WRITE);
-	CHECK_OP_TYPE(opcode, imm_wop, IMM_WRITE);
-
-exit:
-	return rv;
+	d = get_opcode_desc(opcode);
+	return d->mem_width != W_NONE ? d->type : OTHERS;
 }
-#undef CHECK_OP_TYPE
 
 static unsigned int get_ins_reg_width(unsigned long ins_addr)
 {
 	unsigned int opcode;
 	unsigned char *p;
 	struct prefix_bits prf;
-	int i;
+	unsigned int width;
 
 	p = (unsigned char *)ins_addr;
 	p += skip_prefix(p, &prf);
 	p += get_opcode(p, &opcode);
 
-	for (i = 0; i < ARRAY_SIZE(rw8); i++)
-		if (rw8[i] == opcode)
-			return 1;
-
-	for (i = 0; i < ARRAY_SIZE(rw32); i++)
-		if (rw32[i] == opcode)
-			return prf.shorted ? 2 : (prf.enlarged ? 8 : 4);
-
-	printk(KERN_ERR "mmiotrace: Unknown opcode 0x%02x\n", opcode);
-	return 0;
+	width = width_of(get_opcode_desc(opcode)->reg_width, &prf);
+	if (!width)
+		printk(KERN_ERR "mmiotrace: Unknown opcode 0x%02x\n", opcode);
+	return width;
 }
 
 unsigned int get_ins_mem_width(unsigned long ins_addr)
@@ -188,30 +195,16 @@ unsigned int get_ins_mem_width(unsigned long ins_addr)
 	unsigned int opcode;
 	unsigned char *p;
 	struct prefix_bits prf;
-	int i;
+	unsigned int width;
 
 	p = (unsigned char *)ins_addr;
 	p += skip_prefix(p, &prf);
 	p += get_opcode(p, &opcode);
 
-	for (i = 0; i < ARRAY_SIZE(mw8); i++)
-		if (mw8[i] == opcode)
-			return 1;
-
-	for (i = 0; i < ARRAY_SIZE(mw16); i++)
-		if (mw16[i] == opcode)
-			return 2;
-
-	for (i = 0; i < ARRAY_SIZE(mw32); i++)
-		if (mw32[i] == opcode)
-			return prf.shorted ? 2 : 4;
-
-	for (i = 0; i < ARRAY_SIZE(mw64); i++)
-		if (mw64[i] == opcode)
-			return prf.shorted ? 2 : (prf.enlarged ? 8 : 4);
-
-	printk(KERN_ERR "mmiotrace: Unknown opcode 0x%02x\n", opcode);
-	return 0;
+	width = width_of(get_opcode_desc(opcode)->mem_width, &prf);
+	if (!width)
+		printk(KERN_ERR "mmiotrace: Unknown opcode 0x%02x\n", opcode);
+	return width;
 }
 
 /*
@@ -412,18 +405,14 @@ unsigned long get_ins_reg_val(unsigned long ins_addr, struct pt_regs *regs)
 	int reg;
 	unsigned char *p;
 	struct prefix_bits prf;
-	int i;
+	enum reason_type type;
 
 	p = (unsigned char *)ins_addr;
 	p += skip_prefix(p, &prf);
 	p += get_opcode(p, &opcode);
-	for (i = 0; i < ARRAY_SIZE(reg_rop); i++)
-		if (reg_rop[i] == opcode)
-			goto do_work;
-
-	for (i = 0; i < ARRAY_SIZE(reg_wop); i++)
-		if (reg_wop[i] == opcode)
-			goto do_work;
+	type = get_opcode_desc(opcode)->type;
+	if (type == REG_READ || type == REG_WRITE)
+		goto do_work;
 
 	printk(KERN_ERR "mmiotrace: Not a register instruction, opcode "
 							"0x%02x\n", opcode);
@@ -467,14 +456,12 @@ unsigned long get_ins_imm_val(unsigned long ins_addr)
 	unsigned char mod;
 	unsigned char *p;
 	struct prefix_bits prf;
-	int i;
 
 	p = (unsigned char *)ins_addr;
 	p += skip_prefix(p, &prf);
 	p += get_opcode(p, &opcode);
-	for (i = 0; i < ARRAY_SIZE(imm_wop); i++)
-		if (imm_wop[i] == opcode)
-			goto do_work;
+	if (get_opcode_desc(opcode)->type == IMM_WRITE)
+		goto do_work;
 
 	printk(KERN_ERR "mmiotrace: Not an immediate instruction, opcode "
 							"0x%02x\n", opcode);
@@ -484,6 +471,12 @@ do_work:
 	mod_rm = *p;
 	mod = mod_rm >> 6;
 	p++;
+	/* SIB byte follows r/m 4; SIB base 5 under mod 0 is a 32 disp */
+	if (mod != 3 && (mod_rm & 0x7) == 0x4) {
+		if (mod == 0 && (*p & 0x7) == 0x5)
+			p += 4;
+		p++;
+	}
 	switch (mod) {
 	case 0:
 		/* if r/m is 5 we have a 32 disp (IA32 Manual 3, Table 2-2)  */
@@ -515,12 +508,11 @@ do_work:
 		return *(unsigned short *)p;
 
 	case 4:
-		return *(unsigned int *)p;
-
 #ifdef __amd64__
-	case 8:
-		return *(unsigned long *)p;
+		if (prf.enlarged)
+			return (unsigned long)(long)*(int *)p;
 #endif
+		return *(unsigned int *)p;
 
 	default:
 		printk(KERN_ERR "mmiotrace: Error: width.\n");
@@ -530,8 +522,141 @@ err:
 	return 0;
 }
 
+/*
+ * Length of a MOV store to memory (register or immediate source),
+ * or 0 for any other instruction, string stores included.
+ */
+unsigned int get_ins_len(unsigned long ins_addr)
+{
+	unsigned int opcode;
+	unsigned char mod_rm;
+	unsigned char mod;
+	unsigned char *p;
+	struct prefix_bits prf;
+
+	p = (unsigned char *)ins_addr;
+	p += skip_prefix(p, &prf);
+#ifdef __i386__
+	/* 16 bit addressing uses different mod/rm forms */
+	if (memchr((void *)ins_addr, 0x67, p - (unsigned char *)ins_addr))
+		return 0;
+#endif
+	p += get_opcode(p, &opcode);
+
+	switch (opcode) {
+	case 0x88:
+	case 0x89:
+	case 0xC6:
+	case 0xC7:
+		break;
+	default:
+		return 0;
+	}
+
+	mod_rm = *p++;
+	mod = mod_rm >> 6;
+	if (mod == 3)
+		return 0;
+
+	/* SIB byte follows r/m 4; SIB base 5 under mod 0 is a 32 disp */
+	if ((mod_rm & 0x7) == 0x4) {
+		if (mod == 0 && (*p & 0x7) == 0x5)
+			p += 4;
+		p++;
+	} else if (mod == 0 && (mod_rm & 0x7) == 0x5) {
+		p += 4;
+	}
+
+	if (mod == 1)
+		p += 1;
+	else if (mod == 2)
+		p += 4;
+
+	if (opcode == 0xC6)
+		p += 1;
+	else if (opcode == 0xC7)
+		p += (prf.shorted && !prf.enlarged) ? 2 : 4;
+
+	return p - (unsigned char *)ins_addr;
+}
+
+/*
+ * Decode everything the fault path needs from an instruction at once,
+ * so that callers may cache it by address; returns 0 on success.
+ */
+int get_ins_desc(unsigned long ins_addr, struct ins_desc *desc)
+{
+	unsigned int opcode;
+	unsigned char *p;
+	struct prefix_bits prf;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->type = get_ins_type(ins_addr);
+	if (desc->type == OTHERS)
+		return -1;
+
+	p = (unsigned char *)ins_addr;
+	p += skip_prefix(p, &prf);
+	p += get_opcode(p, &opcode);
+
+	desc->mem_width = get_ins_mem_width(ins_addr);
+	desc->len = get_ins_len(ins_addr);
+	desc->rex = prf.rex;
+	if (desc->type == IMM_WRITE) {
+		desc->imm = get_ins_imm_val(ins_addr);
+		return 0;
+	}
+
+	/* for STOS, source register is fixed */
+	if (opcode == 0xAA || opcode == 0xAB)
+		desc->reg = arg_AX;
+	else
+		desc->reg = ((*p >> 3) & 0x7) | (prf.rexr << 3);
+	desc->reg_width = get_ins_reg_width(ins_addr);
+
+	return 0;
+}
+
+/*
+ * Register operand value of an instruction decoded by get_ins_desc.
+ */
+unsigned long get_ins_desc_reg_val(const struct ins_desc *desc,
+				   struct pt_regs *regs)
+{
+	unsigned char *r8;
+	unsigned long *r;
+
+	if (desc->reg_width == 1) {
+		r8 = get_reg_w8(desc->reg, desc->rex, regs);
+		return r8 ? *r8 : 0;
+	}
+
+	r = get_reg_w32(desc->reg, regs);
+	if (!r)
+		return 0;
+
+	switch (desc->reg_width) {
+	case 2:
+		return *(unsigned short *)r;
+	case 4:
+		return *(unsigned int *)r;
+#ifdef __amd64__
+	case 8:
+		return *r;
+#endif
+	default:
+		printk(KERN_ERR "mmiotrace: Error width# %d\n", desc->reg_width);
+	}
+
+	return 0;
+}
+
 #ifdef    CONFIG_NEON_FACE
 EXPORT_SYMBOL(get_ins_imm_val);
 EXPORT_SYMBOL(get_ins_type);
 EXPORT_SYMBOL(get_ins_reg_val);
+EXPORT_SYMBOL(get_ins_mem_width);
+EXPORT_SYMBOL(get_ins_len);
+EXPORT_SYMBOL(get_ins_desc);
+EXPORT_SYMBOL(get_ins_desc_reg_val);
 #endif // CONFIG_NEON_FACE
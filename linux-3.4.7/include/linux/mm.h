@@ -1643,7 +1643,11 @@ neon_follow_page(struct vm_area_struct *vma,
                  unsigned long address);
 int neon_follow_pte(struct vm_area_struct *vma,
                     unsigned long address,
-                    pte_t **ptep);
+                    pte_t **ptep,
+                    unsigned long *size);
+void neon_flush_tlb_range(struct mm_struct *mm,
+                          unsigned long start,
+                          unsigned long end);
 #endif // CONFIG_NEON_FACE
 
 #endif /* __KERNEL__ */
@@ -1606,13 +1606,36 @@ no_page_table:
 }
 
 #ifdef CONFIG_NEON_FACE
+/*
+ * The (small) page holding @address; huge (THP, hugetlbfs 2M/1G)
+ * mappings resolve to the sub-page. NULL if there is none.
+ */
 struct page *
 neon_follow_page(struct vm_area_struct *vma,
                  unsigned long address)
 {
-  return follow_page(vma, address, 0);
+  struct page *page = NULL;
+
+  page = follow_page(vma, address, 0);
+  if (IS_ERR_OR_NULL(page))
+    return NULL;
+
+  return page;
 }
 EXPORT_SYMBOL(neon_follow_page);
+
+// callers pin the mm only; its vmas may be gone by the time of the flush
+void
+neon_flush_tlb_range(struct mm_struct *mm,
+                     unsigned long start,
+                     unsigned long end)
+{
+  struct vm_area_struct vma = { .vm_mm = mm, .vm_start = start,
+                                .vm_end = end };
+
+  flush_tlb_range(&vma, start, end);
+}
+EXPORT_SYMBOL(neon_flush_tlb_range);
 #endif // CONFIG_NEON_FACE
 
 static inline int stack_guard_page(struct vm_area_struct *vma, unsigned long addr)
@@ -3750,7 +3773,8 @@ static int
 __neon_follow_pte(struct mm_struct *mm,
                   unsigned long address,
                   pte_t **ptepp,
-                  spinlock_t **ptlp)
+                  spinlock_t **ptlp,
+                  unsigned long *sizep)
 {
   pgd_t *pgd;
   pud_t *pud;
@@ -3762,17 +3786,38 @@ __neon_follow_pte(struct mm_struct *mm,
     return 1;
 
   pud = pud_offset(pgd, address);
-  if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+  if (pud_none(*pud))
+    return 2;
+
+  /* 1G hugetlbfs page: the pud is the leaf entry */
+  if (pud_huge(*pud)) {
+    *ptlp = &mm->page_table_lock;
+    spin_lock(*ptlp);
+    *ptepp = (pte_t *) pud;
+    *sizep = PUD_SIZE;
+    return 0;
+  }
+  if (unlikely(pud_bad(*pud)))
     return 2;
 
   pmd = pmd_offset(pud, address);
-  VM_BUG_ON(pmd_trans_huge(*pmd));
-  if (pmd_none(*pmd) || unlikely(pmd_bad(*pmd)))
+  if (pmd_none(*pmd))
     return 3;
 
-  /* We cannot handle huge page PFN maps. Luckily they don't exist. */
-  if (pmd_huge(*pmd))
-    return 4;
+  /* 2M hugetlbfs or transparent huge page: the pmd is the leaf entry */
+  if (pmd_huge(*pmd) || pmd_trans_huge(*pmd)) {
+    *ptlp = &mm->page_table_lock;
+    spin_lock(*ptlp);
+    if (unlikely(pmd_trans_splitting(*pmd))) {
+      spin_unlock(*ptlp);
+      return 4;
+    }
+    *ptepp = (pte_t *) pmd;
+    *sizep = PMD_SIZE;
+    return 0;
+  }
+  if (unlikely(pmd_bad(*pmd)))
+    return 3;
 
   ptep = pte_offset_map_lock(mm, pmd, address, ptlp);
   if (!ptep) {
@@ -3781,6 +3826,7 @@ __neon_follow_pte(struct mm_struct *mm,
   // Present or not, I don't care, just give me the PTE
   
   *ptepp = ptep;
+  *sizep = PAGE_SIZE;
   
   return 0;
 }
@@ -3789,13 +3835,15 @@ static inline int
 _neon_follow_pte(struct mm_struct *mm,
                  unsigned long address,
                  pte_t **ptepp,
-                 spinlock_t **ptlp)
+                 spinlock_t **ptlp,
+                 unsigned long *sizep)
 {
   int res = 0;
 
   /* (void) is needed to make gcc happy */
   (void) __cond_lock(*ptlp,
-                     !(res = __neon_follow_pte(mm, address, ptepp, ptlp)));
+                     !(res = __neon_follow_pte(mm, address,
+                                               ptepp, ptlp, sizep)));
   return res;
 }
 
@@ -3804,19 +3852,22 @@ _neon_follow_pte(struct mm_struct *mm,
  * @vma: memory mapping
  * @address: user virtual address
  * @pte: location to store found PTE
+ * @size: location to store the size mapped by the PTE
  *
- * Only IO mappings and raw PFN mappings are allowed.
+ * Huge mappings yield their leaf (pmd, or pud) entry, with @size
+ * PMD_SIZE, or PUD_SIZE, instead of PAGE_SIZE.
  *
  * Returns zero and the pfn at @pte on success, -ve otherwise.
  */
 int neon_follow_pte(struct vm_area_struct *vma,
                     unsigned long address,
-                    pte_t **ptep)
+                    pte_t **ptep,
+                    unsigned long *size)
 {
   int ret = -EINVAL;
   spinlock_t *ptl;
 
-  ret = _neon_follow_pte(vma->vm_mm, address, ptep, &ptl);
+  ret = _neon_follow_pte(vma->vm_mm, address, ptep, &ptl, size);
   if(ret) {
     (*neon_face->tweet)("cannot FOLLOW : address not found in vma_mm");
     switch(ret) {
@@ -3830,7 +3881,7 @@ int neon_follow_pte(struct vm_area_struct *vma,
       (*neon_face->tweet)("(pmd_none(*pmd) || unlikely(pmd_bad(*pmd)))");
       break;
     case 4:
-      (*neon_face->tweet)("(pmd_huge(*pmd))");
+      (*neon_face->tweet)("(pmd_trans_splitting(*pmd))");
       break;
     case 5:
       (*neon_face->tweet)("(ptep = pte_offset_map_lock(mm, pmd, address, ptlp)) == NULL");
@@ -3841,7 +3892,10 @@ int neon_follow_pte(struct vm_area_struct *vma,
     }
     return -EINVAL;
   }
-  pte_unmap_unlock(*ptep, ptl);
+  if (*size == PAGE_SIZE)
+    pte_unmap_unlock(*ptep, ptl);
+  else
+    spin_unlock(ptl);
 
   return 0;
 }
@@ -7,9 +7,11 @@
 
 #include <linux/list.h>     // lists
 #include <asm/atomic.h>     // atomics
-#include <linux/slab.h>     // kmalloc/kzalloc
+#include <linux/slab.h>     // kmem_cache
 #include <linux/sched.h>    // current
 #include <linux/vmalloc.h>  // vmalloc
+#include <linux/rbtree.h>   // map indexes
+#include <linux/timex.h>    // get_cycles
 #include "neon_help.h"
 #include "neon_core.h"
 #include "neon_control.h"
@@ -17,6 +19,34 @@
 #include "neon_track.h"
 #include "neon_sched.h"
 
+/**************************************************************************/
+// Globals
+
+char alloc_report[NEON_REPORT_LEN];
+
+// control struct caches, and their allocation statistics
+typedef struct {
+  const char        *name;
+  size_t             size;
+  struct kmem_cache *cache;
+  atomic_long_t      allocs;
+  atomic_long_t      frees;
+  atomic_long_t      failed;
+  // cycles spent allocating
+  atomic_long_t      cycles;
+} neon_obj_cache_t;
+
+static neon_obj_cache_t obj_cache[NEON_OBJS] = {
+  [NEON_OBJ_TASK]  = { .name = "neon_task",  .size = sizeof(neon_task_t)  },
+  [NEON_OBJ_CTX]   = { .name = "neon_ctx",   .size = sizeof(neon_ctx_t)   },
+  [NEON_OBJ_MAP]   = { .name = "neon_map",   .size = sizeof(neon_map_t)   },
+  [NEON_OBJ_WORK]  = { .name = "neon_work",  .size = sizeof(neon_work_t)  },
+  [NEON_OBJ_FAULT] = { .name = "neon_fault", .size = sizeof(neon_fault_t) },
+};
+
+// creation order of maps, to order maps sharing a search key
+static atomic_long_t map_seq = ATOMIC_LONG_INIT(0);
+
 /**************************************************************************/
 // neon_map_init
 /**************************************************************************/
@@ -26,14 +56,15 @@ neon_map_init(unsigned int  ctx_key,
               unsigned int  dev_key,
               unsigned int  map_key)
 {
-  neon_map_t *map = NULL;
+  neon_map_t   *map = NULL;
+  unsigned int  i   = 0;
 
   might_sleep();
 
   neon_info("ctx 0x%lx : dev 0x%lx : map 0%lx : init",
             ctx_key, dev_key, map_key);
    
-  map = (neon_map_t *) kzalloc(sizeof(neon_map_t), GFP_KERNEL);
+  map = (neon_map_t *) neon_obj_alloc(NEON_OBJ_MAP, GFP_KERNEL);
   if(map == NULL) {
     neon_error("%s : failed to init map : "
                "key 0x%lx : ctx 0x%lx dev : 0x%lx",
@@ -49,6 +80,10 @@ neon_map_init(unsigned int  ctx_key,
   map->key     = map_key;
   map->ctx_key = ctx_key;
   map->dev_key = dev_key;
+  map->seq     = atomic_long_inc_return(&map_seq);
+  for(i = 0; i < NEON_MAP_INDEXES; i++)
+    RB_CLEAR_NODE(&map->key_node[i]);
+  RB_CLEAR_NODE(&map->gpu_node);
   INIT_LIST_HEAD(&map->entry);
 
   // the rest of the map struct will be updated progressively,
@@ -69,9 +104,12 @@ neon_map_fini(neon_ctx_t * const ctx,
   int ret = 0;
 
   neon_info("ctx 0x%x : map 0x%x : fini", map->ctx_key, map->key);
+
+  // no longer to be found
+  neon_ctx_unindex_map(map);
   
   // stop memory access tracking, if not already
-  if(map->fault != NULL) {
+  if(map->page != NULL) {
     if(neon_track_stop(map) != 0) {
       neon_warning("%s:  map_key 0x%x : tracking in progress",
                    __func__, map->key);
@@ -84,6 +122,9 @@ neon_map_fini(neon_ctx_t * const ctx,
     struct list_head *pos  = NULL;
     struct list_head *q    = NULL;
     neon_work_t      *work = NULL;
+    LIST_HEAD(withdrawn);
+    // unlink under the lock, clean up (which may sleep) after it
+    spin_lock(&ctx->work_lock);
     list_for_each_safe(pos, q, &ctx->work_list.entry) {
       work = list_entry(pos, neon_work_t, entry);
       if(map == work->ir ||
@@ -95,25 +136,31 @@ neon_map_fini(neon_ctx_t * const ctx,
         /* neon_map_print(work->rb); */
         /* neon_map_print(work->cb); */
         /* neon_map_print(work->rc); */
-        neon_work_stop(work);
-        if (neon_work_fini(work) != 0) {
-          neon_warning("map 0x%lx : work @ did %d chan %d : "
-                       "pending completion notification",
-                       map->key, work->did, work->cid);
-          ret = -1;
-        }
-        list_del_init(pos);
-        kfree(work);
+        list_move(pos, &withdrawn);
       }
     }
+    spin_unlock(&ctx->work_lock);
+    list_for_each_safe(pos, q, &withdrawn) {
+      work = list_entry(pos, neon_work_t, entry);
+      list_del_init(pos);
+      // a watched-store submission may have found the work already
+      if(work->ir != NULL && work->ir->page != NULL)
+        cancel_work_sync(&work->ir->watch_submit);
+      neon_work_unring(work);
+      neon_work_stop(work);
+      if (neon_work_fini(work) != 0) {
+        neon_warning("map 0x%lx : work @ did %d chan %d : "
+                     "pending completion notification",
+                     map->key, work->did, work->cid);
+        ret = -1;
+      }
+      neon_obj_free(NEON_OBJ_WORK, work);
+    }
   }
 
-  //  free fault/page entries
-  if(map->fault != NULL) {
-    list_del_init(&map->fault->entry);
+  //  free page entries
+  if(map->page != NULL)
     neon_track_fini(map);
-    kfree(map->fault);
-  }
 
   return ret;
 }
@@ -131,11 +178,9 @@ neon_map_print(const neon_map_t * const map)
   }
     
   neon_info("map key 0x%lx : ctx 0x%lx : dev 0x%lx : "
-            "sz 0x%lx : ofs 0x%lx : gpu 0x%lx : vma @ 0x%p : fault...",
+            "sz 0x%lx : ofs 0x%lx : gpu 0x%lx : vma @ 0x%p",
             map->key, map->ctx_key, map->dev_key,
             map->size, map->offset, map->mmio_gpu, map->vma);
-  if(map->fault != NULL) 
-    neon_fault_print(map->fault);
   
   return;
 }
@@ -147,11 +192,12 @@ neon_map_print(const neon_map_t * const map)
 neon_ctx_t *
 neon_ctx_init(unsigned int id, unsigned int ctx_key)
 {
-  neon_ctx_t *ctx = NULL;
+  neon_ctx_t   *ctx = NULL;
+  unsigned int  i   = 0;
 
   neon_info("ctx 0x%x : init", ctx_key);
 
-  ctx = (neon_ctx_t *) kzalloc(sizeof(neon_ctx_t), GFP_KERNEL);
+  ctx = (neon_ctx_t *) neon_obj_alloc(NEON_OBJ_CTX, GFP_KERNEL);
   if(ctx == NULL) {
     neon_error("%s: ctx init failed", __func__);
     return NULL;
@@ -160,8 +206,14 @@ neon_ctx_init(unsigned int id, unsigned int ctx_key)
   ctx->id = id;
   ctx->key = ctx_key;
   INIT_LIST_HEAD(&ctx->map_list.entry);
+  for(i = 0; i < NEON_MAP_INDEXES; i++)
+    ctx->map_index[i] = RB_ROOT;
+  ctx->gpu_index = RB_ROOT;
+  rwlock_init(&ctx->gpu_lock);
   INIT_LIST_HEAD(&ctx->work_list.entry);
+  spin_lock_init(&ctx->work_lock);
   INIT_LIST_HEAD(&ctx->fault_list.entry);
+  spin_lock_init(&ctx->fault_lock);
   INIT_LIST_HEAD(&ctx->entry);
 
   return ctx;
@@ -191,58 +243,285 @@ neon_ctx_fini(neon_ctx_t * const ctx)
                      ctx->key, map->key);
       }
       list_del_init(pos);
-      kfree(map);
+      neon_obj_free(NEON_OBJ_MAP, map);
     }
   }
 
   return ret;
 }
 
+/***************************************************************************/
+// map_index_key
+/***************************************************************************/
+// a map's key in one of the ctx indexes; 0 if not (yet) set
+static inline unsigned long
+map_index_key(const neon_map_t * const map,
+              const neon_map_index_t idx)
+{
+  switch(idx) {
+  case MAP_BY_KEY:
+    return (unsigned long) map->key;
+  case MAP_BY_VMA:
+    return map->vma != NULL ? map->vma->vm_start : 0;
+  case MAP_BY_OFFSET:
+    return map->offset & PAGE_MASK;
+  case MAP_BY_PINNED_PAGES:
+    return (unsigned long) map->pinned_pages;
+  default:
+    return 0;
+  }
+}
+
+/***************************************************************************/
+// key_index_insert
+/***************************************************************************/
+// insert a map in one of the ctx indexes under key; maps sharing a
+// key are ordered newest (created) first, however often re-indexed
+static void
+key_index_insert(neon_ctx_t * const ctx,
+                 neon_map_t * const map,
+                 const neon_map_index_t idx,
+                 const unsigned long key)
+{
+  struct rb_node **link   = &ctx->map_index[idx].rb_node;
+  struct rb_node  *parent = NULL;
+
+  while(*link != NULL) {
+    neon_map_t *m = rb_entry(*link, neon_map_t, key_node[idx]);
+    parent = *link;
+    if(key < m->key_indexed[idx] ||
+       (key == m->key_indexed[idx] && map->seq > m->seq))
+      link = &(*link)->rb_left;
+    else
+      link = &(*link)->rb_right;
+  }
+  map->key_indexed[idx] = key;
+  rb_link_node(&map->key_node[idx], parent, link);
+  rb_insert_color(&map->key_node[idx], &ctx->map_index[idx]);
+
+  return;
+}
+
+/***************************************************************************/
+// key_index_remove
+/***************************************************************************/
+// remove a map from one of the ctx indexes, if in it
+static inline void
+key_index_remove(neon_ctx_t * const ctx,
+                 neon_map_t * const map,
+                 const neon_map_index_t idx)
+{
+  if(!RB_EMPTY_NODE(&map->key_node[idx])) {
+    rb_erase(&map->key_node[idx], &ctx->map_index[idx]);
+    RB_CLEAR_NODE(&map->key_node[idx]);
+    map->key_indexed[idx] = 0;
+  }
+
+  return;
+}
+
+/***************************************************************************/
+// gpu_before
+/***************************************************************************/
+// whether (dev_key, gpu_addr) sorts before map's gpu-view range
+static inline int
+gpu_before(const unsigned int dev_key,
+           const unsigned long gpu_addr,
+           const neon_map_t * const map)
+{
+  return (dev_key < map->dev_key ||
+          (dev_key == map->dev_key && gpu_addr < map->mmio_gpu));
+}
+
+/***************************************************************************/
+// gpu_index_update
+/***************************************************************************/
+// (re)insert a map in the ctx gpu-view range index, if its range is known
+static void
+gpu_index_update(neon_ctx_t * const ctx,
+                 neon_map_t * const map)
+{
+  struct rb_node **link   = &ctx->gpu_index.rb_node;
+  struct rb_node  *parent = NULL;
+
+  write_lock(&ctx->gpu_lock);
+  if(!RB_EMPTY_NODE(&map->gpu_node)) {
+    rb_erase(&map->gpu_node, &ctx->gpu_index);
+    RB_CLEAR_NODE(&map->gpu_node);
+  }
+  if(map->mmio_gpu != 0 && map->size != 0) {
+    while(*link != NULL) {
+      neon_map_t *m = rb_entry(*link, neon_map_t, gpu_node);
+      parent = *link;
+      if(gpu_before(map->dev_key, map->mmio_gpu, m))
+        link = &(*link)->rb_left;
+      else
+        link = &(*link)->rb_right;
+    }
+    rb_link_node(&map->gpu_node, parent, link);
+    rb_insert_color(&map->gpu_node, &ctx->gpu_index);
+  }
+  write_unlock(&ctx->gpu_lock);
+
+  return;
+}
+
+/***************************************************************************/
+// neon_ctx_search_gpu
+/***************************************************************************/
+// find the map of a device whose gpu-view range holds gpu_addr
+neon_map_t *
+neon_ctx_search_gpu(neon_ctx_t * const ctx,
+                    const unsigned int dev_key,
+                    const unsigned long gpu_addr)
+{
+  struct rb_node *node = NULL;
+  neon_map_t     *map  = NULL;
+
+  // the last range starting at or before gpu_addr is the only candidate
+  read_lock(&ctx->gpu_lock);
+  node = ctx->gpu_index.rb_node;
+  while(node != NULL) {
+    neon_map_t *m = rb_entry(node, neon_map_t, gpu_node);
+    if(gpu_before(dev_key, gpu_addr, m))
+      node = node->rb_left;
+    else {
+      map = m;
+      node = node->rb_right;
+    }
+  }
+  read_unlock(&ctx->gpu_lock);
+
+  if(map != NULL &&
+     (map->dev_key != dev_key || gpu_addr >= map->mmio_gpu + map->size))
+    map = NULL;
+
+  return map;
+}
+
+/***************************************************************************/
+// neon_ctx_index_map
+/***************************************************************************/
+// (re)index a map in the ctx indexes; to be called once the map has
+// been enlisted, and whenever one of its search keys (or its gpu-view
+// range) is updated; keys left unchanged are not touched
+void
+neon_ctx_index_map(neon_ctx_t * const ctx,
+                   neon_map_t * const map)
+{
+  unsigned long idx_key = 0;
+  unsigned int  i       = 0;
+
+  for(i = 0; i < NEON_MAP_INDEXES; i++) {
+    idx_key = map_index_key(map, i);
+    if(!RB_EMPTY_NODE(&map->key_node[i]) && map->key_indexed[i] == idx_key)
+      continue;
+    key_index_remove(ctx, map, i);
+    if(idx_key != 0)
+      key_index_insert(ctx, map, i, idx_key);
+  }
+  gpu_index_update(ctx, map);
+
+  return;
+}
+
+/***************************************************************************/
+// neon_ctx_unindex_map
+/***************************************************************************/
+// remove a map from the ctx indexes
+void
+neon_ctx_unindex_map(neon_map_t * const map)
+{
+  unsigned int i = 0;
+
+  if(map->ctx == NULL)
+    return;
+
+  for(i = 0; i < NEON_MAP_INDEXES; i++)
+    key_index_remove(map->ctx, map, i);
+
+  if(!RB_EMPTY_NODE(&map->gpu_node)) {
+    write_lock(&map->ctx->gpu_lock);
+    rb_erase(&map->gpu_node, &map->ctx->gpu_index);
+    RB_CLEAR_NODE(&map->gpu_node);
+    write_unlock(&map->ctx->gpu_lock);
+  }
+
+  return;
+}
+
 /***************************************************************************/
 // neon_ctx_search_map
 /***************************************************************************/
-// find map in ctx list
+// find map in ctx, through the index of the search key
 neon_map_t *
 neon_ctx_search_map(neon_ctx_t *ctx,
                     unsigned long arg,
                     neon_map_search_t type)
 {
-  neon_map_t *map = NULL;
-
-  if(unlikely(list_empty(&ctx->map_list.entry))) {
-    neon_debug("%s : ctx 0x%x has empty map list", __func__, ctx->key);
+  struct rb_node   *node = NULL;
+  neon_map_t       *map  = NULL;
+  neon_map_index_t  idx  = MAP_BY_KEY;
+  unsigned long     key  = arg;
+
+  switch(type) {
+  case FOR_KEY:
+    idx = MAP_BY_KEY;
+    break;
+  case FOR_VMA:
+    idx = MAP_BY_VMA;
+    break;
+  case FOR_OFFSET_PRECISE:
+  case FOR_OFFSET_ALIGNED:
+    // both indexed by the page-aligned offset
+    idx = MAP_BY_OFFSET;
+    key = arg & PAGE_MASK;
+    break;
+  case FOR_PINNED_PAGES:
+    idx = MAP_BY_PINNED_PAGES;
+    break;
+  default:
+    neon_error("search for map by type %d not supported", type);
     return NULL;
   }
 
-  list_for_each_entry(map, &ctx->map_list.entry, entry) {
-    switch(type) {
-    case FOR_KEY:
-      if((unsigned long) map->key == arg)
-        return map;
-      break;
-    case FOR_VMA:
-      if(map->vma != NULL && map->vma->vm_start == arg)
-        return map;
+  // find the first (most recently created) map with the key
+  node = ctx->map_index[idx].rb_node;
+  while(node != NULL) {
+    neon_map_t *m = rb_entry(node, neon_map_t, key_node[idx]);
+    if(key < m->key_indexed[idx])
+      node = node->rb_left;
+    else if(key > m->key_indexed[idx])
+      node = node->rb_right;
+    else {
+      map = m;
+      node = node->rb_left;
+    }
+  }
+
+  // and go over the maps sharing it
+  for(node = map != NULL ? &map->key_node[idx] : NULL;
+      node != NULL; node = rb_next(node)) {
+    map = rb_entry(node, neon_map_t, key_node[idx]);
+    if(map->key_indexed[idx] != key)
       break;
+    switch(type) {
     case FOR_OFFSET_PRECISE:
       if(map->offset == arg)
         return map;
       break;
     case FOR_OFFSET_ALIGNED:
-      if((map->offset - (map->offset % PAGE_SIZE)) == arg)
-        return map;
-      break;
-    case FOR_PINNED_PAGES:
-      if(((unsigned long) map->pinned_pages) == arg)
+      if(key == arg)
         return map;
       break;
     default:
-      neon_error("search for map by type %d not supported", type);
-      return NULL;
-      break;
+      return map;
     }
   }
 
+  neon_debug("%s : ctx 0x%x : no map for 0x%lx (type %d)",
+             __func__, ctx->key, arg, type);
+
   return NULL;
 }
 
@@ -286,7 +565,7 @@ neon_task_init(unsigned int pid)
 
   neon_info("neon task @ pid %d init", pid);
   
-  task =(neon_task_t *) kzalloc(sizeof(neon_task_t), GFP_ATOMIC);
+  task = (neon_task_t *) neon_obj_alloc(NEON_OBJ_TASK, GFP_KERNEL);
     
   if(task == NULL) {
     neon_error("%s: task init failed", __func__);    
@@ -296,8 +575,14 @@ neon_task_init(unsigned int pid)
   task->pid = pid;
   task->sharers = 0;
   task->malicious = 0;
+  task->strikes = 0;
+  task->hold_until = 0;
+  task->wdog_ts = 0;
   task->nctx = 0;
   INIT_LIST_HEAD(&task->ctx_list.entry);
+  neon_track_index_init(&task->track_index);
+  neon_decode_cache_init(&task->decode_cache);
+  neon_thread_faults_init(&task->faults);
 
   neon_debug("neon init - new GPU-accessing task %d", task->pid);
 
@@ -323,9 +608,12 @@ neon_task_fini(neon_task_t * const task)
     ctx = list_entry(pos, neon_ctx_t, entry);
     ret |= neon_ctx_fini(ctx);
     list_del_init(pos);
-    kfree(ctx);
+    neon_obj_free(NEON_OBJ_CTX, ctx);
   }
 
+  // no map left for any thread to fault on
+  neon_thread_faults_fini(&task->faults);
+
   return ret;
 }
 
@@ -369,3 +657,365 @@ neon_task_print(const neon_task_t * const neon_task)
 
   return;
 }
+
+/**************************************************************************/
+// neon_control_init
+/**************************************************************************/
+// create the control struct caches
+int
+neon_control_init(void)
+{
+  unsigned int i = 0;
+
+  might_sleep();
+
+  for(i = 0; i < NEON_OBJS; i++) {
+    neon_obj_cache_t *oc = &obj_cache[i];
+
+    atomic_long_set(&oc->allocs, 0);
+    atomic_long_set(&oc->frees, 0);
+    atomic_long_set(&oc->failed, 0);
+    atomic_long_set(&oc->cycles, 0);
+    oc->cache = kmem_cache_create(oc->name, oc->size, 0,
+                                  SLAB_HWCACHE_ALIGN, NULL);
+    if(oc->cache == NULL) {
+      neon_error("%s : create %s cache failed", __func__, oc->name);
+      neon_control_fini();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**************************************************************************/
+// neon_control_fini
+/**************************************************************************/
+// destroy the control struct caches; all objects must be gone
+void
+neon_control_fini(void)
+{
+  unsigned int i = 0;
+
+  might_sleep();
+
+  for(i = 0; i < NEON_OBJS; i++) {
+    neon_obj_cache_t *oc = &obj_cache[i];
+    long live = atomic_long_read(&oc->allocs) -
+      atomic_long_read(&oc->frees);
+
+    if(oc->cache == NULL)
+      continue;
+    if(live != 0)
+      neon_warning("%s : %ld objects still live", oc->name, live);
+    kmem_cache_destroy(oc->cache);
+    oc->cache = NULL;
+  }
+
+  return;
+}
+
+/**************************************************************************/
+// neon_obj_alloc
+/**************************************************************************/
+// allocate a (zeroed) control struct from its cache
+void *
+neon_obj_alloc(const neon_obj_t type,
+               gfp_t flags)
+{
+  neon_obj_cache_t *oc  = &obj_cache[type];
+  cycles_t          t0  = get_cycles();
+  void             *obj = NULL;
+
+  obj = kmem_cache_zalloc(oc->cache, flags);
+  atomic_long_add(get_cycles() - t0, &oc->cycles);
+  if(obj == NULL) {
+    atomic_long_inc(&oc->failed);
+    return NULL;
+  }
+  atomic_long_inc(&oc->allocs);
+
+  return obj;
+}
+
+/**************************************************************************/
+// neon_obj_free
+/**************************************************************************/
+// return a control struct to its cache
+void
+neon_obj_free(const neon_obj_t type,
+              void * const obj)
+{
+  neon_obj_cache_t *oc = &obj_cache[type];
+
+  if(obj == NULL)
+    return;
+
+  kmem_cache_free(oc->cache, obj);
+  atomic_long_inc(&oc->frees);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_alloc_report
+/**************************************************************************/
+// per-cache object size, allocations, frees, live objects and
+// cycles per allocation
+int
+neon_alloc_report(char *buf,
+                  size_t len)
+{
+  unsigned int i   = 0;
+  int          ofs = 0;
+
+  ofs += scnprintf(buf + ofs, len - ofs,
+                   "cache      objsize  allocs   frees    live  failed "
+                   "cycles/alloc\n");
+  for(i = 0; i < NEON_OBJS; i++) {
+    neon_obj_cache_t *oc     = &obj_cache[i];
+    unsigned long     allocs = atomic_long_read(&oc->allocs);
+    unsigned long     frees  = atomic_long_read(&oc->frees);
+    unsigned long     failed = atomic_long_read(&oc->failed);
+    unsigned long     cycles = atomic_long_read(&oc->cycles);
+
+    ofs += scnprintf(buf + ofs, len - ofs,
+                     "%-10s %7zu %7lu %7lu %7lu %7lu %12lu\n",
+                     oc->name, oc->size, allocs, frees, allocs - frees,
+                     failed,
+                     (allocs + failed) == 0 ? 0 : cycles / (allocs + failed));
+  }
+
+  return ofs;
+}
+
+#ifdef NEON_SELFTEST
+
+#define NEON_BENCH_MAPS    10000
+#define NEON_BENCH_LINEAR  1000  // lookups timed on the map list walk
+
+/**************************************************************************/
+// bench_search_list
+/**************************************************************************/
+// search for a map by key walking the ctx map list, as before indexing
+static neon_map_t *
+bench_search_list(neon_ctx_t * const ctx,
+                  const unsigned long key)
+{
+  neon_map_t *map = NULL;
+
+  list_for_each_entry(map, &ctx->map_list.entry, entry)
+    if(map->key == key)
+      return map;
+
+  return NULL;
+}
+
+/**************************************************************************/
+// control_bench
+/**************************************************************************/
+// time indexing, lookups (vs. the map list walk) and teardown over a
+// context of NEON_BENCH_MAPS maps; lookups go in a scattered order
+static int
+control_bench(void)
+{
+  neon_ctx_t    *ctx      = NULL;
+  neon_map_t    *map      = NULL;
+  unsigned long  i        = 0;
+  unsigned long  key      = 0;
+  unsigned long  missed   = 0;
+  cycles_t       t0       = 0;
+  cycles_t       t_index  = 0;
+  cycles_t       t_key    = 0;
+  cycles_t       t_ofs    = 0;
+  cycles_t       t_list   = 0;
+  cycles_t       t_fini   = 0;
+
+  ctx = neon_ctx_init(0, 0xbe);
+  if(ctx == NULL)
+    return -1;
+
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    map = neon_map_init(ctx->key, 0, i + 1);
+    if(map == NULL) {
+      neon_ctx_fini(ctx);
+      neon_obj_free(NEON_OBJ_CTX, ctx);
+      return -1;
+    }
+    map->ctx = ctx;
+    map->offset = (i + 1) << PAGE_SHIFT;
+    list_add(&map->entry, &ctx->map_list.entry);
+    t0 = get_cycles();
+    neon_ctx_index_map(ctx, map);
+    t_index += get_cycles() - t0;
+  }
+
+  // 7919 is prime, so i * 7919 visits every key once
+  t0 = get_cycles();
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    key = (i * 7919) % NEON_BENCH_MAPS + 1;
+    if(neon_ctx_search_map(ctx, key, FOR_KEY) == NULL)
+      missed++;
+  }
+  t_key = get_cycles() - t0;
+
+  t0 = get_cycles();
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    key = (i * 7919) % NEON_BENCH_MAPS + 1;
+    if(neon_ctx_search_map(ctx, key << PAGE_SHIFT,
+                           FOR_OFFSET_ALIGNED) == NULL)
+      missed++;
+  }
+  t_ofs = get_cycles() - t0;
+
+  t0 = get_cycles();
+  for(i = 0; i < NEON_BENCH_LINEAR; i++) {
+    key = (i * 7919) % NEON_BENCH_MAPS + 1;
+    if(bench_search_list(ctx, key) == NULL)
+      missed++;
+  }
+  t_list = get_cycles() - t0;
+
+  t0 = get_cycles();
+  neon_ctx_fini(ctx);
+  t_fini = get_cycles() - t0;
+  neon_obj_free(NEON_OBJ_CTX, ctx);
+
+  neon_report("ctx bench : %d maps : cycles/index %lu : cycles/lookup "
+              "key %lu offset %lu list-walk %lu : cycles/fini %lu",
+              NEON_BENCH_MAPS,
+              (unsigned long) t_index / NEON_BENCH_MAPS,
+              (unsigned long) t_key / NEON_BENCH_MAPS,
+              (unsigned long) t_ofs / NEON_BENCH_MAPS,
+              (unsigned long) t_list / NEON_BENCH_LINEAR,
+              (unsigned long) t_fini / NEON_BENCH_MAPS);
+
+  if(missed != 0) {
+    neon_error("%s : %lu lookups missed", __func__, missed);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**************************************************************************/
+// neon_control_selftest
+/**************************************************************************/
+// index, search, re-key and unindex a few maps of a scratch context,
+// then time the indexes on a large one; 0 on success
+int
+neon_control_selftest(void)
+{
+  struct page  *pages[1];
+  neon_ctx_t   *ctx    = NULL;
+  neon_map_t   *map[3] = { NULL, NULL, NULL };
+  unsigned int  i      = 0;
+  int           failed = 0;
+
+  ctx = neon_ctx_init(0, 0xc0);
+  if(ctx == NULL)
+    return -1;
+
+  for(i = 0; i < ARRAY_SIZE(map); i++) {
+    map[i] = neon_map_init(ctx->key, 0, i + 1);
+    if(map[i] == NULL) {
+      failed++;
+      goto neon_control_selftest_out;
+    }
+    map[i]->ctx = ctx;
+    list_add(&map[i]->entry, &ctx->map_list.entry);
+  }
+
+  // two maps sharing a page, the last one with pinned pages and a
+  // gpu-view range at the same address as the first's, on another dev
+  map[0]->offset = 0x1000;
+  map[0]->mmio_gpu = 0x100000;
+  map[0]->size = 0x1000;
+  map[1]->offset = 0x1010;
+  map[2]->offset = 0x5000;
+  map[2]->pinned_pages = pages;
+  map[2]->dev_key = 1;
+  map[2]->mmio_gpu = 0x100000;
+  map[2]->size = 0x2000;
+  for(i = 0; i < ARRAY_SIZE(map); i++)
+    neon_ctx_index_map(ctx, map[i]);
+
+  if(neon_ctx_search_map(ctx, 1, FOR_KEY) != map[0] ||
+     neon_ctx_search_map(ctx, 2, FOR_KEY) != map[1] ||
+     neon_ctx_search_map(ctx, 3, FOR_KEY) != map[2] ||
+     neon_ctx_search_map(ctx, 4, FOR_KEY) != NULL) {
+    neon_error("%s : search by key failed", __func__);
+    failed++;
+  }
+  if(neon_ctx_search_map(ctx, 0x1000, FOR_OFFSET_PRECISE) != map[0] ||
+     neon_ctx_search_map(ctx, 0x1010, FOR_OFFSET_PRECISE) != map[1] ||
+     neon_ctx_search_map(ctx, 0x1008, FOR_OFFSET_PRECISE) != NULL ||
+     neon_ctx_search_map(ctx, 0x1000, FOR_OFFSET_ALIGNED) != map[1] ||
+     neon_ctx_search_map(ctx, 0x1010, FOR_OFFSET_ALIGNED) != NULL ||
+     neon_ctx_search_map(ctx, 0x5000, FOR_OFFSET_ALIGNED) != map[2]) {
+    neon_error("%s : search by offset failed", __func__);
+    failed++;
+  }
+  if(neon_ctx_search_map(ctx, (unsigned long) pages,
+                         FOR_PINNED_PAGES) != map[2] ||
+     neon_ctx_search_map(ctx, 0x1000, FOR_VMA) != NULL) {
+    neon_error("%s : search by pinned pages/vma failed", __func__);
+    failed++;
+  }
+  if(neon_ctx_search_gpu(ctx, 0, 0x100800) != map[0] ||
+     neon_ctx_search_gpu(ctx, 0, 0x101000) != NULL ||
+     neon_ctx_search_gpu(ctx, 1, 0x101fff) != map[2] ||
+     neon_ctx_search_gpu(ctx, 1, 0x0fffff) != NULL) {
+    neon_error("%s : search by gpu address failed", __func__);
+    failed++;
+  }
+
+  // re-keyed maps are found under their new key only
+  map[1]->key = 5;
+  neon_ctx_index_map(ctx, map[1]);
+  if(neon_ctx_search_map(ctx, 2, FOR_KEY) != NULL ||
+     neon_ctx_search_map(ctx, 5, FOR_KEY) != map[1]) {
+    neon_error("%s : search after re-key failed", __func__);
+    failed++;
+  }
+
+  // a re-indexed map keeps its place behind newer maps sharing a key
+  neon_ctx_unindex_map(map[0]);
+  neon_ctx_index_map(ctx, map[0]);
+  if(neon_ctx_search_map(ctx, 0x1000, FOR_OFFSET_ALIGNED) != map[1] ||
+     neon_ctx_search_map(ctx, 0x1000, FOR_OFFSET_PRECISE) != map[0]) {
+    neon_error("%s : search after re-index failed", __func__);
+    failed++;
+  }
+
+  // unindexed maps are no longer to be found
+  neon_ctx_unindex_map(map[1]);
+  neon_ctx_unindex_map(map[0]);
+  if(neon_ctx_search_map(ctx, 5, FOR_KEY) != NULL ||
+     neon_ctx_search_map(ctx, 0x1000, FOR_OFFSET_ALIGNED) != NULL ||
+     neon_ctx_search_gpu(ctx, 0, 0x100800) != NULL ||
+     neon_ctx_search_gpu(ctx, 1, 0x100800) != map[2]) {
+    neon_error("%s : search after unindex failed", __func__);
+    failed++;
+  }
+
+ neon_control_selftest_out:
+  // maps are unindexed and freed along with the ctx
+  if(neon_ctx_fini(ctx) != 0)
+    failed++;
+  for(i = 0; i < NEON_MAP_INDEXES; i++)
+    if(!RB_EMPTY_ROOT(&ctx->map_index[i]))
+      failed++;
+  if(!RB_EMPTY_ROOT(&ctx->gpu_index))
+    failed++;
+  neon_obj_free(NEON_OBJ_CTX, ctx);
+
+  if(failed != 0) {
+    neon_error("%s : %d checks failed", __func__, failed);
+    return -1;
+  }
+
+  return control_bench();
+}
+
+#endif // NEON_SELFTEST
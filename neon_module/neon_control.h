@@ -13,6 +13,7 @@
 #include <linux/list.h>       // lists
 #include <linux/wait.h>       // waitqueue
 #include <linux/spinlock.h>   // spin and rwlocks
+#include <linux/workqueue.h>  // watched-store submissions
 #include "neon_core.h"        // dev, chan
 #include "neon_track.h"       // page_t, fault_t
 #include "neon_sched.h"       // work_t
@@ -22,6 +23,21 @@
 struct _neon_ctx_t_;    // forward
 struct _neon_task_t_;   // forward
 
+/****************************************************************************/
+// per-context map indexes, one search tree per key
+typedef enum {
+  MAP_BY_KEY,           // map key
+  MAP_BY_VMA,           // vma start
+  MAP_BY_OFFSET,        // offset, page-aligned
+  MAP_BY_PINNED_PAGES,  // pinned pages array
+  NEON_MAP_INDEXES
+} neon_map_index_t;
+
+// tracked page entries kept within the map itself; larger maps
+// (register maps spanning several pages, any map when tracing)
+// allocate theirs apart
+#define NEON_MAP_INLINE_PAGES 1
+
 /**************************************************************************/
 // identifier struct for mapped areas
 typedef struct _neon_map_t_ {
@@ -41,10 +57,39 @@ typedef struct _neon_map_t_ {
   struct vm_area_struct *vma;
   // start of locked user pages array (if any)
   struct page **pinned_pages;
-  // array of tracked page data
+  // array of tracked page data (page_inline, for small maps)
   neon_page_t *page;
-  // info for pending fault at page in this map
-  neon_fault_t *fault;
+  neon_page_t page_inline[NEON_MAP_INLINE_PAGES];
+  // back-pointer to containing context
+  struct _neon_ctx_t_ *ctx;
+  // user address of the index register (index register maps)
+  unsigned long ir_addr;
+  // write watchpoint on ir_addr, standing in for page arming (if any)
+  struct perf_event *watch;
+  // neon-task of the watching thread
+  struct _neon_task_t_ *watch_task;
+  // entry in the list of watched maps
+  struct list_head watch_entry;
+  // index register value last caught by the watchpoint (or'ed with
+  // NEON_SHADOW_SET), submitted from process context
+  unsigned long watch_idx;
+  // set if a caught store could not be decoded; the watchpoint is then
+  // given up for page arming
+  unsigned long watch_lost;
+  struct work_struct watch_submit;
+  // tracked range index this map is enlisted in (if any)
+  neon_track_index_t *index;
+  // node in the task's tracked range index
+  struct rb_node index_node;
+  // creation order, breaking ties between maps sharing a search key
+  unsigned long seq;
+  // nodes in ctx's map indexes (empty while the key is unset), and
+  // the key each is sorted by
+  struct rb_node key_node[NEON_MAP_INDEXES];
+  unsigned long key_indexed[NEON_MAP_INDEXES];
+  // node in ctx's gpu-view range index (empty until mmio_gpu and size
+  // are both known)
+  struct rb_node gpu_node;
   // entry in ctx's list of maps
   struct list_head entry;
 } neon_map_t;
@@ -58,10 +103,23 @@ typedef struct _neon_ctx_t_ {
   unsigned int key;
   // memory maps in use by this context
   neon_map_t map_list;
-  // list of fault->trap transiting mmaps
+  // the same maps, per search key; ordered by key, the most recently
+  // created first among equal keys
+  struct rb_root map_index[NEON_MAP_INDEXES];
+  // the same maps, by gpu-view range [mmio_gpu, mmio_gpu + size),
+  // ordered by (dev_key, mmio_gpu); ranges of a device never overlap
+  struct rb_root gpu_index;
+  // protect gpu_index (searched by the event kthreads)
+  rwlock_t gpu_lock;
+  // list of fault->trap transiting faults (of any thread)
   neon_fault_t fault_list;
+  // protect fault_list
+  spinlock_t fault_lock;
   // channel instances (works) in use by this context
   struct _neon_work_t_ work_list;
+  // protect work_list (walked by the fault handler, irqs off, and by
+  // watched-store submissions)
+  spinlock_t work_lock;
   // entry in task-struct context list
   struct list_head entry;
 } neon_ctx_t;
@@ -74,14 +132,43 @@ typedef struct _neon_task_t_ {
   int pid;
   // count of processes (task_struct) sharing this neon-struct
   unsigned long sharers;
-  //  if characterized malicious
+  // watchdog level (neon_watchdog_t) if characterized malicious
   unsigned int malicious;
+  // times submissions have been held by the watchdog
+  unsigned int strikes;
+  // submissions held until (jiffies)
+  unsigned long hold_until;
+  // last time (uSec) a request of the task was seen overrunning
+  unsigned long wdog_ts;
   // number of contexts
   unsigned long nctx;
   // list of contexts
   neon_ctx_t ctx_list;
+  // index of tracked map ranges over all contexts
+  neon_track_index_t track_index;
+  // decoded faulting instructions, by user ip
+  neon_decode_cache_t decode_cache;
+  // fault records of the task's threads
+  neon_thread_faults_t faults;
 } neon_task_t;
 
+/****************************************************************************/
+// control structs allocated from caches of their own
+typedef enum {
+  NEON_OBJ_TASK,
+  NEON_OBJ_CTX,
+  NEON_OBJ_MAP,
+  NEON_OBJ_WORK,
+  NEON_OBJ_FAULT,
+  NEON_OBJS
+} neon_obj_t;
+
+extern char alloc_report[NEON_REPORT_LEN];
+
+// sysctl/proc managed options
+#define NEON_ALLOC_REPORT_KNOB                                  \
+  NEON_REPORT_KNOB("alloc_stats", alloc_report, neon_alloc_report)
+
 /****************************************************************************/
 // to define search approach
 typedef enum {
@@ -104,6 +191,12 @@ void          neon_map_print(const neon_map_t * const map);
 neon_ctx_t*   neon_ctx_init(unsigned int id, unsigned int ctx_key);
 int           neon_ctx_fini(neon_ctx_t * const ctx);
 void          neon_ctx_print(const neon_ctx_t * const ctx);
+void          neon_ctx_index_map(neon_ctx_t * const ctx,
+                                 neon_map_t * const map);
+void          neon_ctx_unindex_map(neon_map_t * const map);
+neon_map_t*   neon_ctx_search_gpu(neon_ctx_t * const ctx,
+                                  const unsigned int dev_key,
+                                  const unsigned long gpu_addr);
 neon_map_t*   neon_ctx_search_map(neon_ctx_t *ctx,
                                   unsigned long arg,
                                   neon_map_search_t type);
@@ -114,4 +207,14 @@ void          neon_task_print(const neon_task_t * const neon_task);
 neon_ctx_t*   neon_task_search_ctx(neon_task_t *task,
                                    unsigned int ctx_key);
 
+int           neon_control_init(void);
+void          neon_control_fini(void);
+void*         neon_obj_alloc(const neon_obj_t type, gfp_t flags);
+void          neon_obj_free(const neon_obj_t type, void * const obj);
+int           neon_alloc_report(char *buf, size_t len);
+
+#ifdef NEON_SELFTEST
+int           neon_control_selftest(void);
+#endif // NEON_SELFTEST
+
 #endif  // __NEON_CONTROL_H__
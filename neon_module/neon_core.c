@@ -8,6 +8,7 @@
 #include <linux/list.h>     // lists
 #include <linux/spinlock.h> // lock/unlock
 #include <linux/slab.h>     // kmalloc/kzalloc
+#include <linux/pci.h>      // pci_get_device
 #include <asm/io.h>         // ioremap
 #include <nv.h>             // nvidia module
 #include "neon_help.h"
@@ -36,6 +37,7 @@ neon_chan_init(neon_dev_t * const dev,
   chan->refc_kvaddr = 0;
   chan->refc_target = 0;
   chan->pdt         = 0;
+  seqcount_init(&chan->seq);
   spin_lock_init(&chan->lock);
 
   neon_debug("did %d : cid %d : ir p 0x%lx --> kv 0x%p",
@@ -87,6 +89,27 @@ neon_chan_print(const neon_chan_t * const chan)
   return;
 }
 
+/**************************************************************************/
+// neon_dev_node
+/**************************************************************************/
+// find the NUMA node of the (NVIDIA) PCI device behind bar0
+static int
+neon_dev_node(const unsigned long bar0_addr)
+{
+  struct pci_dev *pdev = NULL;
+  int             node = -1;
+
+  while((pdev = pci_get_device(NVIDIA_VENDOR, PCI_ANY_ID, pdev)) != NULL) {
+    if(pci_resource_start(pdev, 0) == bar0_addr) {
+      node = dev_to_node(&pdev->dev);
+      pci_dev_put(pdev);
+      break;
+    }
+  }
+
+  return node;
+}
+
 /**************************************************************************/
 // neon_dev_init
 /**************************************************************************/
@@ -107,6 +130,7 @@ neon_dev_init(unsigned int id,
   might_sleep();
 
   dev->id = id;
+  dev->node = neon_dev_node(bar0_addr);
   spin_lock_init(&dev->lock);
 
   // the number of channels for every device is a feature
@@ -177,8 +201,9 @@ neon_dev_init(unsigned int id,
   }
 
   neon_info("init dev : id %x : VDS 0x%x/0x%x/0x%x : "
-            "bar0 @ 0x%lx : bar1 @ 0x%lx ",
-            vendor_id, device_id, subsystem_id, bar0_addr, bar1_addr);
+            "bar0 @ 0x%lx : bar1 @ 0x%lx : node %d",
+            vendor_id, device_id, subsystem_id, bar0_addr, bar1_addr,
+            dev->node);
 
   return 0;
 }
@@ -10,6 +10,7 @@
 
 #include <linux/list.h>      // lists
 #include <linux/spinlock.h>  // spin and rwlocks
+#include <linux/seqlock.h>   // seqcount
 #include <linux/kthread.h>   // kthread
 
 /****************************************************************************/
@@ -31,6 +32,9 @@ typedef struct {
   unsigned long refc_target;
   // tics this channel has been occupied processing
   unsigned long pdt;
+  // publishes (pid, refc_kvaddr, refc_target) to lock-free readers;
+  // writers must also hold lock
+  seqcount_t seq;
   // protect this struct
   spinlock_t lock;
 } neon_chan_t;
@@ -40,6 +44,8 @@ typedef struct {
 typedef struct _neon_dev_t_ {
   // index of associated device
   unsigned int id;
+  // NUMA node the device is attached to (-1 if unknown)
+  int node;
   // base address of range in which to expect index register mappings
   unsigned long reg_base;
   // offset at which to find registers in area starting at reg_base
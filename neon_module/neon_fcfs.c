@@ -38,7 +38,10 @@ static void issue_fcfs(sched_dev_t  * const sched_dev,
 static void complete_fcfs(sched_dev_t  * const sched_dev,
                           sched_work_t * const sched_work,
                           sched_task_t * const sched_task);
-static void event_fcfs(void);
+static void complete_batch_fcfs(sched_dev_t  * const sched_dev,
+                                const long * const bmp,
+                                sched_task_t ** const sched_task);
+static void event_fcfs(sched_dev_t * const sched_dev);
 static int  reengage_map_fcfs(const neon_map_t * const neon_map);
 
 neon_policy_face_t neon_policy_fcfs = {
@@ -52,8 +55,10 @@ neon_policy_face_t neon_policy_fcfs = {
   .submit = submit_fcfs,
   .issue = issue_fcfs,
   .complete = complete_fcfs,
+  .complete_batch = complete_batch_fcfs,
   .event = event_fcfs,
-  .reengage_map = reengage_map_fcfs
+  .reengage_map = reengage_map_fcfs,
+  .nonblocking = 1
 };
 
 /**************************************************************************/
@@ -216,12 +221,27 @@ complete_fcfs(sched_dev_t  * const sched_dev,
   return;
 }
 
+/**************************************************************************/
+// complete_batch_fcfs
+/**************************************************************************/
+// mark completion of a set of GPU requests; FCFS keeps no state
+static void
+complete_batch_fcfs(sched_dev_t  * const sched_dev,
+                    const long * const bmp,
+                    sched_task_t ** const sched_task)
+{
+  neon_info("did %d : bmp 0x%lx : complete FCFS (batch)",
+            sched_dev->id, bmp[0]);
+
+  return;
+}
+
 /**************************************************************************/
 // event_fcfs
 /**************************************************************************/
 // asynchronous event handler
 static void
-event_fcfs(void)
+event_fcfs(sched_dev_t * const sched_dev)
 {
   // fcfs never creates asynchronous events
   return;
@@ -10,6 +10,8 @@
 #include <stdarg.h>            // va_list
 #include <trace/events/neon.h> // trace event
 #include <linux/ktime.h>       // ktime
+#include <linux/mutex.h>       // report lock
+#include <linux/sysctl.h>      // proc_dostring
 #include "neon_help.h"
 //#include "neon_track.h"
 
@@ -51,3 +53,31 @@ neon_note(const char *fmt, ...)
 
   return 1;
 }
+
+/**************************************************************************/
+// neon_report_handler
+/**************************************************************************/
+// Read-only proc handler; refresh the report when read from the start
+// and hand it over to proc_dostring
+int
+neon_report_handler(ctl_table *table,
+                    int write,
+                    void __user *buffer,
+                    size_t *lenp,
+                    loff_t *ppos)
+{
+  static DEFINE_MUTEX(report_lock);
+  neon_report_fill_t fill = (neon_report_fill_t) table->extra1;
+  int ret = 0;
+
+  if(write != 0)
+    return -EPERM;
+
+  mutex_lock(&report_lock);
+  if(fill != NULL && *ppos == 0)
+    (*fill)((char *) table->data, table->maxlen);
+  ret = proc_dostring(table, write, buffer, lenp, ppos);
+  mutex_unlock(&report_lock);
+
+  return ret;
+}
@@ -9,6 +9,7 @@
 #define __NEON_HELP_H__
 
 #include <linux/printk.h>      // pr_
+#include <linux/sysctl.h>      // ctl_table
 #include <stdarg.h>            // va_list
 
 /***************************************************************************/
@@ -28,6 +29,26 @@
 // NOTE: use neon_note_ts's DEBUG-enabled wrappers
 int neon_note(const char *fmt, ...); // a neon_help function
 
+/***************************************************************************/
+// Read-only sysctl/proc reports; the knob's extra1 points to a fill
+// function formatting the report in the knob's data buffer
+#define NEON_REPORT_LEN 2048
+
+typedef int (*neon_report_fill_t)(char *buf, size_t len);
+
+int neon_report_handler(ctl_table *table, int write,
+                        void __user *buffer, size_t *lenp,
+                        loff_t *ppos);
+
+#define NEON_REPORT_KNOB(name, buf, fill) {     \
+    .procname = name,                           \
+      .data = buf,                              \
+      .maxlen = NEON_REPORT_LEN,                \
+      .mode = 0444,                             \
+      .proc_handler = &neon_report_handler,     \
+      .extra1 = fill,                           \
+      }
+
 /***************************************************************************/
 // Debugging verbosity control
 // Level 0 --> 5 : errors only --> verbose
@@ -12,6 +12,7 @@
 #include <linux/kdebug.h>    // unregister_die_notifier
 #include <linux/semaphore.h> // down
 #include <linux/wait.h>      // waitqueue
+#include <linux/string.h>    // memset
 #include <neon/neon_face.h>  // neon interface
 #include "neon_help.h"
 #include "neon_core.h"
@@ -19,6 +20,7 @@
 #include "neon_sys.h"
 #include "neon_track.h"
 #include "neon_sched.h"
+#include "neon_policy.h"
 #include "neon_ui.h"
 
 /****************************************************************************/
@@ -176,17 +178,28 @@ neon_map_pages(struct vm_area_struct *vma,
   // update map
   map->vma = vma;
   map->size = size;
+  neon_ctx_index_map(ctx, map);
 
 #ifndef NEON_TRACE_REPORT
-  // track acceses only to index registers ; enough for scheduling
+  // track acceses only to index register maps, whatever their size
+  // (the register sits on one of their pages); enough for scheduling
   if(work != NULL) {
 #endif // !NEON_TRACE_REPORT
     if(neon_track_init(map) != 0) {
       neon_error("%s : cannot init tracking for map 0x%x",
                  __func__, map->key);
       return -1;
-    } else
-      ret = neon_track_start(map);
+    } else {
+#ifndef NEON_TRACE_REPORT
+      // the channel's index register, same as neon_chan_init's
+      neon_dev_t    *dev      = &neon_global.dev[work->did];
+      unsigned long  ir_paddr = dev->reg_base + work->cid * dev->reg_ofs + \
+        NEON_RB_PAGEOFS;
+      neon_track_focus(map, vma->vm_start + ir_paddr -
+                       (map->offset & PAGE_MASK));
+#endif // !NEON_TRACE_REPORT
+      ret = neon_track_start(map, &neon_task->track_index);
+    }
 #ifndef NEON_TRACE_REPORT
   }
 #endif // !NEON_TRACE_REPORT
@@ -197,7 +210,9 @@ neon_map_pages(struct vm_area_struct *vma,
   }
 
   if(work != NULL) {
+    spin_lock(&ctx->work_lock);
     list_add(&work->entry, &ctx->work_list.entry);
+    spin_unlock(&ctx->work_lock);
     if(neon_work_start(work) != 0) {
       neon_error("%s : cannot start work related to map 0x%x",
                  __func__, map->key);
@@ -265,6 +280,7 @@ neon_pin_pages(void *user_address,
   map->size = nr_pages * PAGE_SIZE;
   map->pinned_pages = pinned_pages;
   map->offset = 0; // tells pinned areas from mmapped areas
+  neon_ctx_index_map(ctx, map);
 
   // Pinned vmas might be mapped in chunks --- 5 pages has been observed to
   // be a common sub-vma-size requested to be pinned. Tracking R/W to these areas,
@@ -291,7 +307,7 @@ neon_pin_pages(void *user_address,
   // don't track non-vm_start-aligned areas (extra work for mapping accesses
   // to those deemed unnecessary, given that values have been observed to be
   // always 0 when tracked [observed only 5-page maps]).
-  if(vmaofs == 0 && neon_track_start(map) != 0) {
+  if(vmaofs == 0 && neon_track_start(map, &neon_task->track_index) != 0) {
     neon_error("%s : cannot start tracking on map 0x%lx", map->key);
     return -1;
   }
@@ -359,7 +375,7 @@ neon_unpin_pages(struct page **pinned_pages,
   }
 
   list_del_init(&map->entry);
-  kfree(map);
+  neon_obj_free(NEON_OBJ_MAP, map);
 
   return 0;
 }
@@ -390,6 +406,11 @@ neon_unmap_vma(struct vm_area_struct *vma)
   neon_debug("TRY unmap_vma : vma 0x%p --> start 0x%lx",
              vma, (vma != NULL) ? vma->vm_start : 0);
 
+  // code going away (munmap, exec) takes its decoded instructions along
+  if(vma->vm_flags & VM_EXEC)
+    neon_decode_cache_flush(&neon_task->decode_cache,
+                            vma->vm_start, vma->vm_end);
+
   // find map entry to remove
   list_for_each_entry(ctx, &neon_task->ctx_list.entry, entry) {
     map = neon_ctx_search_map(ctx, vma->vm_start, FOR_VMA);
@@ -414,7 +435,7 @@ neon_unmap_vma(struct vm_area_struct *vma)
               map->ctx_key, map->dev_key, map->key);
 
   list_del_init(&map->entry);
-  kfree(map);
+  neon_obj_free(NEON_OBJ_MAP, map);
 
   return;
 }
@@ -437,6 +458,7 @@ neon_fault_handler(struct pt_regs *regs,
   unsigned long         fault_pidx = 0;
   neon_page_t          *fault_page = NULL;
   neon_fault_t         *fault      = NULL;
+  neon_fault_t          first;
   neon_work_t          *work       = NULL;
   int                   ret        = 0;
 
@@ -449,96 +471,137 @@ neon_fault_handler(struct pt_regs *regs,
 
   preempt_disable();
 
-  // use the faulting address to find where (ctx, dev, map) it belongs
-  if(unlikely(!list_empty(&neon_task->ctx_list.entry))) {
-    neon_ctx_t *ctx = NULL;
-    list_for_each_entry(ctx, &neon_task->ctx_list.entry, entry) {
-      neon_map_t *map = NULL;
-      // find the exact map and page concering this fault
-      list_for_each_entry(map, &ctx->map_list.entry, entry) {
-        // find the exact map and page concering this fault
-        // careful : list of maps might contain uncomissioed maps
-        if(map->vma != NULL &&
-           addr >= map->vma->vm_start &&
-           addr <  (map->vma->vm_start + map->size)) {
-          fault_ctx  = ctx;
-          fault_map  = map;
-          fault_pidx = (addr - map->vma->vm_start) / PAGE_SIZE;
-          fault_page = &map->page[fault_pidx];
-          fault = map->fault;
-          break;
-        }
-      }
-    }
+  // use the faulting address to find where (ctx, dev, map) it belongs;
+  // only tracked maps can fault on our behalf, and those are indexed
+  fault_map = neon_track_lookup(&neon_task->track_index, addr);
+  if(fault_map != NULL) {
+    fault_ctx  = fault_map->ctx;
+    fault_pidx = (addr - fault_map->vma->vm_start) / PAGE_SIZE;
+    fault_page = &fault_map->page[fault_pidx];
   }
-  if(fault == NULL) {
+  if(fault_map == NULL || fault_page->skip != 0) {
     // if no fault info is found, it's because it's not on an addr we track
-    // let the regular fault-handler's code path manage this
+    // (nor is a page we leave present); let the regular fault-handler's
+    // code path manage this
     ret = 1;
     goto fault_handler_end;
   }
 
+  // each thread faults on (and single-steps with) its own record; a
+  // thread's first fault is decoded on the stack, and only gets a
+  // record once it is known to need one (single-stepping)
+  fault = neon_thread_fault(&neon_task->faults, cpu_task->pid, NULL);
+  if(fault == NULL) {
+    memset(&first, 0, sizeof(first));
+    INIT_LIST_HEAD(&first.entry);
+    fault = &first;
+  }
+
   neon_debug("TRY new fault @ 0x%lx", addr);
 
-  // check whether the faulting address has been seen before
-  if(likely(!list_empty(&fault_ctx->fault_list.entry))) {
-    neon_fault_t *f = NULL;
-    list_for_each_entry(f, &fault_ctx->fault_list.entry, entry) {
-      if(f == fault) {
-        neon_warning("fault : ctx 0x%lx : map 0x%lx : page %d : "
-                     "addr 0x%lx : ip 0x%lx : vs ...",
-                     fault_ctx->key, fault_map->key, fault->page_num,
-                     addr, instruction_pointer(regs));
-        neon_fault_print(fault_map->fault);
-        if(fault->addr == addr) {
-          // if the exact same address has been seen before, this
-          // must be a real fault
-          neon_error("%s : fault : ADDR 0x%lx hit ,recursively",
-                     __func__, addr);
-          ret = 1;
-        } else {
-          // to our experience, this will happen on values most likely
-          // sitting on page boundaries, and tends to be realized only
-          // with heavy logging enabled; try to deal with this by
-          // skipping one of two faults
-          neon_warning("fault : MAP 0x%x hit recursively", fault_map->key);
-          neon_page_arming(0, fault_page);
-          fault->siamese = fault_pidx;
-          ret = 0;
-        }
-        goto fault_handler_end;
-      }
+  // check whether this thread faults again before its trap
+  if(unlikely(!list_empty(&fault->entry))) {
+    neon_warning("fault : ctx 0x%lx : map 0x%lx : page %d : "
+                 "addr 0x%lx : ip 0x%lx : vs ...",
+                 fault_ctx->key, fault_map->key, fault->page_num,
+                 addr, instruction_pointer(regs));
+    neon_fault_print(fault);
+    if(fault->addr == addr || fault->map != fault_map) {
+      // if the exact same address has been seen before, this
+      // must be a real fault
+      neon_error("%s : fault : ADDR 0x%lx hit ,recursively",
+                 __func__, addr);
+      ret = 1;
+    } else {
+      // to our experience, this will happen on values most likely
+      // sitting on page boundaries, and tends to be realized only
+      // with heavy logging enabled; try to deal with this by
+      // skipping one of two faults
+      neon_warning("fault : MAP 0x%x hit recursively", fault_map->key);
+      neon_page_arming(0, fault_page);
+      fault->siamese = fault_pidx;
+      ret = 0;
     }
+    goto fault_handler_end;
   }
 
   // decode and save fault info
-  neon_fault_save_decode(regs, addr, fault_map, fault_pidx, fault);
+  neon_fault_save_decode(regs, addr, fault_map, fault_pidx,
+                         &neon_task->decode_cache, fault);
+
+  // reads reach the register on write-only armed pages; a read fault
+  // there came through a stale translation, dropped by the fault itself
+  if(fault->op == 'R' && fault_page->armed != 0 &&
+     fault_page->mask == _PAGE_RW) {
+    fault->addr = 0;
+    goto fault_handler_end;
+  }
 
   // check whether fault concerns index register access
   // if yes, this will be a new work submit request
   if(fault->op == 'W' && fault_map->offset != 0 && fault_map->mmio_gpu == 0) {
     neon_work_t *w    = NULL;
     // check whether write concerns index register
+    spin_lock(&fault_ctx->work_lock);
     list_for_each_entry(w, &fault_ctx->work_list.entry, entry) {
       if(w->ir == fault_map) {
         work = w;
         break;
       }
     }
+    spin_unlock(&fault_ctx->work_lock);
   }
-  // save fault in fault-list
-  list_add(&fault->entry, &fault_ctx->fault_list.entry);
+  neon_track_account(fault_page, work != NULL);
 
-  // write-fault is on index register, manage associated work
 #ifndef NEON_TRACE_REPORT
+  // a plain store to the index register is performed here, on the
+  // kernel alias; the page stays armed and no trap follows
   if(work != NULL) {
-    ret = neon_work_update(fault_ctx, work, fault->val);
-    if(ret != 0) {
-      neon_error("%s : work update failure \n", __func__);
-      ret = -1;
+    neon_chan_t  *chan    = &neon_global.dev[work->did].chan[work->cid];
+    unsigned int  emulate = neon_fault_emulable(fault);
+    if(emulate != 0) {
+      const u32           val     = (u32) fault->val;
+      const unsigned long ip_next = fault->ip + emulate;
+      fault->addr = 0;
+      preempt_enable_no_resched();
+      // ring later, from the shadow value; policies keep the page
+      // armed while the ring is in flight, so no store overtakes it
+      if(submit_defer != 0 &&
+         neon_policy_ring_defer(work, fault_page, val) == 0) {
+        regs->ip = ip_next;
+        return 0;
+      }
+      neon_work_defer(work, val);
+      neon_work_submit(work, 1);
+      neon_fault_emulate(regs, chan->ir_kvaddr, val, ip_next);
+      // honor the scheduler as the trap handler would
+      if(neon_sched_reengage(fault_map) == 0)
+        neon_page_arming(0, fault_page);
+      return 0;
+    }
+  }
+#endif // !NEON_TRACE_REPORT
+
+  if(fault == &first) {
+    fault = neon_thread_fault(&neon_task->faults, cpu_task->pid, &first);
+    if(fault == NULL) {
+      ret = 1;
       goto fault_handler_end;
     }
   }
+
+  // save fault in fault-list, and for the upcoming trap on this cpu
+  spin_lock(&fault_ctx->fault_lock);
+  list_add(&fault->entry, &fault_ctx->fault_list.entry);
+  spin_unlock(&fault_ctx->fault_lock);
+  neon_fault_stash(fault);
+
+  // write-fault is on index register, manage associated work
+#ifndef NEON_TRACE_REPORT
+  // only record the index register value here; the refc address and
+  // target are resolved by the device's event kthread
+  if(work != NULL)
+    neon_work_defer(work, fault->val);
 #endif // !NEON_TRACE_REPORT
 
   // Flags suggested  by linux kernel's kmmio module with equivalent
@@ -607,6 +670,10 @@ neon_copy_task(unsigned long clone_flags,
  copy_task_end :
   write_unlock(&cpu_task->neon_task_rwlock);
 
+  // watchpoints only cover the thread that set them
+  if(neon_task != NULL && (clone_flags & CLONE_VM))
+    neon_track_unwatch(neon_task);
+
   return 0;
 }
 
@@ -619,6 +686,7 @@ static void
 neon_exit_task(struct task_struct *cpu_task)
 {
   neon_task_t  *neon_task = NULL;
+  unsigned long nctx      = 0;
   unsigned int  ctx_live  = 0;
 
   // if the task does not hold a neon-task, nothing to do here
@@ -628,6 +696,9 @@ neon_exit_task(struct task_struct *cpu_task)
 
   write_lock(&cpu_task->neon_task_rwlock);
 
+  // the thread's fault record goes with it
+  neon_thread_fault_drop(&neon_task->faults, cpu_task);
+
   // one less process in the family sharing this neon-task
   // if this was NOT the last task-struct associated with this
   // neon-task, just return --- task content will be cleaned up
@@ -639,21 +710,22 @@ neon_exit_task(struct task_struct *cpu_task)
     return;
   }
 
-  // clean up this task
+  // detach, then clean up this task unlocked; the rest of the family
+  // is gone, and work fini may sleep (waiting on the event kthread's
+  // refc resolution)
+  cpu_task->neon_task = NULL;
+  write_unlock(&cpu_task->neon_task_rwlock);
+
+  nctx = neon_task->nctx;
   if(neon_task_fini(neon_task) < 0) {
-    write_unlock_irq(&cpu_task->neon_task_rwlock);
     neon_error("%s : failed to fini", __func__);
     return;
   }
-
-  cpu_task->neon_task = NULL;
-  kfree(neon_task);
-
-  write_unlock_irq(&cpu_task->neon_task_rwlock);
+  neon_obj_free(NEON_OBJ_TASK, neon_task);
 
   // main task exiting, sharers == 0;
   // update the (global) value of live contexts appropriately
-  ctx_live = atomic_sub_return(neon_task->nctx, &neon_global.ctx_live);
+  ctx_live = atomic_sub_return(nctx, &neon_global.ctx_live);
   if(ctx_live == 0) {
     unregister_die_notifier(&nb_die);
     neon_sched_reset(0);
@@ -710,6 +782,25 @@ __init neon_init(void)
     return -1;
   }
 
+  // control struct caches, before any struct is allocated
+  if(neon_control_init() != 0) {
+    neon_error("%s: module init - failed to init control caches",
+               __func__);
+    return -1;
+  }
+
+#ifdef NEON_SELFTEST
+  // check the fault decoder, the fault hand-off and the map indexes
+  // before any use, and time the poller's lock-free paths
+  if(neon_track_selftest() != 0 || neon_control_selftest() != 0 ||
+     neon_sched_selftest() != 0) {
+    neon_error("%s: module init - self-test failed", __func__);
+    neon_control_fini();
+    return -1;
+  }
+  neon_info("module init - self-test passed");
+#endif // NEON_SELFTEST
+
   // register NEON interface (replace kernel-resident dummy calls
   // with current module's calls)
   if(neon_face_register(&neon_face_minimal) != 0) {
@@ -775,6 +866,9 @@ __exit neon_exit(void)
     goto neon_exit_fail;
   }
 
+  // all control structs are gone with the tasks
+  neon_control_fini();
+
   neon_info("module exit - module unloaded successfully");
   return;
 
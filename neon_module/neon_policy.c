@@ -72,6 +72,8 @@ create_sched_task(unsigned int did,
     return NULL;
   }
 
+  neon_track_batch_init(&sched_task->rearm);
+  INIT_LIST_HEAD(&sched_task->rearm_entry);
   INIT_LIST_HEAD(&sched_task->entry);
 
   select_policy->create(sched_task);
@@ -88,12 +90,30 @@ destroy_sched_task(sched_task_t *sched_task)
 {
   select_policy->destroy(sched_task);
 
+  // no use shooting down the pages of a task leaving the device
+  list_del_init(&sched_task->rearm_entry);
+  neon_track_batch_drop(&sched_task->rearm);
+
   kfree(sched_task->bmp_issue2comp);
   kfree(sched_task->bmp_start2stop);
 
   return;
 }
 
+/**************************************************************************/
+// rearm_kick
+/**************************************************************************/
+// have the event kthread shoot down pages a policy callback armed;
+// called after the sched-dev lock is dropped, possibly with irqs off
+static inline void
+rearm_kick(sched_dev_t * const sched_dev)
+{
+  if(!list_empty(&sched_dev->rearm_list))
+    neon_sched_wake(sched_dev->id);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_policy_init
 /**************************************************************************/
@@ -121,7 +141,14 @@ neon_policy_init(void)
       neon_error("%s : sched chan-array alloc failed! ",  __func__);
       goto policy_init_fail;
     } // sched-work ids will be reset at sched-work start time
+    sched_dev->stask_batch = kzalloc(nchan * sizeof(sched_task_t *),
+                                     GFP_KERNEL);
+    if(sched_dev->stask_batch == NULL) {
+      neon_error("%s : sched batch-array alloc failed! ",  __func__);
+      goto policy_init_fail;
+    }
     INIT_LIST_HEAD(&sched_dev->stask_list.entry);
+    INIT_LIST_HEAD(&sched_dev->rearm_list);
     rwlock_init(&sched_dev->lock);
   }
 
@@ -143,6 +170,7 @@ neon_policy_init(void)
       sched_dev_t *sched_dev = &sched_dev_array[i];
       if(sched_dev->swork_array != NULL)
         kfree(sched_dev->swork_array);
+      kfree(sched_dev->stask_batch);
     }
   }
   kfree(sched_dev_array);
@@ -181,6 +209,7 @@ neon_policy_fini(void)
       ret = -1;
     }
     kfree(sched_dev->swork_array);
+    kfree(sched_dev->stask_batch);
   }
   kfree(sched_dev_array);
   sched_dev_array = NULL;
@@ -218,6 +247,9 @@ neon_policy_reset(unsigned int nctx)
         select_policy->fini();
       select_policy = policy_face[policy_id];
       select_policy->init();
+      // watches stand in for arming only under a non-blocking policy
+      if(neon_policy_nonblocking() == 0)
+        neon_track_unwatch(NULL);
       neon_info("policy reset: new policy is \"%s\", nctx = %d",
                 _policy_name_, nctx);
     }
@@ -280,6 +312,7 @@ neon_policy_start(neon_work_t * const neon_work)
   set_bit(cid, sched_task->bmp_start2stop);
   neon_info("did %d : cid %d : pid %d : policy start", did, cid, pid);
   write_unlock(&sched_dev->lock);
+  rearm_kick(sched_dev);
 
   return 0;
 }
@@ -352,6 +385,7 @@ neon_policy_stop(const neon_work_t * const neon_work)
   }
 
   write_unlock(&sched_dev->lock);
+  rearm_kick(sched_dev);
 
   return 0;
 }
@@ -426,6 +460,7 @@ neon_policy_submit(const neon_work_t * const neon_work)
 #endif // NEON_USE_SAMPLING
 
   write_unlock(&sched_dev->lock);
+  rearm_kick(sched_dev);
 
   return 0;
 }
@@ -481,6 +516,58 @@ neon_policy_issue(sched_dev_t  * const sched_dev,
   return 0;
 }
 
+/**************************************************************************/
+// find_sched_task
+/**************************************************************************/
+// find the sched-task of pid in the device's task list; caller
+// holds sched_dev->lock
+static inline sched_task_t *
+find_sched_task(sched_dev_t * const sched_dev,
+                const unsigned int pid)
+{
+  sched_task_t *stask = NULL;
+
+  list_for_each_entry(stask, &sched_dev->stask_list.entry, entry)
+    if(stask->pid == pid)
+      return stask;
+
+  return NULL;
+}
+
+/**************************************************************************/
+// complete_account
+/**************************************************************************/
+// account a completed work's execution time as of complete_ts;
+// returns the time (uSec) added
+static unsigned long
+complete_account(sched_work_t * const sched_work,
+                 sched_task_t * const sched_task,
+                 const struct timespec * const complete_ts)
+{
+  unsigned long exe_dt = 0;
+
+  if(test_bit(sched_work->id, sched_task->bmp_issue2comp) != 0) {
+    struct timespec dtime = timespec_sub(*complete_ts, sched_work->issue_ts);
+    exe_dt = (unsigned long) (timespec_to_ns(&dtime) / NSEC_PER_USEC);
+    neon_debug("cid %d : exe %ld : total %ld : "
+               "tasknrqst %ld : uninterrupted issue2complete",
+               sched_work->id, exe_dt, sched_task->exe_dt,
+               sched_task->nrqst);
+    clear_bit(sched_work->id, sched_task->bmp_issue2comp);
+    // update the channel's running request-duration estimate
+    if(sched_work->pred_dt == 0)
+      sched_work->pred_dt = exe_dt;
+    else
+      sched_work->pred_dt += ((long) exe_dt - (long) sched_work->pred_dt) \
+        >> NEON_PREDICT_WEIGHT;
+  }
+  sched_work->exe_dt += exe_dt;
+  sched_task->exe_dt += sched_work->exe_dt;
+  sched_task->wait_dt += sched_work->wait_dt;
+
+  return exe_dt;
+}
+
 /**************************************************************************/
 // neon_policy_complete
 /**************************************************************************/
@@ -493,17 +580,12 @@ neon_policy_complete(unsigned int did,
   sched_dev_t     *sched_dev   = &sched_dev_array[did];
   sched_work_t    *sched_work  = &sched_dev->swork_array[cid];
   sched_task_t    *sched_task  = NULL;
-  sched_task_t    *stask       = NULL;
+  struct timespec  complete_ts = { 0 };
   unsigned long    exe_dt      = 0;
 
   // find respective sched-task
   read_lock(&sched_dev->lock);
-  list_for_each_entry(stask, &sched_dev->stask_list.entry, entry) {
-    if(stask->pid == pid) {
-      sched_task = stask;
-      break;
-    }
-  }
+  sched_task = find_sched_task(sched_dev, pid);
   read_unlock(&sched_dev->lock);
   if(sched_task == NULL) {
     neon_error("%s : did %d : cid %d : pid %d : submit without task",
@@ -511,20 +593,8 @@ neon_policy_complete(unsigned int did,
     return;
   }
 
-  if(test_bit(cid, sched_task->bmp_issue2comp) != 0) {
-    struct timespec complete_ts = { 0 };
-    struct timespec dtime       = { 0 };
-    getnstimeofday(&complete_ts);
-    dtime = timespec_sub(complete_ts, sched_work->issue_ts);
-    exe_dt = (unsigned long) (timespec_to_ns(&dtime) / NSEC_PER_USEC);
-    neon_debug("did %d : cid %d : exe %ld : total %ld : "
-               "tasknrqst %ld : uninterrupted issue2complete",
-               did, cid, exe_dt, sched_task->exe_dt, sched_task->nrqst);
-    clear_bit(cid, sched_task->bmp_issue2comp);
-  }
-  sched_work->exe_dt += exe_dt;
-  sched_task->exe_dt += sched_work->exe_dt;
-  sched_task->wait_dt += sched_work->wait_dt;
+  getnstimeofday(&complete_ts);
+  exe_dt = complete_account(sched_work, sched_task, &complete_ts);
 
   write_lock(&sched_dev->lock);
 
@@ -538,18 +608,94 @@ neon_policy_complete(unsigned int did,
             sched_work->exe_dt, exe_dt, sched_work->wait_dt);
 
   write_unlock(&sched_dev->lock);
+  rearm_kick(sched_dev);
 
   return;
 }
 
+/**************************************************************************/
+// neon_policy_complete_batch
+/**************************************************************************/
+// complete event for all channels set in bmp (owned by pid[cid]),
+// found complete in the same poll: one timestamp, one sched-dev
+// lock round-trip. Channels without a task are left with a NULL owner
+void
+neon_policy_complete_batch(const unsigned int did,
+                           const long * const bmp,
+                           const unsigned int * const pid)
+{
+  sched_dev_t     *sched_dev   = &sched_dev_array[did];
+  sched_task_t   **stask       = sched_dev->stask_batch;
+  sched_task_t    *last        = NULL;
+  struct timespec  complete_ts = { 0 };
+  unsigned int     nchan       = neon_global.dev[did].nchan;
+  unsigned int     cid         = 0;
+
+  getnstimeofday(&complete_ts);
+
+  write_lock(&sched_dev->lock);
+
+  for_each_set_bit(cid, bmp, nchan) {
+    sched_work_t *sched_work = &sched_dev->swork_array[cid];
+    unsigned long exe_dt     = 0;
+    // completions in a batch tend to come from the same task
+    if(last == NULL || last->pid != pid[cid])
+      last = find_sched_task(sched_dev, pid[cid]);
+    stask[cid] = last;
+    if(last == NULL) {
+      neon_error("%s : did %d : cid %d : pid %d : submit without task",
+                 __func__, did, cid, pid[cid]);
+      continue;
+    }
+    exe_dt = complete_account(sched_work, last, &complete_ts);
+    neon_info("did %d : cid %d : pid %d : rqst %ld : "
+              "exe task %ld : exe work %ld : "
+              "added %ld : wait task %ld : work complete (batch)",
+              did, cid, last->pid, sched_work->nrqst, last->exe_dt,
+              sched_work->exe_dt, exe_dt, sched_work->wait_dt);
+  }
+
+  if(select_policy->complete_batch != NULL)
+    select_policy->complete_batch(sched_dev, bmp, stask);
+  else
+    for_each_set_bit(cid, bmp, nchan)
+      if(stask[cid] != NULL)
+        select_policy->complete(sched_dev, &sched_dev->swork_array[cid],
+                                stask[cid]);
+
+  write_unlock(&sched_dev->lock);
+  rearm_kick(sched_dev);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_policy_predict
+/**************************************************************************/
+// predicted issue->complete time (uSec) of a request on a channel;
+// 0 if unknown. Read without the sched-dev lock, which callers may
+// already hold; a stale estimate only delays completion detection
+inline unsigned long
+neon_policy_predict(const unsigned int did,
+                    const unsigned int cid)
+{
+  return ACCESS_ONCE(sched_dev_array[did].swork_array[cid].pred_dt);
+}
+
 /**************************************************************************/
 // neon_policy_event
 /**************************************************************************/
-// event thread inquiring policy about event handling
+// device event thread inquiring policy about event handling
 inline void
-neon_policy_event(void)
+neon_policy_event(const unsigned int did)
 {
-  return select_policy->event();
+  select_policy->event(&sched_dev_array[did]);
+
+  // shoot down whatever the policy (here, or in its submit/complete
+  // callbacks) armed
+  neon_policy_rearm_flush(&sched_dev_array[did]);
+
+  return;
 }
 
 /**************************************************************************/
@@ -562,22 +708,100 @@ neon_policy_reengage_map(const neon_map_t * const map)
   return select_policy->reengage_map(map);
 }
 
+/**************************************************************************/
+// neon_policy_nonblocking
+/**************************************************************************/
+// whether the selected policy is non-blocking (see its face)
+inline int
+neon_policy_nonblocking(void)
+{
+  return select_policy->nonblocking;
+}
+
+/**************************************************************************/
+// neon_policy_penalize
+/**************************************************************************/
+// deprioritize a task on a device (watchdog) by charging it usec of
+// device time; returns -1 if the policy has no turns to push back
+int
+neon_policy_penalize(const unsigned int did,
+                     const unsigned int pid,
+                     const unsigned long usec)
+{
+  sched_dev_t  *sched_dev  = &sched_dev_array[did];
+  sched_task_t *sched_task = NULL;
+  int           ret        = -1;
+
+  if(select_policy->penalize == NULL)
+    return -1;
+
+  write_lock(&sched_dev->lock);
+  sched_task = find_sched_task(sched_dev, pid);
+  if(sched_task != NULL) {
+    select_policy->penalize(sched_dev, sched_task, usec);
+    ret = 0;
+  }
+  write_unlock(&sched_dev->lock);
+
+  return ret;
+}
+
+/**************************************************************************/
+// reengage_hold
+/**************************************************************************/
+// whether a channel has to stay armed: a deferred ring still in flight
+// would overwrite (with its older value) any store let through directly
+static inline int
+reengage_hold(const neon_work_t * const work,
+              const unsigned int arm)
+{
+  return arm == 0 && test_bit(NEON_RING_INFLIGHT, &work->ring_flags);
+}
+
+/**************************************************************************/
+// neon_policy_ring_defer
+/**************************************************************************/
+// defer a submit caught on an armed page to the ring worker; the check
+// and the capture are atomic with dis-engaging, so a ring never goes in
+// flight on a page already let through. Returns -1 if the page has been
+// disarmed since the fault, to submit synchronously instead
+int
+neon_policy_ring_defer(neon_work_t * const work,
+                       const neon_page_t * const page,
+                       const u32 reg_idx)
+{
+  sched_dev_t *sched_dev = &sched_dev_array[work->did];
+  int          ret       = -1;
+
+  read_lock(&sched_dev->lock);
+  if(page->armed != 0) {
+    neon_work_submit_deferred(work, reg_idx);
+    ret = 0;
+  }
+  read_unlock(&sched_dev->lock);
+
+  return ret;
+}
+
 /**************************************************************************/
 // neon_policy_reengage_task
 /**************************************************************************/
-// re-engage or dis-engage whole task (not policy specific)
+// re-engage or dis-engage whole task (not policy specific); all of the
+// task's channels share its mm, so they are armed into the task's batch
+// and shot down together by neon_policy_rearm_flush, once the lock is
+// released (irqs-off paths and timers spin on it, and could never take
+// the shootdown ipi)
 // CAREFUL : called with sched-dev write lock held
 void
 neon_policy_reengage_task(sched_dev_t *sched_dev,
                           sched_task_t *sched_task,
                           unsigned int arm)
 {
-  unsigned long  nchan    = neon_global.dev[sched_dev->id].nchan;
-  unsigned int   i        = 0;
+  unsigned long nchan = neon_global.dev[sched_dev->id].nchan;
+  unsigned int  i     = 0;
 
   for_each_set_bit(i, sched_task->bmp_start2stop, nchan) {
     sched_work_t *sched_work = NULL;
-    neon_map_t   *map   = NULL;
     sched_work = &sched_dev->swork_array[i];
     if(sched_work->neon_work == NULL) {
       neon_error("neon_work is NULL for set start2stop "
@@ -588,12 +812,97 @@ neon_policy_reengage_task(sched_dev_t *sched_dev,
       // and then policy-stop
       continue;
     }
-    map = sched_work->neon_work->ir;
-    neon_track_restart(arm, map);
+    if(reengage_hold(sched_work->neon_work, arm))
+      continue;
+    neon_track_batch_arm(arm, sched_work->neon_work->ir, &sched_task->rearm);
     neon_info("did %d : cid %d : task %d : %s-engaged --- task ",
               sched_dev->id, i, sched_task->pid,
               ((arm == 0) ? "dis" : "___"));
+  }
+
+  if(sched_task->rearm.npages != 0 && list_empty(&sched_task->rearm_entry))
+    list_add_tail(&sched_task->rearm_entry, &sched_dev->rearm_list);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_policy_reengage_work
+/**************************************************************************/
+// re-engage or dis-engage a single channel, deferring the shootdown
+// like neon_policy_reengage_task
+// CAREFUL : called with sched-dev write lock held
+void
+neon_policy_reengage_work(sched_dev_t *sched_dev,
+                          sched_work_t *sched_work,
+                          unsigned int arm)
+{
+  sched_task_t *sched_task = NULL;
+
+  sched_task = find_sched_task(sched_dev, sched_work->pid);
+  if(sched_task == NULL || sched_work->neon_work == NULL) {
+    neon_error("%s : did %d : cid %d : pid %d : no task or work",
+               __func__, sched_dev->id, sched_work->id, sched_work->pid);
+    return;
+  }
+
+  if(reengage_hold(sched_work->neon_work, arm))
+    return;
+  neon_track_batch_arm(arm, sched_work->neon_work->ir, &sched_task->rearm);
+  if(sched_task->rearm.npages != 0 && list_empty(&sched_task->rearm_entry))
+    list_add_tail(&sched_task->rearm_entry, &sched_dev->rearm_list);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_policy_rearm_flush
+/**************************************************************************/
+// shoot down the pages (re-)armed under the sched-dev lock, one task
+// (mm) at a time; waits on the shootdown ipis, so it must be called
+// without the lock and with irqs on (the event kthread, see
+// neon_policy_event)
+void
+neon_policy_rearm_flush(sched_dev_t *sched_dev)
+{
+  neon_track_batch_t batch;
+  struct timespec    start_ts = { 0 };
+  struct timespec    stop_ts  = { 0 };
+  unsigned int       npages   = 0;
+
+  // unlocked peek, called on every event; whoever queues kicks the
+  // event kthread again (rearm_kick)
+  if(list_empty(&sched_dev->rearm_list))
+    return;
+
+  getnstimeofday(&start_ts);
+
+  for(;;) {
+    sched_task_t *sched_task = NULL;
+
+    write_lock(&sched_dev->lock);
+    if(list_empty(&sched_dev->rearm_list)) {
+      write_unlock(&sched_dev->lock);
+      break;
+    }
+    sched_task = list_first_entry(&sched_dev->rearm_list,
+                                  sched_task_t, rearm_entry);
+    list_del_init(&sched_task->rearm_entry);
+    // the batch pins the mm, the task may go once unlocked
+    batch = sched_task->rearm;
+    neon_track_batch_init(&sched_task->rearm);
+    write_unlock(&sched_dev->lock);
+
+    npages += batch.npages;
+    neon_track_batch_flush(&batch);
+  }
 
+  if(npages != 0) {
+    getnstimeofday(&stop_ts);
+    neon_info("did %d : %u pages shot down in %lld nsec",
+              sched_dev->id, npages,
+              (long long) (timespec_to_ns(&stop_ts) -
+                           timespec_to_ns(&start_ts)));
   }
 
   return;
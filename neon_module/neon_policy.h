@@ -48,6 +48,10 @@ typedef enum {
   NEON_POLICIES           // # of supported policies
 } neon_policy_id_t;
 
+// Weight (as 1/2^W) of the latest request in the running per-channel
+// request execution time estimate
+#define NEON_PREDICT_WEIGHT 3
+
 // Set default GPU (for debugging purposes)
 #define NEON_MAIN_GPU_DID   0
 
@@ -93,6 +97,8 @@ typedef struct _sched_work_t_ {
   unsigned long exe_dt;
   // time spent waiting on this channel
   unsigned long wait_dt;
+  // running estimate of issue->complete time per request on this channel
+  unsigned long pred_dt;
   // requests submitted/issued on this channel
   unsigned long nrqst;
   // flag marking request is part of a computational kernel/gfx call (2/3)
@@ -119,6 +125,10 @@ typedef struct _sched_task_t_ {
   unsigned long wait_dt;
   // policy-specific entries
   policy_task_t ps;
+  // pages (re-)armed under the sched-dev lock, awaiting their shootdown
+  neon_track_batch_t rearm;
+  // entry in device's list of tasks awaiting a shootdown
+  struct list_head rearm_entry;
   // entry in device's list of tasks
   struct list_head entry;
 } sched_task_t;
@@ -131,6 +141,10 @@ typedef struct _sched_dev_t_ {
   sched_work_t *swork_array;
   // list of tasks occupying channels on this device
   sched_task_t stask_list;
+  // per-channel owner scratch space for batched completions
+  sched_task_t **stask_batch;
+  // tasks with pages armed but not shot down yet (see rearm_flush)
+  struct list_head rearm_list;
   // policy-specific entries
   policy_dev_t ps;
   // protect this struct
@@ -160,8 +174,22 @@ typedef struct _neon_policy_face_t_ {
   void (*complete)(sched_dev_t  * const sched_dev,
                    sched_work_t * const sched_work,
                    sched_task_t * const sched_task);
-  void (*event)(void);
+  // optional; invoked with sched_dev->lock held for a set of
+  // (already accounted) works, or complete is called per work;
+  // sched_task[cid] is NULL for channels whose task is gone
+  void (*complete_batch)(sched_dev_t  * const sched_dev,
+                         const long * const bmp,
+                         sched_task_t ** const sched_task);
+  void (*event)(sched_dev_t * const sched_dev);
   int  (*reengage_map)(const neon_map_t * const map);
+  // optional; charge a task extra device time (uSec), pushing back
+  // its turns; invoked with sched_dev->lock held
+  void (*penalize)(sched_dev_t  * const sched_dev,
+                   sched_task_t * const sched_task,
+                   const unsigned long usec);
+  // set if submit issues right away and the policy never disengages,
+  // so that submissions may as well be observed after the fact
+  unsigned int nonblocking;
 } neon_policy_face_t;
 
 /**************************************************************************/
@@ -179,15 +207,31 @@ int neon_policy_submit(const neon_work_t * const work);
 void neon_policy_complete(const unsigned int did,
                           const unsigned int cid,
                           const unsigned int pid);
+void neon_policy_complete_batch(const unsigned int did,
+                                const long * const bmp,
+                                const unsigned int * const pid);
 int neon_policy_issue(sched_dev_t  * const sched_dev,
                       sched_work_t * const sched_work,
                       sched_task_t * const sched_task,
                       unsigned int had_blocked);
-void neon_policy_event(void);
+unsigned long neon_policy_predict(const unsigned int did,
+                                  const unsigned int cid);
+void neon_policy_event(const unsigned int did);
 int neon_policy_reengage_map(const neon_map_t * const map);
+int neon_policy_nonblocking(void);
+int neon_policy_penalize(const unsigned int did,
+                         const unsigned int pid,
+                         const unsigned long usec);
+int neon_policy_ring_defer(neon_work_t * const work,
+                           const neon_page_t * const page,
+                           const u32 reg_idx);
 void neon_policy_reengage_task(sched_dev_t *sched_dev,
                                sched_task_t *sched_task,
                                unsigned int arm);
+void neon_policy_reengage_work(sched_dev_t *sched_dev,
+                               sched_work_t *sched_work,
+                               unsigned int arm);
+void neon_policy_rearm_flush(sched_dev_t *sched_dev);
 void neon_policy_update(const sched_dev_t *const sched_dev,
                         const sched_task_t *const sched_task);
 
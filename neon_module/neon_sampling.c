@@ -73,8 +73,11 @@ static void issue_sampling(sched_dev_t  * const sched_dev,
 static void complete_sampling(sched_dev_t  * const sched_dev,
                               sched_work_t * const sched_work,
                               sched_task_t * const sched_task);
-static void event_sampling(void);
+static void event_sampling(sched_dev_t * const sched_dev);
 static int  reengage_map_sampling(const neon_map_t * const neon_map);
+static void penalize_sampling(sched_dev_t  * const sched_dev,
+                              sched_task_t * const sched_task,
+                              const unsigned long usec);
 
 neon_policy_face_t neon_policy_sampling = {
   .init = init_sampling,
@@ -88,7 +91,8 @@ neon_policy_face_t neon_policy_sampling = {
   .issue = issue_sampling,
   .complete = complete_sampling,
   .event = event_sampling,
-  .reengage_map = reengage_map_sampling
+  .reengage_map = reengage_map_sampling,
+  .penalize = penalize_sampling
 };
 
 /**************************************************************************/
@@ -400,7 +404,7 @@ season_timer_callback(struct hrtimer *timer)
     read_lock(&sched_dev->lock);
     if(sched_dev->DFQ(update_ts) == 0) {
       atomic_set(&sampling_dev->action, 1);
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
+      neon_sched_wake(sched_dev->id);
     }
     read_unlock(&sched_dev->lock);
   }
@@ -690,7 +694,7 @@ stop_sampling(sched_dev_t  * const sched_dev,
     neon_report("%s : canceled timer, set wake up event", __func__);
     if(atomic_read(&neon_global.ctx_live) > 0) {
       atomic_set(&sched_dev->DFQ(action), 1);
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
+      neon_sched_wake(sched_dev->id);
     }
   }
 
@@ -753,7 +757,7 @@ submit_sampling(sched_dev_t  * const sched_dev,
     // will be stopped; a new request arriving in BARRIER state
     // will push the system to start draining
     atomic_set(&sched_dev->DFQ(action), 1);
-    wake_up_interruptible(&neon_kthread_event_wait_queue);
+    neon_sched_wake(sched_dev->id);
   case DFQ_TASK_DRAINING :
     block = 1;
     break;
@@ -770,7 +774,7 @@ submit_sampling(sched_dev_t  * const sched_dev,
           neon_error("%s : could not cancel sampling timer", __func__);
         neon_report("%s : canceled timer, set wake up event", __func__);
         atomic_set(&sched_dev->DFQ(action), 1);
-        wake_up_interruptible(&neon_kthread_event_wait_queue);
+        neon_sched_wake(sched_dev->id);
       }
     } else
       block = 0;
@@ -941,7 +945,7 @@ complete_sampling(sched_dev_t  * const sched_dev,
     if(--sched_dev->DFQ(countdown) <= 0) {
       // TODO : CHECK --- NEEDS TO  RESET TIMER ?
       atomic_set(&sched_dev->DFQ(action), 1);
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
+      neon_sched_wake(sched_dev->id);
     }
     break;
   case DFQ_TASK_SAMPLING :
@@ -988,7 +992,7 @@ complete_sampling(sched_dev_t  * const sched_dev,
           sched_task->DFQ(nrqst_sampled)--;
         sched_dev->DFQ(update_ts) = 0;
         atomic_set(&sched_dev->DFQ(action), 1);
-        wake_up_interruptible(&neon_kthread_event_wait_queue);
+        neon_sched_wake(sched_dev->id);
       }
       neon_info("DFQ : %s : did %d : cid %d : pid %d [%d] : "
                 "nrqst %ld : smpl_season_dt %ld : wake-up kthread for complete @ %ld",
@@ -1035,176 +1039,173 @@ complete_sampling(sched_dev_t  * const sched_dev,
 /**************************************************************************/
 // asynchronous event handler
 static void
-event_sampling(void)
+event_sampling(sched_dev_t * const sched_dev)
 {
-  unsigned int i = 0;
-  unsigned int j = 0;
-
-  for(i = 0; i < neon_global.ndev; i++) {
-    sched_dev_t     *sched_dev     = &sched_dev_array[i];
-    unsigned int     nchan         = neon_global.dev[i].nchan;
-    season_t         last_season   = DFQ_TASK_NOFSEASONS;
-    sched_task_t    *last_sampled  = NULL;
-    sched_task_t    *stask         = NULL;
-    struct timespec  now_ts        = { 0 };
-    unsigned long    ts            = 0;
-    ktime_t          interval      = { .tv64 = 0 };
-
-    if(atomic_cmpxchg(&sched_dev->DFQ(action), 1, 0) == 0)
-      continue;
+  const unsigned int i             = sched_dev->id;
+  unsigned int       j             = 0;
+  unsigned int       nchan         = neon_global.dev[i].nchan;
+  season_t           last_season   = DFQ_TASK_NOFSEASONS;
+  sched_task_t      *last_sampled  = NULL;
+  sched_task_t      *stask         = NULL;
+  struct timespec    now_ts        = { 0 };
+  unsigned long      ts            = 0;
+  ktime_t            interval      = { .tv64 = 0 };
+
+  if(atomic_cmpxchg(&sched_dev->DFQ(action), 1, 0) == 0)
+    return;
 
 #ifdef NEON_SAMPLING_COMP0_ONLY
-    if(i > 0)
-      break;
+  if(i > 0)
+    return;
 #endif // NEON_SAMPLING_COMP0_ONLY
 
-    getnstimeofday(&now_ts);
-    ts = (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC);
+  getnstimeofday(&now_ts);
+  ts = (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC);
 
-    write_lock(&sched_dev->lock);
+  write_lock(&sched_dev->lock);
 
-    last_season = sched_dev->DFQ(season);
+  last_season = sched_dev->DFQ(season);
 
-    neon_debug("DFQ sampling_event: season %s : did %d",
-               season_name[last_season], sched_dev->id);
-    
-    switch(last_season) {
-    case DFQ_TASK_FREERUN :
-      // reengage freeruners
-      for(j = 0; j < nchan; j++) {
-        sched_work_t *swork = &sched_dev->swork_array[j];
-        if(swork->DFQ(heed) != 0) {
-          if(swork->DFQ(engage) == 0) {
-            swork->DFQ(engage) = 1;
-            neon_track_restart(1, swork->neon_work->ir);
-            neon_report("DFQ : did %d : cid %d : pid %d : re_-engaged",
-                        i, j, swork->pid);
-          } else
-            neon_report("DFQ : did %d : cid %d : pid %d : was-engaged",
-                        i, j, swork->pid);
-        }
-      }
-      sched_dev->DFQ(season) = DFQ_TASK_BARRIER;
-      last_season = sched_dev->DFQ(season);
-      neon_report("DFQ : freerun season over %s @ %ld - alarm",
-                  sched_dev->DFQ(active) != 0 ? "enter_BARRIER" : \
-                  "set___BARRIER", ts);
-      if(sched_dev->DFQ(active) == 0) {
-        // We can stay in BARRIER state if there exist no active tasks
-        // currently; the system will enter BARRIER immediately upon
-        // 1st request with a new event. The system's information is
-        // up to date until right before FREERUN begun --- by moving
-        // to BARRIER it will become up to date until now (FREERUN end)
-        break;
+  neon_debug("DFQ sampling_event: season %s : did %d",
+             season_name[last_season], sched_dev->id);
+  
+  switch(last_season) {
+  case DFQ_TASK_FREERUN :
+    // reengage freeruners; shot down once the lock is dropped
+    // (neon_policy_event)
+    for(j = 0; j < nchan; j++) {
+      sched_work_t *swork = &sched_dev->swork_array[j];
+      if(swork->DFQ(heed) != 0) {
+        if(swork->DFQ(engage) == 0) {
+          swork->DFQ(engage) = 1;
+          neon_policy_reengage_work(sched_dev, swork, 1);
+          neon_report("DFQ : did %d : cid %d : pid %d : re_-engaged",
+                      i, j, swork->pid);
+        } else
+          neon_report("DFQ : did %d : cid %d : pid %d : was-engaged",
+                      i, j, swork->pid);
       }
-    case DFQ_TASK_BARRIER :
-      // count pending work
-      sched_dev->DFQ(countdown) = 0;
-      list_for_each_entry(stask, &sched_dev->stask_list.entry, entry) {
-        unsigned int j = 0;
-        if(stask->DFQ(held_back) == 0)
-          neon_policy_update(sched_dev, stask);
-        for_each_set_bit(j, stask->bmp_issue2comp, nchan) {
-          sched_work_t *swork = &sched_dev->swork_array[j];
-          if(swork->DFQ(heed) == 0)
-            continue;
-          if(unlikely(swork->DFQ(engage) == 0)) {
-            // at this point, being in the barrier, all channels
-            // should have been re-engaged, or we did something stupid
-            neon_error("DFQ : %s : %s : did %d : pid % d : cid %d : channel "
-                       "should have been engaged", __func__,
-                       season_name[sched_dev->DFQ(season)],
-                       sched_dev->id, stask->pid, j);
-            BUG();
-          }
-          sched_dev->DFQ(countdown++);
+    }
+    sched_dev->DFQ(season) = DFQ_TASK_BARRIER;
+    last_season = sched_dev->DFQ(season);
+    neon_report("DFQ : freerun season over %s @ %ld - alarm",
+                sched_dev->DFQ(active) != 0 ? "enter_BARRIER" : \
+                "set___BARRIER", ts);
+    if(sched_dev->DFQ(active) == 0) {
+      // We can stay in BARRIER state if there exist no active tasks
+      // currently; the system will enter BARRIER immediately upon
+      // 1st request with a new event. The system's information is
+      // up to date until right before FREERUN begun --- by moving
+      // to BARRIER it will become up to date until now (FREERUN end)
+      break;
+    }
+  case DFQ_TASK_BARRIER :
+    // count pending work
+    sched_dev->DFQ(countdown) = 0;
+    list_for_each_entry(stask, &sched_dev->stask_list.entry, entry) {
+      unsigned int j = 0;
+      if(stask->DFQ(held_back) == 0)
+        neon_policy_update(sched_dev, stask);
+      for_each_set_bit(j, stask->bmp_issue2comp, nchan) {
+        sched_work_t *swork = &sched_dev->swork_array[j];
+        if(swork->DFQ(heed) == 0)
+          continue;
+        if(unlikely(swork->DFQ(engage) == 0)) {
+          // at this point, being in the barrier, all channels
+          // should have been re-engaged, or we did something stupid
+          neon_error("DFQ : %s : %s : did %d : pid % d : cid %d : channel "
+                     "should have been engaged", __func__,
+                     season_name[sched_dev->DFQ(season)],
+                     sched_dev->id, stask->pid, j);
+          BUG();
         }
+        sched_dev->DFQ(countdown++);
       }
-      if(sched_dev->DFQ(countdown) > 0) {
-        // drain pending work; completion notifications will move
-        // us from draining to sampling
-        sched_dev->DFQ(season) = DFQ_TASK_DRAINING;
-        neon_info("DFQ : %s->%s : did %d : countdown %d - alarm",
-                  season_name[last_season],
-                  season_name[sched_dev->DFQ(season)],
-                  sched_dev->id, sched_dev->DFQ(countdown), ts);
-        break;
-      }
-      // there is no pending work so skip draining phase entirely
-      // and go to sampling directly
-      neon_info("DFQ : %s : did %d : device totally empty @ %ld - alarm",
-                season_name[last_season], sched_dev->id, ts);
-    case DFQ_TASK_DRAINING :
-      sched_dev->DFQ(season) = DFQ_TASK_SAMPLING;
-      last_season = DFQ_TASK_SAMPLING;
-      neon_info("DFQ : %s->%s : did %d : countdown %d : "
-                "drained @ %ld - alarm", season_name[last_season],
+    }
+    if(sched_dev->DFQ(countdown) > 0) {
+      // drain pending work; completion notifications will move
+      // us from draining to sampling
+      sched_dev->DFQ(season) = DFQ_TASK_DRAINING;
+      neon_info("DFQ : %s->%s : did %d : countdown %d - alarm",
+                season_name[last_season],
                 season_name[sched_dev->DFQ(season)],
                 sched_dev->id, sched_dev->DFQ(countdown), ts);
-    case DFQ_TASK_SAMPLING :
-      // As a sampling period finishes, check whether sampled task has
-      // ongoing work (overuse of sampling timeslice)
-      last_sampled = sched_dev->DFQ(sampled_task);
-      if(last_sampled != NULL &&
-         !bitmap_empty(last_sampled->bmp_issue2comp, nchan)) {
-        unsigned int false_alarm = 0;
-        unsigned int j           = 0;
-        // We wait for the completion of ongoing work at the end of a sampling
-        // period only if there exist more tasks waiting to be sampled
-        for_each_set_bit(j, last_sampled->bmp_issue2comp, nchan) {
-          sched_work_t *swork = &sched_dev->swork_array[j];
-          neon_report("DFQ : did %d : cid %d : pid %d : %s "
-                      "at sampling end @ %ld - alarm",
-                      sched_dev->id, j, last_sampled->pid,
-                      swork->DFQ(heed) == 0 ? "ignore" : "manage", ts);
-          if(swork->DFQ(heed) == 0) {
-            // fake-issued requests need to be ignored for
-            // completion notification if they are coming from
-            // an unmanaged channel --- reset the issued bit
-            clear_bit(swork->id, last_sampled->bmp_issue2comp);
-            false_alarm = 1;
-          }
+      break;
+    }
+    // there is no pending work so skip draining phase entirely
+    // and go to sampling directly
+    neon_info("DFQ : %s : did %d : device totally empty @ %ld - alarm",
+              season_name[last_season], sched_dev->id, ts);
+  case DFQ_TASK_DRAINING :
+    sched_dev->DFQ(season) = DFQ_TASK_SAMPLING;
+    last_season = DFQ_TASK_SAMPLING;
+    neon_info("DFQ : %s->%s : did %d : countdown %d : "
+              "drained @ %ld - alarm", season_name[last_season],
+              season_name[sched_dev->DFQ(season)],
+              sched_dev->id, sched_dev->DFQ(countdown), ts);
+  case DFQ_TASK_SAMPLING :
+    // As a sampling period finishes, check whether sampled task has
+    // ongoing work (overuse of sampling timeslice)
+    last_sampled = sched_dev->DFQ(sampled_task);
+    if(last_sampled != NULL &&
+       !bitmap_empty(last_sampled->bmp_issue2comp, nchan)) {
+      unsigned int false_alarm = 0;
+      unsigned int j           = 0;
+      // We wait for the completion of ongoing work at the end of a sampling
+      // period only if there exist more tasks waiting to be sampled
+      for_each_set_bit(j, last_sampled->bmp_issue2comp, nchan) {
+        sched_work_t *swork = &sched_dev->swork_array[j];
+        neon_report("DFQ : did %d : cid %d : pid %d : %s "
+                    "at sampling end @ %ld - alarm",
+                    sched_dev->id, j, last_sampled->pid,
+                    swork->DFQ(heed) == 0 ? "ignore" : "manage", ts);
+        if(swork->DFQ(heed) == 0) {
+          // fake-issued requests need to be ignored for
+          // completion notification if they are coming from
+          // an unmanaged channel --- reset the issued bit
+          clear_bit(swork->id, last_sampled->bmp_issue2comp);
+          false_alarm = 1;
         }
-        if(false_alarm == 1)
-          break;
-        sched_dev->DFQ(update_ts) = ts;
-        neon_report("DFQ : did %d : last %d : busy on sampling end "
-                    "@ %ld - alarm", sched_dev->id, last_sampled->pid, ts);
-        break;
-      } else {
-        // if there is no ongoing work, then update the sampled task
-        // and, if this is the end of a samplign season, enter freerun
-        interval = update_now(sched_dev);
-        neon_report("DFQ : %s -> %s : did %d : pid  %d->%d : "
-                    "%s @ %ld - alarm (next_in %ld)",
-                    season_name[last_season],
-                    season_name[sched_dev->DFQ(season)], sched_dev->id,
-                    last_sampled == NULL ? 0 : last_sampled->pid,
-                    sched_dev->DFQ(sampled_task) == NULL ? 0 :
-                    sched_dev->DFQ(sampled_task)->pid,
-                    interval.tv64 == sampling_interval.tv64 ? "sample" : \
-                    "circled-all", ts, interval.tv64/1000);
       }
+      if(false_alarm == 1)
+        break;
+      sched_dev->DFQ(update_ts) = ts;
+      neon_report("DFQ : did %d : last %d : busy on sampling end "
+                  "@ %ld - alarm", sched_dev->id, last_sampled->pid, ts);
       break;
-    default :
-      neon_error("Unknown season");
-    }
-
-    if(interval.tv64 != 0) {
-      if(hrtimer_try_to_cancel(&sched_dev->DFQ(season_timer)) != -1) {
-        ktime_t next_in = { 0  };
-        hrtimer_start(&sched_dev->DFQ(season_timer), interval,
-                      HRTIMER_MODE_REL);
-        next_in = hrtimer_expires_remaining(&sched_dev->DFQ(season_timer));
-        neon_report("%s : canceled timer, restart, next expires in %ld",
-                    __func__, next_in.tv64/1000);
-      } else
-        neon_error("%s : could not cancel sampling timer", __func__);
+    } else {
+      // if there is no ongoing work, then update the sampled task
+      // and, if this is the end of a samplign season, enter freerun
+      interval = update_now(sched_dev);
+      neon_report("DFQ : %s -> %s : did %d : pid  %d->%d : "
+                  "%s @ %ld - alarm (next_in %ld)",
+                  season_name[last_season],
+                  season_name[sched_dev->DFQ(season)], sched_dev->id,
+                  last_sampled == NULL ? 0 : last_sampled->pid,
+                  sched_dev->DFQ(sampled_task) == NULL ? 0 :
+                  sched_dev->DFQ(sampled_task)->pid,
+                  interval.tv64 == sampling_interval.tv64 ? "sample" : \
+                  "circled-all", ts, interval.tv64/1000);
     }
+    break;
+  default :
+    neon_error("Unknown season");
+  }
 
-    write_unlock(&sched_dev->lock);
+  if(interval.tv64 != 0) {
+    if(hrtimer_try_to_cancel(&sched_dev->DFQ(season_timer)) != -1) {
+      ktime_t next_in = { 0  };
+      hrtimer_start(&sched_dev->DFQ(season_timer), interval,
+                    HRTIMER_MODE_REL);
+      next_in = hrtimer_expires_remaining(&sched_dev->DFQ(season_timer));
+      neon_report("%s : canceled timer, restart, next expires in %ld",
+                  __func__, next_in.tv64/1000);
+    } else
+      neon_error("%s : could not cancel sampling timer", __func__);
   }
 
+  write_unlock(&sched_dev->lock);
+
   return;
 }
 
@@ -1241,3 +1242,22 @@ reengage_map_sampling(const neon_map_t * const neon_map)
 
   return reengage;
 }
+
+/**************************************************************************/
+// penalize_sampling
+/**************************************************************************/
+// advance a task's virtual time; it is held back at the next vtime
+// update till the others catch up
+static void
+penalize_sampling(sched_dev_t  * const sched_dev,
+                  sched_task_t * const sched_task,
+                  const unsigned long usec)
+{
+  sched_task->DFQ(vtime) += usec;
+
+  neon_info("DFQ : did %d : pid %d : vtime %ld : dev-vtime %ld : penalized",
+            sched_dev->id, sched_task->pid, sched_task->DFQ(vtime),
+            sched_dev->DFQ(vtime));
+
+  return;
+}
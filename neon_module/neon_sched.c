@@ -13,6 +13,12 @@
 #include <linux/highmem.h> // kmap
 #include <linux/pid.h>     // get_pid_task
 #include <linux/signal.h>  // kill_pgrp
+#include <linux/string.h>  // strsep
+#include <linux/completion.h> // kthread exit
+#include <linux/kthread.h> // self-test threads
+#include <linux/sched.h>   // mmput
+#include <asm/processor.h> // __monitor, __mwait
+#include <asm/io.h>        // writel
 #include "neon_core.h"
 #include "neon_control.h"
 #include "neon_sys.h"
@@ -24,195 +30,1213 @@
 // period presets
 unsigned int _polling_T_     = NEON_POLLING_T_DEFAULT;
 unsigned int polling_T       = NEON_POLLING_T_DEFAULT;
+unsigned int _polling_floor_ = NEON_POLLING_FLOOR_DEFAULT;
+unsigned int polling_floor   = NEON_POLLING_FLOOR_DEFAULT;
 unsigned int _malicious_T_   = NEON_MALICIOUS_T_DEFAULT;
 unsigned int malicious_T     = NEON_MALICIOUS_T_DEFAULT;
+unsigned int _malicious_hold_ = NEON_MALICIOUS_HOLD_DEFAULT;
+unsigned int malicious_hold   = NEON_MALICIOUS_HOLD_DEFAULT;
+unsigned int _malicious_kill_ = NEON_MALICIOUS_KILL_DEFAULT;
+unsigned int malicious_kill   = NEON_MALICIOUS_KILL_DEFAULT;
+unsigned int _predict_       = NEON_PREDICT_DEFAULT;
+unsigned int predict         = NEON_PREDICT_DEFAULT;
+unsigned int _polling_mwait_ = NEON_POLLING_MWAIT_DEFAULT;
+unsigned int polling_mwait   = NEON_POLLING_MWAIT_DEFAULT;
+unsigned int _submit_defer_  = NEON_SUBMIT_DEFER_DEFAULT;
+unsigned int submit_defer    = NEON_SUBMIT_DEFER_DEFAULT;
+
+// per-device event kthread cpu lists
+char _polling_cpus_[NEON_POLLING_CPUS_LEN] = { 0 };
+
+// polling report buffer
+char polling_report[NEON_REPORT_LEN];
 
-// requests queue for scheduling purposes
-wait_queue_head_t neon_kthread_event_wait_queue;
 // kernel-thread exit flag
 static unsigned int      kthread_repeat = 0;
-// hrtimer time descriptor
-ktime_t                  polling_interval;
-// polling high rez timer
-static struct hrtimer    polling_timer;
+// per-device polling state
+static neon_poll_t      *poll_array = NULL;
+// deferred submissions (may block on policies, one per channel)
+static struct workqueue_struct *ring_wq = NULL;
+
+/****************************************************************************/
+// now_usec
+/****************************************************************************/
+// current time in uSec
+static inline unsigned long
+now_usec(void)
+{
+  struct timespec now_ts = { 0 };
+
+  getnstimeofday(&now_ts);
+
+  return (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC);
+}
 
 /****************************************************************************/
 // polling_timer_callback
 /****************************************************************************/
-// called by the polling timer, this alarm will wake-up the sleeping
-// polling thread to poll every polling_T periods
+// called by a device's polling timer, this alarm will wake-up the
+// sleeping polling thread to poll the device's live channels
 static enum hrtimer_restart
 polling_timer_callback( struct hrtimer *timer )
 {
+  neon_poll_t *poll = container_of(timer, neon_poll_t, timer);
+
+  if(likely(kthread_repeat) &&
+     atomic_read(&neon_global.ctx_live) > 0) {
+    atomic_set(&poll->action, 1);
+    neon_sched_wake(poll->did);
+  }
+
+  return HRTIMER_NORESTART;
+}
+
+/****************************************************************************/
+// neon_sched_wake
+/****************************************************************************/
+// raise an event for a device's event kthread
+void
+neon_sched_wake(const unsigned int did)
+{
+  neon_poll_t *poll = &poll_array[did];
+
+  atomic_set(&poll->wake, 1);
+  wake_up_interruptible(&poll->event_wq);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_cpus_update
+/****************************************************************************/
+// parse the per-device cpu lists and have every event kthread
+// move to its cpus; devices without a (valid) list stay on the
+// cpus of their NUMA node
+static void
+polling_cpus_update(void)
+{
+  char          cpus[NEON_POLLING_CPUS_LEN] = { 0 };
+  char         *next = cpus;
+  unsigned int  i    = 0;
+
+  strncpy(cpus, _polling_cpus_, NEON_POLLING_CPUS_LEN - 1);
+  for(i = 0; i < neon_global.ndev; i++) {
+    neon_poll_t  *poll = &poll_array[i];
+    const int     node = neon_global.dev[i].node;
+    char         *list = strsep(&next, ";");
+
+    if(list != NULL)
+      list = strim(list);
+    if(list == NULL || *list == '\0' ||
+       cpulist_parse(list, &poll->cpus) != 0 ||
+       !cpumask_intersects(&poll->cpus, cpu_online_mask)) {
+      if(list != NULL && *list != '\0')
+        neon_error("did %d : bad cpu list \"%s\" --- using node %d",
+                   i, list, node);
+      if(node >= 0)
+        cpumask_copy(&poll->cpus, cpumask_of_node(node));
+      else
+        cpumask_copy(&poll->cpus, cpu_possible_mask);
+    }
+    atomic_set(&poll->affine, 1);
+    neon_sched_wake(i);
+  }
+
+  return;
+}
+
+/****************************************************************************/
+// polling_table_init
+/****************************************************************************/
+// allocate a device's (empty) live refc table
+static int
+polling_table_init(neon_poll_table_t * const tbl,
+                   const unsigned int nchan)
+{
+  unsigned int cid = 0;
+
+  tbl->n      = 0;
+  tbl->refc   = (void **) kzalloc(nchan * sizeof(void *), GFP_KERNEL);
+  tbl->target = (unsigned long *) kzalloc(nchan * sizeof(unsigned long),
+                                          GFP_KERNEL);
+  tbl->due    = (unsigned long *) kzalloc(nchan * sizeof(unsigned long),
+                                          GFP_KERNEL);
+  tbl->cid    = (unsigned int *) kzalloc(nchan * sizeof(unsigned int),
+                                         GFP_KERNEL);
+  tbl->pid    = (unsigned int *) kzalloc(nchan * sizeof(unsigned int),
+                                         GFP_KERNEL);
+  tbl->slot   = (unsigned int *) kzalloc(nchan * sizeof(unsigned int),
+                                         GFP_KERNEL);
+  seqcount_init(&tbl->seq);
+  spin_lock_init(&tbl->lock);
+  if(tbl->refc == NULL || tbl->target == NULL || tbl->due == NULL ||
+     tbl->cid == NULL || tbl->pid == NULL || tbl->slot == NULL)
+    return -ENOMEM;
+
+  for(cid = 0; cid < nchan; cid++)
+    tbl->slot[cid] = NEON_POLL_NOSLOT;
+
+  return 0;
+}
+
+/****************************************************************************/
+// polling_table_fini
+/****************************************************************************/
+// release a device's live refc table
+static void
+polling_table_fini(neon_poll_table_t * const tbl)
+{
+  kfree(tbl->refc);
+  kfree(tbl->target);
+  kfree(tbl->due);
+  kfree(tbl->cid);
+  kfree(tbl->pid);
+  kfree(tbl->slot);
+  tbl->refc   = NULL;
+  tbl->target = NULL;
+  tbl->due    = NULL;
+  tbl->cid    = NULL;
+  tbl->pid    = NULL;
+  tbl->slot   = NULL;
+  tbl->n      = 0;
+
+  return;
+}
+
+/****************************************************************************/
+// polling_table_insert
+/****************************************************************************/
+// add (or update) a live channel's entry
+static void
+polling_table_insert(neon_poll_table_t * const tbl,
+                     const unsigned int cid,
+                     const unsigned int pid,
+                     void * const refc,
+                     const unsigned long target,
+                     const unsigned long due)
+{
+  unsigned int i = 0;
+
+  spin_lock(&tbl->lock);
+  write_seqcount_begin(&tbl->seq);
+  i = tbl->slot[cid];
+  if(i == NEON_POLL_NOSLOT) {
+    i = tbl->n++;
+    tbl->slot[cid] = i;
+    tbl->cid[i] = cid;
+  }
+  tbl->refc[i]   = refc;
+  tbl->target[i] = target;
+  tbl->due[i]    = due;
+  tbl->pid[i]    = pid;
+  write_seqcount_end(&tbl->seq);
+  spin_unlock(&tbl->lock);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_table_remove
+/****************************************************************************/
+// drop a channel's entry, moving the last entry into its place
+static void
+polling_table_remove(neon_poll_table_t * const tbl,
+                     const unsigned int cid)
+{
+  unsigned int i    = 0;
+  unsigned int last = 0;
+
+  spin_lock(&tbl->lock);
+  i = tbl->slot[cid];
+  if(i != NEON_POLL_NOSLOT) {
+    write_seqcount_begin(&tbl->seq);
+    last = --tbl->n;
+    if(i != last) {
+      tbl->refc[i]   = tbl->refc[last];
+      tbl->target[i] = tbl->target[last];
+      tbl->due[i]    = tbl->due[last];
+      tbl->cid[i]    = tbl->cid[last];
+      tbl->pid[i]    = tbl->pid[last];
+      tbl->slot[tbl->cid[i]] = i;
+    }
+    tbl->slot[cid] = NEON_POLL_NOSLOT;
+    write_seqcount_end(&tbl->seq);
+  }
+  spin_unlock(&tbl->lock);
+
+  return;
+}
+
+/****************************************************************************/
+// work_publish
+/****************************************************************************/
+// publish a live work's (pid, refc, target) to its channel and the
+// device's refc table; a work whose refc is not resolved yet is
+// published without a refc, so pollers skip it. Caller holds chan->lock
+static void
+work_publish(neon_work_t * const work,
+             neon_chan_t * const chan)
+{
+  neon_poll_t   *poll   = &poll_array[work->did];
+  void          *refc   = NULL;
+  unsigned long  target = 0;
+
+  if(test_bit(work->cid, poll->bmp_unresolved) == 0) {
+    refc   = (void *) work->refc_kvaddr;
+    target = work->refc_target;
+  }
+
+  write_seqcount_begin(&chan->seq);
+  chan->pid = work->neon_task->pid;
+  chan->refc_kvaddr = refc;
+  chan->refc_target = target;
+  write_seqcount_end(&chan->seq);
+
+  polling_table_insert(&poll->table, work->cid, work->neon_task->pid,
+                       refc, target, poll->chan[work->cid].due);
+
+  return;
+}
+
+/****************************************************************************/
+// table_scan
+/****************************************************************************/
+// find every live entry of tbl whose refc has reached its target in one
+// pass over the dense table; marks its channel in bmp, with its owner
+// in pid. Refc mappings are never unmapped (see neon_work_update), so
+// loading through an entry of a snapshot that is about to be retried
+// is safe; its value is dropped with it
+static inline void
+table_scan(neon_poll_table_t * const tbl,
+           const unsigned int nchan,
+           long * const bmp,
+           unsigned int * const pid)
+{
+  unsigned int seq = 0;
+  unsigned int n   = 0;
+  unsigned int i   = 0;
+
+  do {
+    seq = read_seqcount_begin(&tbl->seq);
+    n = min(ACCESS_ONCE(tbl->n), nchan);
+    bitmap_zero(bmp, nchan);
+    for(i = 0; i < n; i++) {
+      void *refc = tbl->refc[i];
+      if(i + NEON_POLL_PREFETCH < n)
+        prefetch(tbl->refc[i + NEON_POLL_PREFETCH]);
+      if(unlikely(refc == NULL))
+        continue;
+      if(*((volatile unsigned int *) refc) >= tbl->target[i]) {
+        __set_bit(tbl->cid[i], bmp);
+        pid[tbl->cid[i]] = tbl->pid[i];
+      }
+    }
+  } while(read_seqcount_retry(&tbl->seq, seq));
+
+  return;
+}
+
+/****************************************************************************/
+// polling_table_scan
+/****************************************************************************/
+// scan a device's live refc table; marks the complete channels in
+// poll->bmp_scan, with their owner in poll->comp_pid
+static void
+polling_table_scan(neon_poll_t * const poll)
+{
+  table_scan(&poll->table, neon_global.dev[poll->did].nchan,
+             poll->bmp_scan, poll->comp_pid);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_table_urgent
+/****************************************************************************/
+// pick the live entry predicted to complete first; returns its refc
+// address (NULL if none) and target, and the table sequence the pick
+// is valid for (see read_seqcount_retry)
+static void *
+polling_table_urgent(neon_poll_t * const poll,
+                     unsigned long * const target,
+                     unsigned int * const seqp)
+{
+  neon_poll_table_t * const tbl   = &poll->table;
+  const unsigned int        nchan = neon_global.dev[poll->did].nchan;
+  void                     *refc  = NULL;
+  unsigned long             due   = 0;
+  unsigned int              seq   = 0;
+  unsigned int              n     = 0;
+  unsigned int              i     = 0;
+
+  do {
+    seq  = read_seqcount_begin(&tbl->seq);
+    n    = min(ACCESS_ONCE(tbl->n), nchan);
+    refc = NULL;
+    for(i = 0; i < n; i++) {
+      if(tbl->refc[i] == NULL)
+        continue;
+      if(refc == NULL || tbl->due[i] < due) {
+        refc    = tbl->refc[i];
+        due     = tbl->due[i];
+        *target = tbl->target[i];
+      }
+    }
+  } while(read_seqcount_retry(&tbl->seq, seq));
+  *seqp = seq;
+
+  return refc;
+}
+
+/****************************************************************************/
+// polling_mwait_on
+/****************************************************************************/
+// whether device did waits on MONITOR/MWAIT (polling_mwait is a
+// device bitmask, so only the first 32 devices can be selected)
+static inline int
+polling_mwait_on(const unsigned int did)
+{
+  return did < 32 && (polling_mwait & (1U << did)) != 0;
+}
+
+/****************************************************************************/
+// polling_mwait_wait
+/****************************************************************************/
+// MWAIT on the cache line of the most urgent live refc, so that the
+// GPU's semaphore write wakes the device kthread right away; returns
+// -1 if MWAIT does not apply (the kthread should sleep as usual),
+// 1 if the watched refc hit its target, 0 if woken for anything else
+static int
+polling_mwait_wait(neon_poll_t * const poll)
+{
+  neon_poll_table_t * const tbl    = &poll->table;
+  void                     *refc   = NULL;
+  unsigned long             target = 0;
+  unsigned int              val    = 0;
+  unsigned int              seq    = 0;
+
+  if(polling_mwait_on(poll->did) == 0)
+    return -1;
+
+  while(likely(kthread_repeat)) {
+    refc = polling_table_urgent(poll, &target, &seq);
+    if(refc == NULL)
+      return -1;
+    if(atomic_read(&poll->wake) != 0 || need_resched() ||
+       signal_pending(current))
+      return 0;
+    // the pick goes stale if the table changes (its work may be going
+    // away): load the refc, then re-validate the pick before trusting
+    // the value, after arming the monitor and after waking, and pick
+    // again if the table changed; a stale load is harmless since refc
+    // mappings are never unmapped (see neon_work_update)
+    __monitor(refc, 0, 0);
+    smp_mb();
+    val = *((volatile unsigned int *) refc);
+    if(read_seqcount_retry(&tbl->seq, seq))
+      continue;
+    if(val >= target)
+      break;
+    // C1 with interrupts enabled: also woken by timers and IPIs
+    __mwait(0, 0);
+    val = *((volatile unsigned int *) refc);
+    if(read_seqcount_retry(&tbl->seq, seq))
+      continue;
+    if(val >= target)
+      break;
+  }
+  if(unlikely(kthread_repeat == 0))
+    return 0;
+  poll->nmwait++;
+
+  return 1;
+}
+
+/****************************************************************************/
+// polling_timer_start
+/****************************************************************************/
+// (re)start a device's polling timer at its current period
+static inline void
+polling_timer_start(neon_poll_t * const poll)
+{
+  if(likely(kthread_repeat) &&
+     atomic_read(&neon_global.ctx_live) > 0)
+    hrtimer_start(&poll->timer,
+                  ns_to_ktime((u64) poll->period * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_timer_idle
+/****************************************************************************/
+// called by the device kthread after a poll: keep polling while any
+// channel is live, otherwise leave the timer unarmed until the next
+// submit (see polling_timer_kick)
+static void
+polling_timer_idle(neon_poll_t * const poll)
+{
+  neon_dev_t * const dev = &neon_global.dev[poll->did];
+
+  if(!bitmap_empty(dev->bmp_sub2comp, dev->nchan)) {
+    polling_timer_start(poll);
+    return;
+  }
+
+  poll->idle_ts = now_usec();
+  atomic_set(&poll->armed, 0);
+  // a submit racing with the check above may have missed the
+  // cleared flag; pair with the barrier in atomic_cmpxchg there
+  smp_mb();
+  if(!bitmap_empty(dev->bmp_sub2comp, dev->nchan) &&
+     atomic_cmpxchg(&poll->armed, 0, 1) == 0)
+    polling_timer_start(poll);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_timer_kick
+/****************************************************************************/
+// called at submit time to re-arm an idle device's polling timer,
+// accounting for the polls avoided in the meantime
+static inline void
+polling_timer_kick(neon_poll_t * const poll)
+{
+  if(atomic_cmpxchg(&poll->armed, 0, 1) != 0)
+    return;
+
+  if(poll->period > 0)
+    poll->nidle += (now_usec() - poll->idle_ts) / poll->period;
+  polling_timer_start(poll);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_adapt
+/****************************************************************************/
+// Adapt a device's polling period to its load: tighten toward the
+// floor when completions are being found, back off exponentially
+// toward the ceiling while channels stay busy or idle
+static inline void
+polling_adapt(neon_poll_t * const poll,
+              const unsigned int ncomp)
+{
+  const unsigned long floor = polling_floor;
+  const unsigned long ceil  = polling_T * USEC_PER_MSEC;
+
+  // per-channel prediction timers detect completions;
+  // periodic polling is only a safety net
+  if(predict != 0) {
+    poll->period = NEON_POLLING_SAFETY_X * ceil;
+    return;
+  }
+
+  if(ncomp > 0)
+    poll->period = max(poll->period / 2, floor);
+  else
+    poll->period = min(poll->period * 2, ceil);
+
+  return;
+}
+
+/****************************************************************************/
+// predict_timer_callback
+/****************************************************************************/
+// called by a channel's prediction timer at the predicted completion
+// time of its request; mark the channel due for the device's kthread
+static enum hrtimer_restart
+predict_timer_callback(struct hrtimer *timer)
+{
+  neon_chan_poll_t *cpoll = container_of(timer, neon_chan_poll_t, timer);
+
   if(likely(kthread_repeat)) {
-    if(atomic_read(&neon_global.ctx_live) > 0)
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
-    hrtimer_forward(timer, timer->base->get_time(),polling_interval);
-    return HRTIMER_RESTART;
+    set_bit(cpoll->cid, poll_array[cpoll->did].bmp_due);
+    neon_sched_wake(cpoll->did);
   }
 
   return HRTIMER_NORESTART;
 }
 
+/****************************************************************************/
+// predict_timer_start
+/****************************************************************************/
+// (re)start a channel's prediction timer, in uSec from now
+static inline void
+predict_timer_start(neon_chan_poll_t * const cpoll,
+                    const unsigned long usec)
+{
+  if(likely(kthread_repeat) && predict != 0)
+    hrtimer_start(&cpoll->timer,
+                  ns_to_ktime((u64) usec * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_chan_check
+/****************************************************************************/
+// check whether a live channel's request has completed; returns
+// 1 if complete, 0 if still running, -1 if the channel was skipped.
+// The channel's (pid, refc) tuple is read as a consistent snapshot
+// without taking its lock; the owner's pid is returned through pid.
+// The time since the channel was last checked bounds the detection lag
+static int
+polling_chan_check(neon_poll_t * const poll,
+                   const unsigned int cid,
+                   const unsigned long now,
+                   unsigned int * const pid,
+                   unsigned long * const lag)
+{
+  neon_dev_t       *dev      = &neon_global.dev[poll->did];
+  neon_chan_t      *chan     = &dev->chan[cid];
+  neon_chan_poll_t *cpoll    = &poll->chan[cid];
+  void             *kvaddr   = NULL;
+  unsigned long     target   = 0;
+  unsigned int      refc_val = 0;
+  unsigned int      seq      = 0;
+
+  // pointer, target and value are all read within the section; the
+  // pointer may be stale (its work gone) until the retry says so, but
+  // refc mappings are never unmapped (see neon_work_update), so the
+  // load is harmless and its value dropped
+  do {
+    seq      = read_seqcount_begin(&chan->seq);
+    *pid     = chan->pid;
+    kvaddr   = chan->refc_kvaddr;
+    target   = chan->refc_target;
+    refc_val = kvaddr != NULL ? *((volatile unsigned int *) kvaddr) : 0;
+  } while(read_seqcount_retry(&chan->seq, seq));
+
+  if(unlikely(kvaddr == NULL)) {
+    neon_info("did %d, cid %d : pid %d : skip completing work",
+              poll->did, cid, *pid);
+    return -1;
+  }
+
+  neon_debug("did %d : cid %d : pid %d : "
+             "refc 0x%lx/0x%lx : sched_POLL",
+             poll->did, cid, *pid, refc_val, target);
+
+  *lag = now - cpoll->check_ts;
+  cpoll->check_ts = now;
+
+  if(refc_val >= target) {
+    neon_debug("did %d : cid %d : pid %d : "
+               "refc [?/0x%p, 0x%lx] : sched_COMPL",
+               poll->did, cid, *pid, kvaddr, target);
+    return 1;
+  }
+
+  return 0;
+}
+
 #ifdef NEON_MALICIOUS_TERMINATOR
 /****************************************************************************/
-// kill_malicious
+// watchdog_escalate
 /****************************************************************************/
-static void
-kill_malicious(unsigned int pidnum)
+// raise the watchdog level of the task owning an overrunning request
+// on did/cid, running for age uSec as of now; each new level is acted
+// upon and reported once. Returns 1 if the task's level was raised
+static int
+watchdog_escalate(const unsigned int pidnum,
+                  const unsigned int did,
+                  const unsigned int cid,
+                  const neon_watchdog_t level,
+                  const unsigned long age,
+                  const unsigned long now)
 {
-  struct pid *pid = find_get_pid(pidnum);
-  struct task_struct *cpu_task = get_pid_task(pid, PIDTYPE_PID);
-  neon_task_t *neon_task = NULL;
-  unsigned int marked_malicious = 0;
+  static const char * const action[] = {
+    "ok", "deprioritized", "held back", "killed"
+  };
+  struct pid         *pid       = find_get_pid(pidnum);
+  struct task_struct *cpu_task  = get_pid_task(pid, PIDTYPE_PID);
+  neon_task_t        *neon_task = NULL;
+  unsigned long       hold      = 0;
+  int                 raised    = 0;
+
+  if(cpu_task == NULL) {
+    put_pid(pid);
+    return 0;
+  }
 
-  
   write_lock(&cpu_task->neon_task_rwlock);
   neon_task = (neon_task_t *) cpu_task->neon_task;
-  if(neon_task != NULL) {
-    if (neon_task->malicious == 0) {
-      neon_task->malicious = 1;
-      marked_malicious = 1;
+  // an overrun restarts the clean period, raised or not
+  if(neon_task != NULL)
+    neon_task->wdog_ts = now;
+  if(neon_task != NULL && neon_task->malicious < level) {
+    neon_task->malicious = level;
+    switch(level) {
+    case NEON_WATCHDOG_HOLD:
+      hold = malicious_hold << min(neon_task->strikes,
+                                   (unsigned int) NEON_MALICIOUS_HOLD_SHIFT_MAX);
+      neon_task->strikes++;
+      neon_task->hold_until = jiffies + msecs_to_jiffies(hold);
+      break;
+    default:
+      break;
     }
+    raised = 1;
   }
   write_unlock(&cpu_task->neon_task_rwlock);
-  
-  // making sure we only attempt to kill the process once
-  if (marked_malicious == 1) {
-    neon_info("PID %d is likely malicious; will be killed", pidnum);
-    kill_pgrp(pid, SIGKILL, 1);
+
+  if(raised == 1) {
+    // charge the overrun to the task's share of the device (a no-op
+    // under fcfs, which has no turns to push back)
+    neon_policy_penalize(did, pidnum, age);
+    if(level == NEON_WATCHDOG_KILL && malicious_kill != 0)
+      kill_pgrp(pid, SIGKILL, 1);
+    neon_warning("did %d : cid %d : pid %d : request running %lu ms : "
+                 "task %s%s", did, cid, pidnum, age / USEC_PER_MSEC,
+                 action[level],
+                 level == NEON_WATCHDOG_HOLD ? " (strike)" :
+                 (level == NEON_WATCHDOG_KILL && malicious_kill == 0 ?
+                  " --- not really, malicious_kill off" : ""));
+  }
+
+  put_task_struct(cpu_task);
+  put_pid(pid);
+
+  return raised;
+}
+
+/****************************************************************************/
+// watchdog_check
+/****************************************************************************/
+// check the age of a live request against the watchdog levels
+static int
+watchdog_check(neon_poll_t * const poll,
+               const unsigned int cid,
+               const unsigned int pid,
+               const unsigned long now)
+{
+  const unsigned long T   = malicious_T * USEC_PER_MSEC;
+  const unsigned long age = now - poll->chan[cid].wdog_ts;
+  neon_watchdog_t     level = NEON_WATCHDOG_OK;
+
+  if(T == 0 || pid == 0)
+    return 0;
+
+  if(age >= 4 * T)
+    level = NEON_WATCHDOG_KILL;
+  else if(age >= 2 * T)
+    level = NEON_WATCHDOG_HOLD;
+  else if(age >= T)
+    level = NEON_WATCHDOG_NICE;
+  else
+    return 0;
+
+  poll->chan[cid].suspect = 1;
+
+  return watchdog_escalate(pid, poll->did, cid, level, age, now);
+}
+
+/****************************************************************************/
+// watchdog_clear
+/****************************************************************************/
+// a task with a deprioritized or held request completed one; restore
+// it once no request of it has overrun for a full malicious_T (strikes
+// are kept, so repeat offenders get held longer). Returns 0 while the
+// task stays suspect
+static int
+watchdog_clear(const unsigned int pidnum,
+               const unsigned long now)
+{
+  const unsigned long T         = malicious_T * USEC_PER_MSEC;
+  struct pid         *pid       = find_get_pid(pidnum);
+  struct task_struct *cpu_task  = get_pid_task(pid, PIDTYPE_PID);
+  neon_task_t        *neon_task = NULL;
+  int                 cleared   = 1;
+  int                 restored  = 0;
+
+  if(cpu_task == NULL) {
+    put_pid(pid);
+    return 1;
+  }
+
+  write_lock(&cpu_task->neon_task_rwlock);
+  neon_task = (neon_task_t *) cpu_task->neon_task;
+  if(neon_task != NULL &&
+     neon_task->malicious > NEON_WATCHDOG_OK &&
+     neon_task->malicious < NEON_WATCHDOG_KILL) {
+    if(now - neon_task->wdog_ts >= T) {
+      neon_task->malicious = NEON_WATCHDOG_OK;
+      restored = 1;
+    } else
+      cleared = 0;
+  }
+  write_unlock(&cpu_task->neon_task_rwlock);
+
+  if(restored == 1)
+    neon_warning("pid %d : no overrun for %u ms : task restored",
+                 pidnum, malicious_T);
+
+  put_task_struct(cpu_task);
+  put_pid(pid);
+
+  return cleared;
+}
+
+/****************************************************************************/
+// watchdog_hold
+/****************************************************************************/
+// hold a submission of a task the watchdog put on hold; submissions
+// from the fault handler (irqs off) cannot sleep and go on, the
+// task's policy penalty still pushing back its turns
+static void
+watchdog_hold(const neon_task_t * const neon_task)
+{
+  const unsigned long until = ACCESS_ONCE(neon_task->hold_until);
+
+  if(irqs_disabled())
+    return;
+
+  if(neon_task->malicious >= NEON_WATCHDOG_HOLD &&
+     time_before(jiffies, until)) {
+    neon_debug("pid %d : submit held for %u ms", neon_task->pid,
+               jiffies_to_msecs(until - jiffies));
+    schedule_timeout_interruptible(until - jiffies);
   }
 
   return;
 }
 #endif // NEON_MALICIOUS_TERMINATOR
 
+/****************************************************************************/
+// polling_complete
+/****************************************************************************/
+// queue a completion event for a channel and account for it
+static inline void
+polling_complete(neon_poll_t * const poll,
+                 const unsigned int cid,
+                 const unsigned int pid,
+                 const unsigned long lag)
+{
+#ifdef NEON_MALICIOUS_TERMINATOR
+  if(poll->chan[cid].suspect != 0 && watchdog_clear(pid, now_usec()) != 0)
+    poll->chan[cid].suspect = 0;
+#endif // NEON_MALICIOUS_TERMINATOR
+  set_bit(cid, poll->bmp_comp);
+  poll->comp_pid[cid] = pid;
+  poll->ncomp++;
+  poll->lag_sum += lag;
+  if(lag > poll->lag_max)
+    poll->lag_max = lag;
+
+  return;
+}
+
+/****************************************************************************/
+// polling_complete_flush
+/****************************************************************************/
+// deliver the completions queued in this poll as one batch
+static inline void
+polling_complete_flush(neon_poll_t * const poll)
+{
+  const unsigned int nchan = neon_global.dev[poll->did].nchan;
+
+  if(bitmap_empty(poll->bmp_comp, nchan))
+    return;
+
+  neon_work_complete_batch(poll->did, poll->bmp_comp, poll->comp_pid);
+  bitmap_zero(poll->bmp_comp, nchan);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_refc_due
+/****************************************************************************/
+// check the channels whose prediction timer has expired; requests
+// still running are checked again after a (growing) retry back-off
+static void
+polling_refc_due(neon_poll_t * const poll)
+{
+  neon_dev_t    *dev  = &neon_global.dev[poll->did];
+  unsigned int   cid  = 0;
+  unsigned long  now  = now_usec();
+  unsigned long  lag  = 0;
+  unsigned int   pid  = 0;
+  const unsigned long ceil = polling_T * USEC_PER_MSEC;
+
+  for_each_set_bit(cid, poll->bmp_due, dev->nchan) {
+    neon_chan_poll_t *cpoll = &poll->chan[cid];
+    int complete = 0;
+
+    clear_bit(cid, poll->bmp_due);
+    if(test_bit(cid, dev->bmp_sub2comp) == 0)
+      continue;
+
+    complete = polling_chan_check(poll, cid, now, &pid, &lag);
+    if(complete == 1) {
+      polling_complete(poll, cid, pid, lag);
+      poll->npredict++;
+    } else {
+      predict_timer_start(cpoll, cpoll->retry);
+      cpoll->retry = min(cpoll->retry * 2, ceil);
+      poll->nretry++;
+    }
+  }
+  polling_complete_flush(poll);
+
+  return;
+}
+
 /****************************************************************************/
 // polling_refc_update
 /****************************************************************************/
+// poll the live channels of a device whose polling timer has expired
 static void
-polling_refc_update(void)
+polling_refc_update(neon_poll_t * const poll)
 {
-  neon_dev_t   *dev      = NULL;
+  const unsigned int did = poll->did;
+  neon_dev_t   *dev      = &neon_global.dev[did];
   neon_chan_t  *chan     = NULL;
-  unsigned int  did      = 0;
   unsigned int  cid      = 0;
-  unsigned int  refc_val = 0;
-
-  for(did = 0; did < neon_global.ndev; did++) {
-    unsigned int complete  = 0;
-    unsigned int likely_malicious = 0;
-    // scan through all active device channels (respective bit is set)
-    // update the scheduled work's reference counter value and, if
-    // the target value is hit, raise a new scheduling-completion event;
-    // if anyone has appeared to be maliciously using the GPU for a
-    // predefined number of periods, kill 'em
-    dev = &neon_global.dev[did];
-    likely_malicious = dev->nchan;
-    neon_debug("dev %d : sub2comp 0x%lx", did,
-              dev->bmp_sub2comp == NULL ? 0 : dev->bmp_sub2comp[0]);
-    if(!__bitmap_empty(dev->bmp_sub2comp, dev->nchan)) {
-      for_each_set_bit(cid, dev->bmp_sub2comp, dev->nchan) {
-        complete = 0;
+  unsigned int  ncomp    = 0;
+  unsigned long now      = 0;
+  unsigned int  likely_malicious = dev->nchan;
+
+  // scan through all active device channels (respective bit is set)
+  // update the scheduled work's reference counter value and, if
+  // the target value is hit, raise a new scheduling-completion event;
+  // if anyone has appeared to be maliciously using the GPU for
+  // (multiples of) malicious_T, throttle 'em, step by step
+  neon_debug("dev %d : sub2comp 0x%lx", did,
+             dev->bmp_sub2comp == NULL ? 0 : dev->bmp_sub2comp[0]);
+
+  now = now_usec();
+  poll->poll_ts = now;
+  poll->npoll++;
+
+  if(!__bitmap_empty(dev->bmp_sub2comp, dev->nchan)) {
+    // all refc loads happen in the dense table scan; the per-channel
+    // walk below only touches poller-private state
+    polling_table_scan(poll);
+    for_each_set_bit(cid, dev->bmp_sub2comp, dev->nchan) {
+      neon_chan_poll_t *cpoll = &poll->chan[cid];
+      if(test_bit(cid, poll->bmp_scan) != 0) {
+        polling_complete(poll, cid, poll->comp_pid[cid],
+                         now - cpoll->check_ts);
+        ncomp++;
+      }
+#ifdef NEON_MALICIOUS_TERMINATOR
+      else if(likely_malicious == dev->nchan) {
+        unsigned int pid = 0;
+        unsigned int seq = 0;
         chan = &dev->chan[cid];
-        if(spin_trylock(&chan->lock) == 0) {
-          neon_info("did %d : cid %d : chan locked",
-                      did, cid);
-          continue;
-        }
+        do {
+          seq = read_seqcount_begin(&chan->seq);
+          pid = chan->pid;
+        } while(read_seqcount_retry(&chan->seq, seq));
+        if(watchdog_check(poll, cid, pid, now) != 0)
+          likely_malicious = cid;
+      }
+#endif // NEON_MALICIOUS_TERMINATOR
+      cpoll->check_ts = now;
+    }
+  }
+  // If a (likely) malicious application has been abusing a
+  // channel, make sure to restart the watchdog for all other
+  // channels to avoid throttling respective processes by
+  // mistake (they should be given a chance to prove they are
+  // not malicious also as being queued behind the malicious
+  // guy made them look bad)
+  if(likely_malicious != dev->nchan &&
+     !__bitmap_empty(dev->bmp_sub2comp, dev->nchan)) {
+    for_each_set_bit(cid, dev->bmp_sub2comp, dev->nchan) {
+      if (cid != likely_malicious) {
+        chan = &dev->chan[cid];
+        neon_info("2nd chance for PID %d, using chan %d,"
+                  "to prove it's not malicious", chan->pid, cid);
+        poll->chan[cid].wdog_ts = now;
+      }
+    }
+  }
+  polling_complete_flush(poll);
 
-        if(unlikely(chan->refc_kvaddr == NULL)) {
-          neon_info("did %d, cid %d : pid %d : skip completing work",
-                    did, cid, chan->pid);
-          spin_unlock(&chan->lock);
-          continue;
-        }
+  polling_adapt(poll, ncomp);
 
-        refc_val = *((unsigned int *) chan->refc_kvaddr);
+  return;
+}
 
-        neon_debug("did %d : cid %d : pid %d : "
-                   "refc 0x%lx/0x%lx : sched_POLL",
-                   did, cid, chan->pid, refc_val,
-                   chan->refc_target);
+/****************************************************************************/
+// neon_poll_report
+/****************************************************************************/
+// per-device polling period and completion-detection lag report
+int
+neon_poll_report(char *buf,
+                 size_t len)
+{
+  unsigned int i   = 0;
+  int          ofs = 0;
+
+  ofs += scnprintf(buf + ofs, len - ofs,
+                   "did period(us) polls idle-skips completions predicted "
+                   "retries mwait-hits lag-avg(us) lag-max(us)\n");
+  for(i = 0; poll_array != NULL && i < neon_global.ndev; i++) {
+    const neon_poll_t *poll = &poll_array[i];
+    ofs += scnprintf(buf + ofs, len - ofs,
+                     "%3u %10lu %5lu %10lu %11lu %9lu %7lu %10lu %11lu %11lu\n",
+                     poll->did, poll->period, poll->npoll, poll->nidle,
+                     poll->ncomp,
+                     poll->npredict, poll->nretry, poll->nmwait,
+                     poll->ncomp > 0 ? poll->lag_sum / poll->ncomp : 0,
+                     poll->lag_max);
+  }
 
-        if(refc_val >= chan->refc_target) {
-          neon_debug("did %d : cid %d : pid %d : "
-                     "refc [?/0x%p, 0x%lx] : sched_COMPL",
-                     did, cid, chan->pid,
-                     chan->refc_kvaddr, chan->refc_target);
-          complete = 1;
-        }
-#ifdef NEON_MALICIOUS_TERMINATOR
-        else {
-          if(malicious_T != 0 && chan->pdt > 0) {
-            if(chan->pdt++ > (malicious_T / polling_T))
-              likely_malicious = cid;
-          }
-        }
-#endif // NEON_MALICIOUS_TERMINATOR        
-        spin_unlock(&chan->lock);
-        if(complete == 1)
-          neon_work_complete(did, cid, chan->pid);
-#ifdef NEON_MALICIOUS_TERMINATOR    
-        if(likely_malicious != dev->nchan) {
-          kill_malicious(chan->pid);
-          break;
-        }
-#endif // NEON_MALICIOUS_TERMINATOR
-      }
+  return ofs;
+}
+
+/****************************************************************************/
+// polling_resolve
+/****************************************************************************/
+// resolve the refc address and target of work submitted since the
+// last pass from its recorded index register value (parsing the
+// command buffer), and publish it if the work is already live. The
+// app's vmas and page tables are walked under its mmap_sem, with a
+// reference on its mm; a channel whose mm is busy (e.g. munmap) or
+// that got a newer value meanwhile stays queued for the next pass
+static void
+polling_resolve(neon_poll_t * const poll)
+{
+  neon_dev_t   *dev = &neon_global.dev[poll->did];
+  unsigned int  cid = 0;
+
+  for_each_set_bit(cid, poll->bmp_deferred, dev->nchan) {
+    neon_chan_t      *chan    = &dev->chan[cid];
+    neon_chan_poll_t *cpoll   = &poll->chan[cid];
+    neon_work_t      *work    = NULL;
+    struct mm_struct *mm      = NULL;
+    unsigned long     reg_idx = 0;
+    int               ret     = 0;
+
+    spin_lock(&chan->lock);
+    work = cpoll->resolve;
+    if(test_and_clear_bit(cid, poll->bmp_deferred) == 0 || work == NULL ||
+       work->ir->vma == NULL) {
+      spin_unlock(&chan->lock);
+      continue;
     }
-    // If a (likely) malicious application has been abusing a
-    // channel, make sure to reset the abuse counters
-    // for all other channels to avoid killing respective
-    // processes by mistake (they should be given a chance
-    // to prove they are not malicious also as being queued
-    // behind the malicious guy made them look bad)
-    if(likely_malicious != dev->nchan &&
-       !__bitmap_empty(dev->bmp_sub2comp, dev->nchan)) {
-      for_each_set_bit(cid, dev->bmp_sub2comp, dev->nchan) {
-        if (cid != likely_malicious) {
-          chan = &dev->chan[cid];
-          spin_lock(&chan->lock);
-          if (chan->pdt > 0) {
-            neon_info("2nd chance for PID %d, using chan %d,"
-                        "to prove it's not malicious", chan->pid, cid);
-            chan->pdt = 1;
-          }
-          spin_unlock(&chan->lock);
-        }
-      }
-      likely_malicious = dev->nchan;
+    // the work (and its ir map) cannot go while queued; the mm may
+    // be exiting already
+    mm = work->ir->vma->vm_mm;
+    if(atomic_inc_not_zero(&mm->mm_users) == 0) {
+      spin_unlock(&chan->lock);
+      continue;
+    }
+    reg_idx = work->reg_idx;
+    cpoll->resolving = 1;
+    spin_unlock(&chan->lock);
+
+    // never wait on mmap_sem: its writer may be stopping this work
+    if(down_read_trylock(&mm->mmap_sem) == 0) {
+      spin_lock(&chan->lock);
+      set_bit(cid, poll->bmp_deferred);
+      cpoll->resolving = 0;
+      spin_unlock(&chan->lock);
+      wake_up(&poll->resolve_wq);
+      mmput(mm);
+      continue;
+    }
+    ret = neon_work_update(work->ctx, work, reg_idx);
+    if(ret != 0) {
+      // untrackable; the work completes when the app stops it
+      neon_error("%s : did %d : cid %d : idx %ld : work update failure",
+                 __func__, poll->did, cid, reg_idx);
+      work->refc_kvaddr = 0;
+      work->refc_vaddr  = 0;
     }
+    up_read(&mm->mmap_sem);
+
+    spin_lock(&chan->lock);
+    cpoll->resolving = 0;
+    // a newer submit queued again: keep it unpublished, resolve anew
+    if(cpoll->resolve == work && test_bit(cid, poll->bmp_deferred) == 0) {
+      clear_bit(cid, poll->bmp_unresolved);
+      if(test_bit(cid, dev->bmp_sub2comp) != 0)
+        work_publish(work, chan);
+    }
+    spin_unlock(&chan->lock);
+    wake_up(&poll->resolve_wq);
+
+    mmput(mm);
   }
+
+  return;
+}
+
+/****************************************************************************/
+// polling_dev_fini
+/****************************************************************************/
+// stop a device's timers and release its polling state
+static void
+polling_dev_fini(neon_poll_t * const poll)
+{
+  unsigned int cid = 0;
+
+  if(hrtimer_cancel(&poll->timer) != 0)
+    neon_debug("did %d : Polling timer was busy when stopped", poll->did);
+  if(poll->chan != NULL) {
+    for(cid = 0; cid < neon_global.dev[poll->did].nchan; cid++)
+      hrtimer_cancel(&poll->chan[cid].timer);
+    kfree(poll->chan);
+    poll->chan = NULL;
+  }
+  kfree(poll->bmp_due);
+  kfree(poll->bmp_scan);
+  kfree(poll->bmp_unresolved);
+  kfree(poll->bmp_deferred);
+  kfree(poll->bmp_comp);
+  kfree(poll->comp_pid);
+  poll->bmp_due = NULL;
+  poll->bmp_scan = NULL;
+  poll->bmp_unresolved = NULL;
+  poll->bmp_deferred = NULL;
+  poll->bmp_comp = NULL;
+  poll->comp_pid = NULL;
+  polling_table_fini(&poll->table);
+
+  return;
+}
+
+/****************************************************************************/
+// polling_dev_init
+/****************************************************************************/
+// initialize a device's polling state and timers
+static int
+polling_dev_init(neon_poll_t * const poll,
+                 const unsigned int did)
+{
+  const unsigned int nchan = neon_global.dev[did].nchan;
+  unsigned int       cid   = 0;
+
+  poll->did = did;
+  poll->period = polling_T * USEC_PER_MSEC;
+  atomic_set(&poll->action, 0);
+  atomic_set(&poll->wake, 0);
+  atomic_set(&poll->affine, 0);
+  init_waitqueue_head(&poll->event_wq);
+  init_waitqueue_head(&poll->resolve_wq);
+  init_completion(&poll->exited);
+  hrtimer_init(&poll->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  poll->timer.function = &polling_timer_callback;
+  atomic_set(&poll->armed, 0);
+  poll->idle_ts = now_usec();
+
+  poll->bmp_due = (long *) kzalloc(BITS_TO_LONGS(nchan) * sizeof(long),
+                                   GFP_KERNEL);
+  poll->bmp_scan = (long *) kzalloc(BITS_TO_LONGS(nchan) * sizeof(long),
+                                    GFP_KERNEL);
+  poll->bmp_unresolved = (long *) kzalloc(BITS_TO_LONGS(nchan) * sizeof(long),
+                                          GFP_KERNEL);
+  poll->bmp_deferred = (long *) kzalloc(BITS_TO_LONGS(nchan) * sizeof(long),
+                                        GFP_KERNEL);
+  poll->bmp_comp = (long *) kzalloc(BITS_TO_LONGS(nchan) * sizeof(long),
+                                    GFP_KERNEL);
+  poll->comp_pid = (unsigned int *) kzalloc(nchan * sizeof(unsigned int),
+                                            GFP_KERNEL);
+  poll->chan = (neon_chan_poll_t *) kzalloc(nchan * sizeof(neon_chan_poll_t),
+                                            GFP_KERNEL);
+  if(poll->bmp_due == NULL || poll->bmp_scan == NULL ||
+     poll->bmp_unresolved == NULL || poll->bmp_deferred == NULL ||
+     poll->bmp_comp == NULL || poll->comp_pid == NULL ||
+     poll->chan == NULL || polling_table_init(&poll->table, nchan) != 0) {
+    neon_error("%s : did %d : polling state alloc failed", __func__, did);
+    kfree(poll->bmp_due);
+    kfree(poll->bmp_scan);
+    kfree(poll->bmp_unresolved);
+    kfree(poll->bmp_deferred);
+    kfree(poll->bmp_comp);
+    kfree(poll->comp_pid);
+    kfree(poll->chan);
+    poll->bmp_due = NULL;
+    poll->bmp_scan = NULL;
+    poll->bmp_unresolved = NULL;
+    poll->bmp_deferred = NULL;
+    poll->bmp_comp = NULL;
+    poll->comp_pid = NULL;
+    poll->chan = NULL;
+    polling_table_fini(&poll->table);
+    return -ENOMEM;
+  }
+  for(cid = 0; cid < nchan; cid++) {
+    neon_chan_poll_t *cpoll = &poll->chan[cid];
+    cpoll->did = did;
+    cpoll->cid = cid;
+    hrtimer_init(&cpoll->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cpoll->timer.function = &predict_timer_callback;
+  }
+
+  return 0;
 }
 
 /****************************************************************************/
 // event_thread_func
 /****************************************************************************/
-// the kernel-thread event-handling (callback) function
+// the per-device kernel-thread event-handling (callback) function
 static int
 event_thread_func(void *arg)
 {
+  neon_poll_t *poll = (neon_poll_t *) arg;
   DEFINE_WAIT(wait);
 
-  neon_debug("neonkthr starting");
+  neon_debug("did %d : neonkthr starting", poll->did);
 
   // detach user resources
-  daemonize("neonkthr");
+  daemonize("neonkthr%u", poll->did);
   // killable
   allow_signal(SIGKILL);
 
   while(1) {
-    prepare_to_wait(&neon_kthread_event_wait_queue, &wait,
-                    TASK_INTERRUPTIBLE);
-    schedule();
+    // in MWAIT mode, stay on the cpu while requests are live and
+    // poll as soon as the most urgent one completes
+    int mwait = polling_mwait_wait(poll);
+    if(mwait < 0) {
+      prepare_to_wait(&poll->event_wq, &wait, TASK_INTERRUPTIBLE);
+      // polling timers are only re-armed here, so do not sleep
+      // over an event raised while busy
+      if(atomic_read(&poll->wake) == 0)
+        schedule();
+      finish_wait(&poll->event_wq, &wait);
+    } else
+      cond_resched();
+    atomic_set(&poll->wake, 0);
+    if(mwait > 0)
+      atomic_set(&poll->action, 1);
 
     if(kthread_repeat) {
-      // update reference counters of live contexts->channels
-      polling_refc_update();
+      if(atomic_cmpxchg(&poll->affine, 1, 0) == 1) {
+        if(set_cpus_allowed_ptr(current, &poll->cpus) != 0)
+          neon_error("did %d : neonkthr affinity update failed",
+                     poll->did);
+        else {
+          char cpus[NEON_POLLING_CPUS_LEN] = { 0 };
+          cpulist_scnprintf(cpus, NEON_POLLING_CPUS_LEN, &poll->cpus);
+          neon_info("did %d : neonkthr on cpus %s", poll->did, cpus);
+        }
+      }
+      // resolve the refc of freshly submitted work before polling
+      if(!bitmap_empty(poll->bmp_deferred,
+                       neon_global.dev[poll->did].nchan))
+        polling_resolve(poll);
+      // update reference counters of live channels if the
+      // polling timer has expired, and re-arm the timer at
+      // the (adapted) polling period
+      if(atomic_cmpxchg(&poll->action, 1, 0) == 1) {
+        polling_refc_update(poll);
+        polling_timer_idle(poll);
+      }
+      // check channels whose predicted completion time has come
+      if(!bitmap_empty(poll->bmp_due, neon_global.dev[poll->did].nchan))
+        polling_refc_due(poll);
       // contact policy and handle service requests
       // (appropriate flags must have been set by policy timers)
-      neon_policy_event();
+      neon_policy_event(poll->did);
     } else
       break;
 
@@ -222,10 +1246,9 @@ event_thread_func(void *arg)
     }
   }
 
-  neon_debug("neonkthr exiting");
+  neon_debug("did %d : neonkthr exiting", poll->did);
 
-  finish_wait(&neon_kthread_event_wait_queue, &wait);
-  do_exit(0);
+  complete_and_exit(&poll->exited, 0);
 
   return 0;
 }
@@ -237,27 +1260,73 @@ event_thread_func(void *arg)
 int
 neon_sched_init(void)
 {
-  int ret = 0;
+  unsigned int i   = 0;
+  int          ret = 0;
+
+  // init per-device polling state; timers start at reset
+  poll_array = kzalloc(neon_global.ndev * sizeof(neon_poll_t), GFP_KERNEL);
+  if(poll_array == NULL) {
+    neon_error("%s : polling state alloc failed", __func__);
+    return -ENOMEM;
+  }
+  for(i = 0; i < neon_global.ndev; i++) {
+    ret = polling_dev_init(&poll_array[i], i);
+    if(ret != 0)
+      break;
+  }
 
-  // init kthread and sync q; will sleep till requested to poll
-  init_waitqueue_head(&neon_kthread_event_wait_queue);
+  // deferred rings sleep on policies, so each gets its own worker
+  if(ret == 0) {
+    ring_wq = alloc_workqueue("neon_ring", WQ_NON_REENTRANT, 0);
+    if(ring_wq == NULL) {
+      neon_error("%s : ring workqueue alloc failed", __func__);
+      ret = -ENOMEM;
+    }
+  }
 
-  // prepare polling; init polling kthread daemon
-  ret = kernel_thread(event_thread_func, NULL, CLONE_KERNEL);
-  if(ret < 0) {
-    neon_error("%s polling kthread creation failed \n",
-               __func__);
+  // policies must be in place before event kthreads start
+  if(ret == 0) {
+    ret = neon_policy_init();
+    if(ret != 0)
+      destroy_workqueue(ring_wq);
+  }
+  if(ret != 0) {
+    for(i = 0; i < neon_global.ndev; i++)
+      polling_dev_fini(&poll_array[i]);
+    kfree(poll_array);
+    poll_array = NULL;
+    ring_wq = NULL;
     return ret;
   }
+
+  // prepare polling; init one event kthread daemon per device;
+  // each will sleep till requested to poll or handle policy events
   kthread_repeat = 1;
-  hrtimer_init(&polling_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-  polling_timer.function = &polling_timer_callback;
+  for(i = 0; i < neon_global.ndev; i++) {
+    ret = kernel_thread(event_thread_func, &poll_array[i], CLONE_KERNEL);
+    if(ret < 0) {
+      neon_error("%s : did %d : polling kthread creation failed \n",
+                 __func__, i);
+      kthread_repeat = 0;
+      while(i-- > 0) {
+        neon_sched_wake(i);
+        wait_for_completion(&poll_array[i].exited);
+      }
+      neon_policy_fini();
+      destroy_workqueue(ring_wq);
+      ring_wq = NULL;
+      for(i = 0; i < neon_global.ndev; i++)
+        polling_dev_fini(&poll_array[i]);
+      kfree(poll_array);
+      poll_array = NULL;
+      return ret;
+    }
+  }
+  polling_cpus_update();
 
-  ret = neon_policy_init();
-  if(ret == 0)
-    neon_info("sched_init");
+  neon_info("sched_init");
 
-  return ret;
+  return 0;
 }
 
 /***************************************************************************/
@@ -267,7 +1336,8 @@ neon_sched_init(void)
 int
 neon_sched_fini(void)
 {
-  int ret = 0;
+  unsigned int i   = 0;
+  int          ret = 0;
 
   // this should not be possible given module task use count
   // but double checking never hurts
@@ -277,10 +1347,16 @@ neon_sched_fini(void)
   }
 
   kthread_repeat = 0;
-  wake_up_interruptible(&neon_kthread_event_wait_queue);
+  for(i = 0; i < neon_global.ndev; i++) {
+    neon_sched_wake(i);
+    wait_for_completion(&poll_array[i].exited);
+    polling_dev_fini(&poll_array[i]);
+  }
+  kfree(poll_array);
+  poll_array = NULL;
 
-  if(hrtimer_cancel(&polling_timer) != 0)
-    neon_debug("Polling timer was busy when stopped");
+  destroy_workqueue(ring_wq);
+  ring_wq = NULL;
 
   ret = neon_policy_fini();
   if(ret == 0)
@@ -312,10 +1388,21 @@ neon_sched_reengage(const neon_map_t * const map)
 void
 neon_sched_reset(unsigned int nctx)
 {
+  unsigned int i = 0;
+
   // adjust thread polling period
   if(nctx == 0) {
-    if(hrtimer_cancel(&polling_timer) != 0)
-      neon_debug("Polling timer was busy when stopped");
+    for(i = 0; i < neon_global.ndev; i++) {
+      neon_poll_t  *poll = &poll_array[i];
+      unsigned int  cid  = 0;
+      atomic_set(&poll->action, 0);
+      atomic_set(&poll->armed, 0);
+      if(hrtimer_cancel(&poll->timer) != 0)
+        neon_debug("did %d : Polling timer was busy when stopped", i);
+      for(cid = 0; cid < neon_global.dev[i].nchan; cid++)
+        hrtimer_cancel(&poll->chan[cid].timer);
+      bitmap_zero(poll->bmp_due, neon_global.dev[i].nchan);
+    }
   } else if (nctx == 1 ) {
     // proc/sysctl updates
     polling_T = _polling_T_;
@@ -330,15 +1417,53 @@ neon_sched_reset(unsigned int nctx)
       polling_T = NEON_POLLING_T_MAX;
     }
 
+    polling_floor = _polling_floor_;
+    if(polling_floor < NEON_POLLING_FLOOR_MIN) {
+      neon_error("Adjusting polling floor %u to min %d uSec",
+                 polling_floor, NEON_POLLING_FLOOR_MIN);
+      polling_floor = NEON_POLLING_FLOOR_MIN;
+    }
+    if(polling_floor > polling_T * USEC_PER_MSEC) {
+      neon_error("Adjusting polling floor %u to polling T %u",
+                 polling_floor, polling_T);
+      polling_floor = polling_T * USEC_PER_MSEC;
+    }
+
     if(_malicious_T_ != 0 && _malicious_T_ <= NEON_POLLING_T_MAX) {
       neon_error("Adjusting malicious T %u to default %u",
                  _malicious_T_, NEON_MALICIOUS_T_DEFAULT);
       malicious_T = NEON_MALICIOUS_T_DEFAULT;
     } else
       malicious_T = _malicious_T_;
+    malicious_hold = _malicious_hold_;
+    malicious_kill = _malicious_kill_;
 
-    polling_interval = ktime_set(0, polling_T * NSEC_PER_MSEC);
-    hrtimer_start(&polling_timer, polling_interval, HRTIMER_MODE_REL);
+    predict = _predict_;
+    submit_defer = _submit_defer_;
+
+    track_emulate = _track_emulate_;
+    track_ir_only = _track_ir_only_;
+    track_wronly = _track_wronly_;
+    track_watch = _track_watch_;
+
+    if(_polling_mwait_ != 0 && !boot_cpu_has(X86_FEATURE_MWAIT)) {
+      neon_error("No MONITOR/MWAIT on this cpu, polling_mwait 0x%x ignored",
+                 _polling_mwait_);
+      polling_mwait = 0;
+    } else
+      polling_mwait = _polling_mwait_;
+
+    // (re)pin event kthreads
+    polling_cpus_update();
+
+    // every device starts polling at the ceiling and adapts;
+    // polling timers are armed by the first submit (tickless)
+    for(i = 0; i < neon_global.ndev; i++) {
+      neon_poll_t *poll = &poll_array[i];
+      poll->period  = polling_T * USEC_PER_MSEC;
+      poll->poll_ts = 0;
+      poll->idle_ts = now_usec();
+    }
   } else {
     neon_error("%s : nctx %d : dunno what to do at this checkpoint",
                __func__, nctx);
@@ -389,7 +1514,7 @@ neon_hash_map_offset(unsigned long address,
 /**************************************************************************/
 // get cmd [addr, size] info for work, update work->cb if necessary
 static int
-update_work_cb_cmd(const struct _neon_ctx_t_ * const ctx,
+update_work_cb_cmd(struct _neon_ctx_t_ * const ctx,
                    neon_work_t *const work,
                    const unsigned long reg_idx_val,
                    unsigned long * const cmd_tuple)
@@ -399,7 +1524,6 @@ update_work_cb_cmd(const struct _neon_ctx_t_ * const ctx,
   unsigned long  bottom   = 0;
   unsigned long  top      = 0;
   unsigned long  cmd_mmio = 0;
-  neon_map_t    *map      = NULL;
 
   if(unlikely(reg_idx_val == 0)) {
     neon_info("rb exhausted - using last entry");
@@ -435,41 +1559,23 @@ update_work_cb_cmd(const struct _neon_ctx_t_ * const ctx,
   cmd_tuple[1] = top >> 8;
 
   // We need to identify the actual command-buffer address
-  // and we 'll use the cmd_mmio, ctx and dev key to searh the
-  // map_list for it. The only canonical information we have managed
-  // to identify in the trace for the cb is its size. In OpenCL, cb and
-  // rb share the same buffer of size 0x402000; the rb takes the lower
-  // 2 pages. In OpenGL it looks like the cb has a size of 0x200000,
-  // but further command buffers appear to be possible to be added.
+  // and we 'll use the cmd_mmio and dev key to search the ctx's
+  // gpu-view range index for it. The only canonical information we
+  // have managed to identify in the trace for the cb is its size.
+  // In OpenCL, cb and rb share the same buffer of size 0x402000; the
+  // rb takes the lower 2 pages. In OpenGL it looks like the cb has a
+  // size of 0x200000, but further command buffers appear to be
+  // possible to be added.
   if(unlikely(work->cb == NULL ||
               cmd_mmio <  work->cb->mmio_gpu ||
               cmd_mmio >= work->cb->mmio_gpu + work->cb->size)) {
-    work->cb = NULL;
-    list_for_each_entry(map, &ctx->map_list.entry, entry) {
-      neon_debug("SEARCH_CB work/map : "
-                 "map 0x%x/0x%x : ctx 0x%x/0x%x : dev 0x%x/0x%x : "
-                 "cmd_mmio 0x%lx  E [0x%lx, 0x%lx]/[0x%lx, 0x%lx]",
-                 work->cb == NULL ? 0 : work->cb->key, map->key,
-                 work->rb->ctx_key, map->ctx_key,
-                 work->rb->dev_key, map->dev_key,
-                 cmd_mmio,
-                 work->cb == NULL ? 0 : work->cb->mmio_gpu,
-                 work->cb == NULL ? 0 : work->cb->size,
-                 map->mmio_gpu, map->size);
-      if(map->mmio_gpu != 0 &&
-         map->ctx_key == work->rb->ctx_key &&
-         map->dev_key == work->rb->dev_key &&
-         cmd_mmio >= map->mmio_gpu &&
-         cmd_mmio <  map->mmio_gpu + map->size) {
-        work->cb = map;
-        neon_debug("UPDATE_CB : ctx 0x%x : dev 0x%x : did %d : cid %d : "
-                   "NEW cb == 0x%lx [0x%lx, 0x%lx]",
-                   work->rb->ctx_key, work->rb->dev_key, work->did, work->cid,
-                   work->cb->key, work->cb->mmio_gpu, work->cb->size);
-        break;
-      }
-    }
-    if(work->cb == NULL) {
+    work->cb = neon_ctx_search_gpu(ctx, work->rb->dev_key, cmd_mmio);
+    if(work->cb != NULL)
+      neon_debug("UPDATE_CB : ctx 0x%x : dev 0x%x : did %d : cid %d : "
+                 "NEW cb == 0x%lx [0x%lx, 0x%lx]",
+                 work->rb->ctx_key, work->rb->dev_key, work->did, work->cid,
+                 work->cb->key, work->cb->mmio_gpu, work->cb->size);
+    else {
       neon_error("%s : ctx 0x%x : dev 0x%x : did %d : cid %d : "
                  "idx-val %d : tuple [0x%lx, 0x%lx] : can't find cb",
                  __func__, work->rb->ctx_key, work->rb->dev_key,
@@ -496,33 +1602,20 @@ update_work_cb_cmd(const struct _neon_ctx_t_ * const ctx,
 /**************************************************************************/
 // update work->rc if necessary
 static inline int
-update_work_rc(const struct _neon_ctx_t_ * const ctx,
+update_work_rc(struct _neon_ctx_t_ * const ctx,
                neon_work_t * const work,
                const unsigned long * const refc_tuple)
 {
-  neon_map_t *map = NULL;
-
   // Get the virtual addess (CPU view) of the reference counter
   if(unlikely(work->rc == NULL ||
               refc_tuple[0] <  work->rc->mmio_gpu ||
               refc_tuple[0] >= work->rc->mmio_gpu + work->rc->size)) {
     // update rc
-    work->rc = NULL;
-    list_for_each_entry(map, &ctx->map_list.entry, entry) {
-      neon_debug("work ctx 0x%x : dev 0x%x : mmio 0x%x : "
-                 "in map(0x%x, 0x%x)->[0x%lx, 0x%lx] ? SEARCH ",
-                 work->rb->ctx_key, work->rb->dev_key, refc_tuple[0],
-                 map->ctx_key, map->dev_key, map->mmio_gpu,
-                 map->mmio_gpu + map->size);
-      if(map->mmio_gpu != 0 &&
-         map->ctx_key == work->rb->ctx_key &&
-         map->dev_key == work->rb->dev_key &&
-         refc_tuple[0] >= map->mmio_gpu &&
-         refc_tuple[0] <  map->mmio_gpu + map->size) {
-        work->rc = map;
-        break;
-      }
-    }
+    work->rc = neon_ctx_search_gpu(ctx, work->rb->dev_key, refc_tuple[0]);
+    neon_debug("work ctx 0x%x : dev 0x%x : mmio 0x%lx : "
+               "in map 0x%x ? SEARCH ",
+               work->rb->ctx_key, work->rb->dev_key, refc_tuple[0],
+               work->rc != NULL ? work->rc->key : 0);
     if(work->rc == NULL)
       return -1;
   }
@@ -530,6 +1623,45 @@ update_work_rc(const struct _neon_ctx_t_ * const ctx,
   return 0;
 }
 
+/**************************************************************************/
+// work_ring
+/**************************************************************************/
+// deferred submit: take the latest captured index register value,
+// wait for the policy on the task's behalf, then ring the doorbell
+// with it. Each captured value is taken (and submitted) once; stores
+// captured while this runs queue the item again
+static void
+work_ring(struct work_struct *ring)
+{
+  neon_work_t   *work   = container_of(ring, neon_work_t, ring);
+  neon_chan_t   *chan   = &neon_global.dev[work->did].chan[work->cid];
+  unsigned long  shadow = 0;
+
+  clear_bit(NEON_RING_PENDING, &work->ring_flags);
+  smp_mb__after_clear_bit();
+
+  shadow = xchg(&work->shadow_idx, 0);
+  if(shadow == 0 || ACCESS_ONCE(work->ring_stop) != 0)
+    goto work_ring_done;
+
+  // record the value for refc resolution, queued by the submit
+  neon_work_defer(work, (u32) shadow);
+  neon_work_submit(work, 1);
+
+  if(ACCESS_ONCE(work->ring_stop) == 0)
+    writel((u32) shadow, chan->ir_kvaddr);
+
+ work_ring_done:
+  // no longer in flight, unless a value was captured meanwhile (its
+  // capture sets the bit after the shadow, so one of us sees the other)
+  clear_bit(NEON_RING_INFLIGHT, &work->ring_flags);
+  smp_mb__after_clear_bit();
+  if(ACCESS_ONCE(work->shadow_idx) != 0)
+    set_bit(NEON_RING_INFLIGHT, &work->ring_flags);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_work_init
 /**************************************************************************/
@@ -569,7 +1701,7 @@ neon_work_init(neon_task_t * const neon_task,
   }
 
   // create work struct
-  work = (neon_work_t *) kzalloc(sizeof(neon_work_t), GFP_KERNEL);
+  work = (neon_work_t *) neon_obj_alloc(NEON_OBJ_WORK, GFP_KERNEL);
   if(work == NULL) {
     neon_error("%s : alloc work struct failed \n", __func__);
     return NULL;
@@ -585,6 +1717,7 @@ neon_work_init(neon_task_t * const neon_task,
   work->neon_task   = neon_task;
   work->refc_vaddr  = 0;
   work->refc_target = 0;
+  INIT_WORK(&work->ring, work_ring);
   switch(rb->size) {
   case NEON_RB_SIZE_GRAPHICS:
     work->workload = NEON_WORKLOAD_GRAPHICS;
@@ -612,9 +1745,26 @@ neon_work_init(neon_task_t * const neon_task,
 inline int
 neon_work_fini(neon_work_t * const work)
 {
-  neon_dev_t  *dev         = &neon_global.dev[work->did];
-  neon_chan_t *chan        = &dev->chan[work->cid];
-  unsigned int refc_target = 0;
+  neon_dev_t       *dev         = &neon_global.dev[work->did];
+  neon_chan_t      *chan        = &dev->chan[work->cid];
+  neon_poll_t      *poll        = &poll_array[work->did];
+  neon_chan_poll_t *cpoll       = &poll->chan[work->cid];
+  unsigned int      refc_target = 0;
+
+  // leave the resolution queue, and let a resolution in progress end
+  spin_lock(&chan->lock);
+  if(cpoll->resolve == work) {
+    cpoll->resolve = NULL;
+    clear_bit(work->cid, poll->bmp_deferred);
+    clear_bit(work->cid, poll->bmp_unresolved);
+  }
+  work->reg_pending = 0;
+  spin_unlock(&chan->lock);
+  wait_event(poll->resolve_wq, ACCESS_ONCE(cpoll->resolving) == 0);
+
+  // a deferred ring still blocked at the policy has been let go by
+  // neon_work_stop; wait for it to drop out
+  cancel_work_sync(&work->ring);
 
   if(test_bit(work->cid, dev->bmp_sub2comp) != 0) {
     spin_lock(&chan->lock);
@@ -688,7 +1838,16 @@ neon_work_update(struct _neon_ctx_t_ * const ctx,
   refc_vaddr = work->rc->vma->vm_start + refc_tuple[0] - work->rc->mmio_gpu;
   if(unlikely(work->refc_vaddr != refc_vaddr)) {
     struct page *refc_page = NULL;
+    // huge mappings resolve to the small page holding the counter
     refc_page = neon_follow_page(work->rc->vma, refc_vaddr);
+    if(unlikely(refc_page == NULL)) {
+      neon_error("%s : did %d : cid %d : refc 0x%lx : no page mapped",
+                 __func__, work->did, work->cid, refc_vaddr);
+      return -1;
+    }
+    // never unmapped: pollers load through published refc addresses
+    // without a lock, and may do so after the work is gone (the
+    // loaded value is then dropped by their seqcount retry)
     work->refc_kvaddr = (unsigned long) vm_map_ram(&refc_page, 1,
                                                    -1, PAGE_KERNEL);
     work->refc_kvaddr += (refc_vaddr & ~PAGE_MASK);
@@ -721,6 +1880,28 @@ neon_work_print(const neon_work_t * const work)
   return;
 }
 
+/**************************************************************************/
+// neon_work_defer
+/**************************************************************************/
+// Record the index register value written by a new submit; called in
+// the fault path, which must stay cheap, so the command buffer is
+// parsed (neon_work_update) later by the device's event kthread. The
+// value is only queued for resolution by the neon_work_submit that
+// follows, so a work is never resolved ahead of its submit
+inline void
+neon_work_defer(neon_work_t * const work,
+                unsigned long reg_idx)
+{
+  neon_chan_t *chan = &neon_global.dev[work->did].chan[work->cid];
+
+  spin_lock(&chan->lock);
+  work->reg_idx = reg_idx;
+  work->reg_pending = 1;
+  spin_unlock(&chan->lock);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_work_submit
 /**************************************************************************/
@@ -729,11 +1910,14 @@ int
 neon_work_submit(neon_work_t * const work,
                  unsigned int really)
 {
-  neon_dev_t    *dev         = &neon_global.dev[work->did];
-  neon_chan_t   *chan        = &dev->chan[work->cid];
-  int            ret         = 0;
-
-  if(likely(really == 1)) {
+  neon_dev_t       *dev     = &neon_global.dev[work->did];
+  neon_chan_t      *chan    = &dev->chan[work->cid];
+  neon_chan_poll_t *cpoll   = &poll_array[work->did].chan[work->cid];
+  unsigned long     pred    = 0;
+  unsigned int      resolve = 0;
+  int               ret     = 0;
+
+  if(likely(really != 0)) {
     // reset request processing time; this channel is
     // assumed to be empty because previous request
     // is either already complete or new request is
@@ -742,6 +1926,12 @@ neon_work_submit(neon_work_t * const work,
     chan->pdt = 0;
     spin_unlock(&chan->lock);
     
+#ifdef NEON_MALICIOUS_TERMINATOR
+    // a task the watchdog put on hold waits here first
+    if(really != NEON_SUBMIT_OBSERVED)
+      watchdog_hold(work->neon_task);
+#endif // NEON_MALICIOUS_TERMINATOR
+
     // submit request --- might block here until
     // scheduler allows us to proceed (request
     // will be issued as the specific policy decides)
@@ -753,62 +1943,134 @@ neon_work_submit(neon_work_t * const work,
   // before policy-submit ; verify that everything
   // is OK with saving it to channel AFTER
 
+  // first check due when the running estimate says the request
+  // should be done; unknown channels start at the polling floor
+  cpoll->retry    = polling_floor;
+  cpoll->check_ts = now_usec();
+  pred = neon_policy_predict(work->did, work->cid);
+  if(pred == 0)
+    pred = polling_floor;
+  cpoll->due  = cpoll->check_ts + pred;
+  cpoll->work = work;
+  cpoll->wdog_ts = cpoll->check_ts;
+
   // start counting request processing time; if submit
   // has returned, it means request has been scheduled
-  // save work in channel
+  // save work in channel (refc might still be resolving)
   spin_lock(&chan->lock);
-  chan->pid = work->neon_task->pid;
-  chan->refc_kvaddr = (void *) work->refc_kvaddr;
-  chan->refc_target = work->refc_target;
+  // queue the index register value recorded for this submit; the
+  // channel is published without a refc till it is resolved
+  if(work->reg_pending != 0) {
+    work->reg_pending = 0;
+    cpoll->resolve = work;
+    set_bit(work->cid, poll_array[work->did].bmp_unresolved);
+    set_bit(work->cid, poll_array[work->did].bmp_deferred);
+    resolve = 1;
+  }
+  work_publish(work, chan);
   chan->pdt = 1;
 
   // mark channel as "live" for the kthread to know to query
   set_bit(work->cid, dev->bmp_sub2comp);
   
   spin_unlock(&chan->lock);
+
+  // wake up an idle poller (or one waiting on another refc)
+  polling_timer_kick(&poll_array[work->did]);
+  if(resolve != 0 || polling_mwait_on(work->did) != 0)
+    neon_sched_wake(work->did);
+
+  predict_timer_start(cpoll, pred);
   
   neon_debug("did %d : cid %d : pid %d : refc=0x%lx work submitted %s",
              work->did, work->cid, work->neon_task->pid,
-             work->refc_target, really == 1 ? "really" : "fake");
+             work->refc_target, really != 0 ? "really" : "fake");
 
   return ret;
 }
 
 /**************************************************************************/
-// neon_work_complete
+// neon_work_submit_deferred
 /**************************************************************************/
-// Completion notification raised by the polling thread or the app
-// at stop time 
-inline void
-neon_work_complete(unsigned int did,
-                   unsigned int cid,
-                   unsigned int pid)
+// Non-blocking submit from the fault path: capture the index register
+// value in the shadow doorbell and leave submission and ringing to a
+// worker; stores arriving before it takes the value are coalesced
+// into its ring, and the item is queued once till it runs
+void
+neon_work_submit_deferred(neon_work_t * const work,
+                          u32 reg_idx)
+{
+  xchg(&work->shadow_idx, NEON_SHADOW_SET | reg_idx);
+  set_bit(NEON_RING_INFLIGHT, &work->ring_flags);
+  if(test_and_set_bit(NEON_RING_PENDING, &work->ring_flags) == 0)
+    queue_work(ring_wq, &work->ring);
+
+  neon_debug("did %d : cid %d : pid %d : idx 0x%x : submit deferred",
+             work->did, work->cid, work->neon_task->pid, reg_idx);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_work_unring
+/**************************************************************************/
+// Drop deferred rings of a work about to be stopped; one already
+// submitted (or blocked) is reaped by neon_work_fini
+void
+neon_work_unring(neon_work_t * const work)
+{
+  ACCESS_ONCE(work->ring_stop) = 1;
+  smp_wmb();
+
+  return;
+}
+
+/**************************************************************************/
+// work_complete_claim
+/**************************************************************************/
+// mark work as complete in dev's live channel bitmap; returns 0 if
+// someone else (poller or app at stop time) already did
+static inline int
+work_complete_claim(const unsigned int did,
+                    const unsigned int cid,
+                    const unsigned int pid)
 {
-  neon_dev_t  *dev    = &neon_global.dev[did];
-  neon_chan_t *chan   = &dev->chan[cid];
-  unsigned long check = 0;
+  neon_dev_t *dev = &neon_global.dev[did];
 
-  // mark work as complete in dev's live channel bitmap
   if(test_and_clear_bit(cid, dev->bmp_sub2comp) == 0) {
     neon_debug("did %d : cid %d : pid %d : work already completed",
                did, cid, pid);
-    return;
-  } else {
-    spin_lock(&chan->lock);    
-    check = chan->refc_target;
-    spin_unlock(&chan->lock);
+    return 0;
   }
+  polling_table_remove(&poll_array[did].table, cid);
+  hrtimer_try_to_cancel(&poll_array[did].chan[cid].timer);
+  clear_bit(cid, poll_array[did].bmp_due);
 
-  // notify scheduling policy of completion event
-  neon_policy_complete(did, cid, pid);
+  return 1;
+}
+
+/**************************************************************************/
+// work_complete_clear
+/**************************************************************************/
+// remove completed work from channel
+static inline void
+work_complete_clear(const unsigned int did,
+                    const unsigned int cid,
+                    const unsigned int pid)
+{
+  neon_dev_t    *dev   = &neon_global.dev[did];
+  neon_chan_t   *chan  = &dev->chan[cid];
+  unsigned long  check = 0;
 
-  // remove from channel
   // ignore if new request has been submitted
   spin_lock(&chan->lock);
+  check = chan->refc_target;
   if(test_bit(cid, dev->bmp_sub2comp) == 0){
+    write_seqcount_begin(&chan->seq);
     chan->pid         = 0;
     chan->refc_kvaddr = NULL;
     chan->refc_target = 0;
+    write_seqcount_end(&chan->seq);
     chan->pdt = 0;
   }
   spin_unlock(&chan->lock);
@@ -819,6 +2081,56 @@ neon_work_complete(unsigned int did,
   return;
 }
 
+/**************************************************************************/
+// neon_work_complete
+/**************************************************************************/
+// Completion notification raised by the polling thread or the app
+// at stop time 
+inline void
+neon_work_complete(unsigned int did,
+                   unsigned int cid,
+                   unsigned int pid)
+{
+  if(work_complete_claim(did, cid, pid) == 0)
+    return;
+
+  // notify scheduling policy of completion event
+  neon_policy_complete(did, cid, pid);
+
+  work_complete_clear(did, cid, pid);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_work_complete_batch
+/**************************************************************************/
+// Completion notification for all channels set in bmp (owned by
+// pid[cid]), raised by the polling thread; bmp is consumed
+void
+neon_work_complete_batch(unsigned int did,
+                         long * const bmp,
+                         const unsigned int * const pid)
+{
+  const unsigned int nchan = neon_global.dev[did].nchan;
+  unsigned int       cid   = 0;
+
+  for_each_set_bit(cid, bmp, nchan)
+    if(work_complete_claim(did, cid, pid[cid]) == 0)
+      clear_bit(cid, bmp);
+
+  if(bitmap_empty(bmp, nchan))
+    return;
+
+  // notify scheduling policy of all completion events at once
+  neon_policy_complete_batch(did, bmp, pid);
+
+  for_each_set_bit(cid, bmp, nchan)
+    work_complete_clear(did, cid, pid[cid]);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_work_start
 /**************************************************************************/
@@ -852,3 +2164,491 @@ neon_work_stop(const neon_work_t * const work)
 
   return ret;
 }
+
+#ifdef NEON_SELFTEST
+
+#define NEON_BENCH_READS   1000000 // snapshot reads per publication bench
+#define NEON_BENCH_WAKES   1000    // writes waited for per wake bench mode
+#define NEON_BENCH_CHANS   96      // live channels in the scan bench
+#define NEON_BENCH_SCANS   10000   // scans per scan bench method
+
+/**************************************************************************/
+// bench_cpus
+/**************************************************************************/
+// two distinct online cpus for a bench's threads; -1 if there are none
+static int
+bench_cpus(unsigned int * const cpu0,
+           unsigned int * const cpu1)
+{
+  *cpu0 = cpumask_first(cpu_online_mask);
+  *cpu1 = cpumask_next(*cpu0, cpu_online_mask);
+
+  return *cpu1 < nr_cpu_ids ? 0 : -1;
+}
+
+/**************************************************************************/
+// bench_thread
+/**************************************************************************/
+// start fn(arg) as a kthread bound to cpu; NULL on failure
+static struct task_struct *
+bench_thread(int (*fn)(void *),
+             void * const arg,
+             const unsigned int cpu)
+{
+  struct task_struct *task = NULL;
+
+  task = kthread_create(fn, arg, "neon_bench/%u", cpu);
+  if(IS_ERR(task))
+    return NULL;
+  kthread_bind(task, cpu);
+  wake_up_process(task);
+
+  return task;
+}
+
+/**************************************************************************/
+// bench_park
+/**************************************************************************/
+// have a bench thread that is done wait for its kthread_stop
+static int
+bench_park(void)
+{
+  set_current_state(TASK_INTERRUPTIBLE);
+  while(!kthread_should_stop()) {
+    schedule();
+    set_current_state(TASK_INTERRUPTIBLE);
+  }
+  __set_current_state(TASK_RUNNING);
+
+  return 0;
+}
+
+/**************************************************************************/
+// publication bench: a writer thread publishes a channel's (pid, refc,
+// target) tuple as work_publish does, while a reader thread takes
+// snapshots of it as polling_chan_check does, and as the poller did
+// before, with spin_trylock, skipping the channel when it is taken
+typedef struct {
+  neon_chan_t       chan;
+  unsigned int      refc[2];
+  // writer pause between publications (nSec)
+  unsigned int      pause;
+  unsigned long     writes;
+  // reader results
+  unsigned long     seq_cycles;
+  unsigned long     seq_retries;
+  unsigned long     seq_torn;
+  unsigned long     lock_cycles;
+  unsigned long     lock_skipped;
+  unsigned int      sink;
+  struct completion done;
+} bench_publish_t;
+
+/**************************************************************************/
+// bench_publish_writer
+/**************************************************************************/
+static int
+bench_publish_writer(void *arg)
+{
+  bench_publish_t * const b    = arg;
+  neon_chan_t     * const chan = &b->chan;
+  unsigned int            n    = 0;
+
+  while(!kthread_should_stop()) {
+    n++;
+    spin_lock(&chan->lock);
+    write_seqcount_begin(&chan->seq);
+    chan->pid         = n;
+    chan->refc_kvaddr = &b->refc[n & 1];
+    chan->refc_target = n;
+    write_seqcount_end(&chan->seq);
+    spin_unlock(&chan->lock);
+    ACCESS_ONCE(b->writes) = n;
+    if(b->pause != 0)
+      ndelay(b->pause);
+    if((n & 0xffff) == 0)
+      cond_resched();
+  }
+
+  return 0;
+}
+
+/**************************************************************************/
+// bench_publish_reader
+/**************************************************************************/
+static int
+bench_publish_reader(void *arg)
+{
+  bench_publish_t * const b      = arg;
+  neon_chan_t     * const chan   = &b->chan;
+  void                   *kvaddr = NULL;
+  unsigned long           target = 0;
+  unsigned int            pid    = 0;
+  unsigned int            val    = 0;
+  unsigned int            seq    = 0;
+  unsigned int            tries  = 0;
+  unsigned long           i      = 0;
+  cycles_t                t0     = 0;
+
+  // wait for the writer to be at it
+  while(ACCESS_ONCE(b->writes) == 0)
+    cpu_relax();
+
+  t0 = get_cycles();
+  for(i = 0; i < NEON_BENCH_READS; i++) {
+    tries = 0;
+    do {
+      seq    = read_seqcount_begin(&chan->seq);
+      pid    = chan->pid;
+      kvaddr = chan->refc_kvaddr;
+      target = chan->refc_target;
+      val   += *((volatile unsigned int *) kvaddr);
+      tries++;
+    } while(read_seqcount_retry(&chan->seq, seq));
+    b->seq_retries += tries - 1;
+    if(kvaddr != &b->refc[pid & 1] || target != pid)
+      b->seq_torn++;
+  }
+  b->seq_cycles = get_cycles() - t0;
+
+  t0 = get_cycles();
+  for(i = 0; i < NEON_BENCH_READS; i++) {
+    if(spin_trylock(&chan->lock) == 0) {
+      b->lock_skipped++;
+      continue;
+    }
+    pid    = chan->pid;
+    kvaddr = chan->refc_kvaddr;
+    target = chan->refc_target;
+    val   += *((volatile unsigned int *) kvaddr);
+    spin_unlock(&chan->lock);
+  }
+  b->lock_cycles = get_cycles() - t0;
+  b->sink = val;
+
+  complete(&b->done);
+
+  return bench_park();
+}
+
+/**************************************************************************/
+// publish_bench
+/**************************************************************************/
+// time snapshot reads of a channel published back to back, then every
+// uSec, by another cpu: seqcount retries vs. trylock skips (each skip
+// delays a completion by a polling period); fails on a torn snapshot
+static int
+publish_bench(void)
+{
+  static const unsigned int  pauses[] = { 0, 1000 };
+  bench_publish_t           *b        = NULL;
+  struct task_struct        *reader   = NULL;
+  struct task_struct        *writer   = NULL;
+  unsigned int               cpu0     = 0;
+  unsigned int               cpu1     = 0;
+  unsigned int               i        = 0;
+  int                        ret      = 0;
+
+  if(bench_cpus(&cpu0, &cpu1) != 0) {
+    neon_report("publish bench : needs two cpus : skipped");
+    return 0;
+  }
+
+  b = kmalloc(sizeof(*b), GFP_KERNEL);
+  if(b == NULL)
+    return -1;
+
+  for(i = 0; i < ARRAY_SIZE(pauses) && ret == 0; i++) {
+    memset(b, 0, sizeof(*b));
+    spin_lock_init(&b->chan.lock);
+    seqcount_init(&b->chan.seq);
+    b->chan.refc_kvaddr = &b->refc[0];
+    b->pause = pauses[i];
+    init_completion(&b->done);
+
+    writer = bench_thread(bench_publish_writer, b, cpu1);
+    reader = writer == NULL ? NULL :
+      bench_thread(bench_publish_reader, b, cpu0);
+    if(reader == NULL) {
+      if(writer != NULL)
+        kthread_stop(writer);
+      ret = -1;
+      break;
+    }
+    wait_for_completion(&b->done);
+    kthread_stop(writer);
+    kthread_stop(reader);
+
+    neon_report("publish bench : writer pause %u ns : %lu writes : "
+                "seqcount cycles/read %lu retries %lu torn %lu : "
+                "trylock cycles/read %lu skipped %lu (%lu%%)",
+                b->pause, b->writes,
+                b->seq_cycles / NEON_BENCH_READS, b->seq_retries,
+                b->seq_torn, b->lock_cycles / NEON_BENCH_READS,
+                b->lock_skipped, b->lock_skipped * 100 / NEON_BENCH_READS);
+    if(b->seq_torn != 0) {
+      neon_error("%s : %lu torn snapshots", __func__, b->seq_torn);
+      ret = -1;
+    }
+  }
+  kfree(b);
+
+  return ret;
+}
+
+/**************************************************************************/
+// wake bench: a writer thread stands in for the GPU's semaphore write
+// and stamps each write; a waiter on another cpu waits for it as the
+// device kthread does, on MONITOR/MWAIT or on an hrtimer period at the
+// polling floor, and takes the write-to-wake latency
+typedef struct {
+  // the watched word, alone on its cache line as a refc would be
+  unsigned int      word ____cacheline_aligned;
+  unsigned int      armed ____cacheline_aligned;
+  ktime_t           stamp;
+  unsigned int      mwait;
+  // waiter results (nSec)
+  unsigned long     sum;
+  unsigned long     max;
+  struct completion done;
+} bench_wake_t;
+
+/**************************************************************************/
+// bench_wake_writer
+/**************************************************************************/
+static int
+bench_wake_writer(void *arg)
+{
+  bench_wake_t * const b     = arg;
+  unsigned int         round = 0;
+
+  for(round = 1; round <= NEON_BENCH_WAKES; round++) {
+    while(ACCESS_ONCE(b->armed) != round) {
+      if(kthread_should_stop())
+        return 0;
+      cpu_relax();
+    }
+    // land at varying points of the waiter's period
+    udelay(10 + (round * 7) % 40);
+    b->stamp = ktime_get();
+    smp_wmb();
+    ACCESS_ONCE(b->word) = round;
+  }
+
+  return bench_park();
+}
+
+/**************************************************************************/
+// bench_wake_waiter
+/**************************************************************************/
+static int
+bench_wake_waiter(void *arg)
+{
+  bench_wake_t * const b      = arg;
+  ktime_t              period =
+    ns_to_ktime((u64) polling_floor * NSEC_PER_USEC);
+  unsigned long        ns     = 0;
+  unsigned int         round  = 0;
+
+  for(round = 1; round <= NEON_BENCH_WAKES; round++) {
+    ACCESS_ONCE(b->armed) = round;
+    while(ACCESS_ONCE(b->word) != round) {
+      if(b->mwait != 0) {
+        __monitor(&b->word, 0, 0);
+        smp_mb();
+        if(ACCESS_ONCE(b->word) == round)
+          break;
+        __mwait(0, 0);
+      } else {
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        schedule_hrtimeout_range(&period, 0, HRTIMER_MODE_REL);
+      }
+    }
+    smp_rmb();
+    ns = ktime_to_ns(ktime_sub(ktime_get(), b->stamp));
+    b->sum += ns;
+    if(ns > b->max)
+      b->max = ns;
+  }
+  complete(&b->done);
+
+  return bench_park();
+}
+
+/**************************************************************************/
+// wake_bench
+/**************************************************************************/
+// time how soon a waiter notices another cpu's write, on MWAIT (when
+// the cpu has it) and on an hrtimer at the polling floor
+static int
+wake_bench(void)
+{
+  static const char * const  modes[] = { "hrtimer", "mwait" };
+  bench_wake_t              *b       = NULL;
+  struct task_struct        *waiter  = NULL;
+  struct task_struct        *writer  = NULL;
+  unsigned int               cpu0    = 0;
+  unsigned int               cpu1    = 0;
+  unsigned int               mwait   = 0;
+  int                        ret     = 0;
+
+  if(bench_cpus(&cpu0, &cpu1) != 0) {
+    neon_report("wake bench : needs two cpus : skipped");
+    return 0;
+  }
+
+  b = kmalloc(sizeof(*b), GFP_KERNEL);
+  if(b == NULL)
+    return -1;
+
+  for(mwait = 0; mwait < ARRAY_SIZE(modes); mwait++) {
+    if(mwait != 0 && !boot_cpu_has(X86_FEATURE_MWAIT)) {
+      neon_report("wake bench : mwait : no MWAIT : skipped");
+      continue;
+    }
+    memset(b, 0, sizeof(*b));
+    b->mwait = mwait;
+    init_completion(&b->done);
+
+    writer = bench_thread(bench_wake_writer, b, cpu1);
+    waiter = writer == NULL ? NULL :
+      bench_thread(bench_wake_waiter, b, cpu0);
+    if(waiter == NULL) {
+      if(writer != NULL)
+        kthread_stop(writer);
+      ret = -1;
+      break;
+    }
+    wait_for_completion(&b->done);
+    kthread_stop(writer);
+    kthread_stop(waiter);
+
+    neon_report("wake bench : %s : period %u us : %u wakes : "
+                "latency avg %lu ns max %lu ns", modes[mwait],
+                polling_floor, NEON_BENCH_WAKES,
+                b->sum / NEON_BENCH_WAKES, b->max);
+  }
+  kfree(b);
+
+  return ret;
+}
+
+/**************************************************************************/
+// scan_bench
+/**************************************************************************/
+// time finding the complete channels among NEON_BENCH_CHANS live ones,
+// every third complete, each refc on its own cache line: the walk the
+// poller used to make (channel bitmap, channel lock, refc load) vs. the
+// dense table scan; fails if the two disagree
+static int
+scan_bench(void)
+{
+  const unsigned int  nchan    = NEON_BENCH_CHANS;
+  const size_t        bmp_size = BITS_TO_LONGS(nchan) * sizeof(long);
+  neon_poll_table_t  *tbl      = NULL;
+  neon_chan_t        *chans    = NULL;
+  unsigned int      **refc     = NULL;
+  unsigned int       *pid      = NULL;
+  long               *bmp_sub  = NULL;
+  long               *bmp_walk = NULL;
+  long               *bmp_scan = NULL;
+  unsigned long       walk     = 0;
+  unsigned long       scan     = 0;
+  unsigned int        cid      = 0;
+  unsigned int        r        = 0;
+  cycles_t            t0       = 0;
+  int                 ret      = -1;
+
+  tbl      = kzalloc(sizeof(*tbl), GFP_KERNEL);
+  chans    = kzalloc(nchan * sizeof(neon_chan_t), GFP_KERNEL);
+  refc     = kzalloc(nchan * sizeof(unsigned int *), GFP_KERNEL);
+  pid      = kzalloc(nchan * sizeof(unsigned int), GFP_KERNEL);
+  bmp_sub  = kzalloc(bmp_size, GFP_KERNEL);
+  bmp_walk = kzalloc(bmp_size, GFP_KERNEL);
+  bmp_scan = kzalloc(bmp_size, GFP_KERNEL);
+  if(tbl == NULL || chans == NULL || refc == NULL || pid == NULL ||
+     bmp_sub == NULL || bmp_walk == NULL || bmp_scan == NULL)
+    goto out;
+  if(polling_table_init(tbl, nchan) != 0)
+    goto out;
+  for(cid = 0; cid < nchan; cid++) {
+    refc[cid] = kmalloc(L1_CACHE_BYTES, GFP_KERNEL);
+    if(refc[cid] == NULL)
+      goto out;
+  }
+
+  for(cid = 0; cid < nchan; cid++) {
+    neon_chan_t * const chan = &chans[cid];
+    *refc[cid] = cid;
+    spin_lock_init(&chan->lock);
+    seqcount_init(&chan->seq);
+    chan->pid         = 1000 + cid;
+    chan->refc_kvaddr = refc[cid];
+    chan->refc_target = cid % 3 == 0 ? cid : cid + 1;
+    polling_table_insert(tbl, cid, chan->pid, chan->refc_kvaddr,
+                         chan->refc_target, 0);
+    __set_bit(cid, bmp_sub);
+  }
+
+  t0 = get_cycles();
+  for(r = 0; r < NEON_BENCH_SCANS; r++) {
+    bitmap_zero(bmp_walk, nchan);
+    for_each_set_bit(cid, bmp_sub, nchan) {
+      neon_chan_t * const chan = &chans[cid];
+      spin_lock(&chan->lock);
+      if(*((volatile unsigned int *) chan->refc_kvaddr) >=
+         chan->refc_target) {
+        __set_bit(cid, bmp_walk);
+        pid[cid] = chan->pid;
+      }
+      spin_unlock(&chan->lock);
+    }
+  }
+  walk = get_cycles() - t0;
+
+  t0 = get_cycles();
+  for(r = 0; r < NEON_BENCH_SCANS; r++)
+    table_scan(tbl, nchan, bmp_scan, pid);
+  scan = get_cycles() - t0;
+
+  neon_report("scan bench : %u live channels : %d complete : "
+              "channel walk cycles/scan %lu : table scan cycles/scan %lu",
+              nchan, bitmap_weight(bmp_scan, nchan),
+              walk / NEON_BENCH_SCANS, scan / NEON_BENCH_SCANS);
+  if(!bitmap_equal(bmp_walk, bmp_scan, nchan) ||
+     bitmap_weight(bmp_scan, nchan) != (nchan + 2) / 3) {
+    neon_error("%s : table scan and channel walk disagree", __func__);
+    goto out;
+  }
+  ret = 0;
+
+out:
+  if(refc != NULL)
+    for(cid = 0; cid < nchan; cid++)
+      kfree(refc[cid]);
+  if(tbl != NULL)
+    polling_table_fini(tbl);
+  kfree(tbl);
+  kfree(chans);
+  kfree(refc);
+  kfree(pid);
+  kfree(bmp_sub);
+  kfree(bmp_walk);
+  kfree(bmp_scan);
+
+  return ret;
+}
+
+/**************************************************************************/
+// neon_sched_selftest
+/**************************************************************************/
+// time the poller's lock-free paths against threads standing in for
+// submitters; 0 on success
+int
+neon_sched_selftest(void)
+{
+  return scan_bench() != 0 || publish_bench() != 0 ||
+    wake_bench() != 0 ? -1 : 0;
+}
+
+#endif // NEON_SELFTEST
@@ -9,8 +9,14 @@
 #define __NEON_SCHED_H__
 
 #include <linux/spinlock.h> // task lock
+#include <linux/hrtimer.h>  // polling timers
+#include <linux/wait.h>     // event wait queues
+#include <linux/cpumask.h>  // event kthread affinity
+#include <linux/completion.h> // event kthread exit
+#include <linux/workqueue.h> // deferred doorbell rings
 #include <neon/neon_face.h> // neon interface
 #include "neon_core.h"      // neon_chan
+#include "neon_help.h"      // report knobs
 
 /***************************************************************************/
 // Enable potentiall malicious task killing
@@ -19,19 +25,71 @@
 /***************************************************************************/
 // sys/proc managed options
 
-// polling thresholds
+// polling thresholds; polling_T is the ceiling of the adaptive
+// per-device polling period, polling_floor its floor
 #define NEON_POLLING_T_MIN              1 //    1 mSec
 #define NEON_POLLING_T_MAX           1000 //    1  Sec
 #define NEON_POLLING_T_DEFAULT          1 //    1 mSec
+#define NEON_POLLING_FLOOR_MIN         10 //   10 uSec
+#define NEON_POLLING_FLOOR_DEFAULT     50 //   50 uSec
 #define NEON_MALICIOUS_T_DEFAULT    60000 //   60  Sec
+// watchdog: submissions held for malicious_hold, doubling per strike
+// (up to 2^HOLD_SHIFT_MAX times); killing is opt-in
+#define NEON_MALICIOUS_HOLD_DEFAULT    10 //   10 mSec
+#define NEON_MALICIOUS_HOLD_SHIFT_MAX   8 //   x256
+#define NEON_MALICIOUS_KILL_DEFAULT     0 //   1=true/0=false
+// completion prediction; with per-channel prediction timers on,
+// periodic polling is only a safety net at SAFETY_X * polling_T
+#define NEON_PREDICT_DEFAULT            1 //   1=true/0=false
+#define NEON_POLLING_SAFETY_X          10 //   x polling_T
+// per-device MONITOR/MWAIT completion waiting, as a device bitmask
+// (bit i = device i, for the first 32 devices); ignored on cpus
+// without MWAIT
+#define NEON_POLLING_MWAIT_DEFAULT      0 //   none
+// non-blocking submission: an (emulable) index register store is only
+// captured, the faulting thread moves on and the doorbell is rung
+// later on its behalf, once the policy lets the request through
+#define NEON_SUBMIT_DEFER_DEFAULT       0 //   1=true/0=false
 
-extern wait_queue_head_t neon_kthread_event_wait_queue;
+// per-device event kthread cpus, as ';'-separated cpu lists
+// (one per device; an empty list means the device's NUMA node)
+#define NEON_POLLING_CPUS_LEN         128
 
 extern unsigned int _polling_T_;
 extern unsigned int polling_T;
 
+extern unsigned int _polling_floor_;
+extern unsigned int polling_floor;
+
+extern char _polling_cpus_[NEON_POLLING_CPUS_LEN];
+
+extern unsigned int _predict_;
+extern unsigned int predict;
+
+extern unsigned int _polling_mwait_;
+extern unsigned int polling_mwait;
+
+extern unsigned int _submit_defer_;
+extern unsigned int submit_defer;
+
+extern char polling_report[];
+int neon_poll_report(char *buf, size_t len);
+
 extern unsigned int _malicious_T_;
 extern unsigned int malicious_T;
+extern unsigned int _malicious_hold_;
+extern unsigned int malicious_hold;
+extern unsigned int _malicious_kill_;
+extern unsigned int malicious_kill;
+
+// watchdog escalation levels of a task whose request overruns,
+// reached at 1x, 2x and 4x malicious_T respectively
+typedef enum {
+  NEON_WATCHDOG_OK,    // not suspected
+  NEON_WATCHDOG_NICE,  // deprioritized by the policy
+  NEON_WATCHDOG_HOLD,  // submissions held at the fault path
+  NEON_WATCHDOG_KILL   // killed (malicious_kill) or reported as such
+} neon_watchdog_t;
 
 #define NEON_MALICIOUS_KNOB  {                  \
     .procname = "malicious_T",                  \
@@ -40,6 +98,20 @@ extern unsigned int malicious_T;
       .mode = 0666,                             \
       .proc_handler = &proc_dointvec,           \
       }
+#define NEON_MALICIOUS_HOLD_KNOB  {             \
+    .procname = "malicious_hold",               \
+      .data = &_malicious_hold_,                \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_MALICIOUS_KILL_KNOB  {             \
+    .procname = "malicious_kill",               \
+      .data = &_malicious_kill_,                \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
 #define NEON_POLLING_KNOB  {                    \
     .procname = "polling_T",                    \
       .data = &_polling_T_,                     \
@@ -47,6 +119,158 @@ extern unsigned int malicious_T;
       .mode = 0666,                             \
       .proc_handler = &proc_dointvec,           \
       }
+#define NEON_POLLING_FLOOR_KNOB  {              \
+    .procname = "polling_floor",                \
+      .data = &_polling_floor_,                 \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_POLLING_CPUS_KNOB  {               \
+    .procname = "polling_cpus",                 \
+      .data = _polling_cpus_,                   \
+      .maxlen = NEON_POLLING_CPUS_LEN,          \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dostring,           \
+      }
+#define NEON_PREDICT_KNOB  {                    \
+    .procname = "predict",                      \
+      .data = &_predict_,                       \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_POLLING_MWAIT_KNOB  {              \
+    .procname = "polling_mwait",                \
+      .data = &_polling_mwait_,                 \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_SUBMIT_DEFER_KNOB  {               \
+    .procname = "submit_defer",                 \
+      .data = &_submit_defer_,                  \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_POLLING_REPORT_KNOB                                \
+  NEON_REPORT_KNOB("polling_stats", polling_report, neon_poll_report)
+
+/**************************************************************************/
+// dense per-device table of live (refc, target, cid) entries, scanned by
+// the poller instead of walking scattered channel structs
+#define NEON_POLL_NOSLOT   UINT_MAX  // channel not in the table
+#define NEON_POLL_PREFETCH 4         // refc entries prefetched ahead
+
+typedef struct {
+  // number of live entries, packed at [0, n)
+  unsigned int n;
+  // per-entry reference counter kernel address
+  void **refc;
+  // per-entry reference counter target value
+  unsigned long *target;
+  // per-entry predicted completion time (uSec)
+  unsigned long *due;
+  // per-entry channel id and owner pid
+  unsigned int *cid;
+  unsigned int *pid;
+  // channel id -> entry index, NEON_POLL_NOSLOT if not live
+  unsigned int *slot;
+  // publishes entries to the lock-free poller scan
+  seqcount_t seq;
+  // serializes writers (submit, complete)
+  spinlock_t lock;
+} ____cacheline_aligned_in_smp neon_poll_table_t;
+
+/**************************************************************************/
+// per-channel completion prediction state
+typedef struct {
+  // associated device id [0, neon_global.ndev)
+  unsigned int did;
+  // associated channel id [0, dev->nchan)
+  unsigned int cid;
+  // prediction (and retry) high rez timer
+  struct hrtimer timer;
+  // current retry back-off (uSec)
+  unsigned long retry;
+  // timestamp of last refc check or submit (uSec)
+  unsigned long check_ts;
+  // predicted completion time of the live request (uSec)
+  unsigned long due;
+  // watchdog start time of the live request (uSec)
+  unsigned long wdog_ts;
+  // the live request has overrun malicious_T
+  unsigned int suspect;
+  // work last submitted on this channel
+  struct _neon_work_t_ *work;
+  // submitted work whose index register value awaits resolution
+  // (protected by the channel's lock)
+  struct _neon_work_t_ *resolve;
+  // the event kthread is resolving resolve's refc
+  unsigned int resolving;
+} neon_chan_poll_t;
+
+// per-device completion polling and event kthread state
+typedef struct {
+  // associated device id [0, neon_global.ndev)
+  unsigned int did;
+  // event kthread wait queue
+  wait_queue_head_t event_wq;
+  // event raised since the kthread last looked
+  atomic_t wake;
+  // cpu affinity update flag
+  atomic_t affine;
+  // cpus the event kthread is allowed to run on
+  struct cpumask cpus;
+  // event kthread exit notification
+  struct completion exited;
+  // current polling period (uSec) within [polling_floor, polling_T]
+  unsigned long period;
+  // polling event flag
+  atomic_t action;
+  // polling high rez timer
+  struct hrtimer timer;
+  // polling timer armed; cleared while no channel is live (tickless)
+  atomic_t armed;
+  // timestamp the polling timer was last left unarmed (uSec)
+  unsigned long idle_ts;
+  // per-channel prediction state
+  neon_chan_poll_t *chan;
+  // channels whose prediction timer has expired
+  long *bmp_due;
+  // channels whose refc is yet to be resolved from the index register
+  // (published without a refc meanwhile)
+  long *bmp_unresolved;
+  // channels with an index register value queued for resolution
+  long *bmp_deferred;
+  // woken as a resolution ends (see neon_work_fini)
+  wait_queue_head_t resolve_wq;
+  // live refc table
+  neon_poll_table_t table;
+  // channels found complete by the last table scan
+  long *bmp_scan;
+  // channels found complete, delivered to the policy as one batch
+  long *bmp_comp;
+  // owner pid of each channel in bmp_comp
+  unsigned int *comp_pid;
+  // timestamp of last poll (uSec)
+  unsigned long poll_ts;
+  // number of polls
+  unsigned long npoll;
+  // number of polls avoided while no channel was live
+  unsigned long nidle;
+  // number of MWAIT wake-ups on a completed refc
+  unsigned long nmwait;
+  // number of completions detected (by prediction timers)
+  unsigned long ncomp;
+  unsigned long npredict;
+  // number of prediction timer retries
+  unsigned long nretry;
+  // accumulated and worst completion-detection lag bound (uSec)
+  unsigned long lag_sum;
+  unsigned long lag_max;
+} neon_poll_t;
 
 /**************************************************************************/
 // gpu workload type
@@ -87,14 +311,35 @@ typedef struct _neon_work_t_ {
   unsigned long refc_kvaddr;
   // target refc value
   unsigned long refc_target;
+  // index register value of the last submit, resolved into refc lazily
+  unsigned long reg_idx;
+  // reg_idx recorded, to be queued for resolution at submit
+  unsigned int reg_pending;
   // flag marking request is part of a computational kernel/gfx call (2/3)
   unsigned long part_of_call;
   // workload type
   neon_workload_t workload;
+  // shadow doorbell: index register value captured by a deferred
+  // submit (| NEON_SHADOW_SET), consumed (xchg) by the ring worker and
+  // written to the real register once the request is let go
+  unsigned long shadow_idx;
+  // ring item queued and not yet running (NEON_RING_PENDING); a
+  // captured value not yet written to the register (NEON_RING_INFLIGHT)
+  unsigned long ring_flags;
+  // set once the work is going away; deferred rings are dropped
+  unsigned int ring_stop;
+  // deferred submit-and-ring item
+  struct work_struct ring;
   // entry in ctx's work-list
   struct list_head entry;
 } neon_work_t;
 
+// shadow doorbell holds a value not rung yet
+#define NEON_SHADOW_SET   (1UL << 32)
+// ring_flags bits
+#define NEON_RING_PENDING  0
+#define NEON_RING_INFLIGHT 1
+
 /**************************************************************************/
 // scheduling events and polling kernel thread interface
 int neon_hash_map_offset(unsigned long address,
@@ -108,18 +353,35 @@ int  neon_work_update(struct _neon_ctx_t_ * const ctx,
                       neon_work_t * const work,
                       unsigned long reg_idx);
 void neon_work_print(const neon_work_t * const work);
+void neon_work_defer(neon_work_t * const work,
+                     unsigned long reg_idx);
 
 int  neon_work_start(neon_work_t * const work);
 int  neon_work_stop(const neon_work_t * const work);
+// submit of a request already rung at the hardware (e.g. caught by a
+// write watchpoint); accounted like a real one, but never held
+#define NEON_SUBMIT_OBSERVED 2
 int  neon_work_submit(neon_work_t * const work,
                       unsigned int really);
+void neon_work_submit_deferred(neon_work_t * const work,
+                               u32 reg_idx);
+void neon_work_unring(neon_work_t * const work);
 void neon_work_complete(unsigned int did,
                         unsigned int cid,
                         unsigned int pid);
+void neon_work_complete_batch(unsigned int did,
+                              long * const bmp,
+                              const unsigned int * const pid);
+
+void neon_sched_wake(const unsigned int did);
 
 int  neon_sched_init(void);
 int  neon_sched_fini(void);
 void neon_sched_reset(unsigned int nctx);
 int  neon_sched_reengage(const struct _neon_map_t_ * const map);
 
+#ifdef NEON_SELFTEST
+int  neon_sched_selftest(void);
+#endif // NEON_SELFTEST
+
 #endif // __NEON_SCHED_H__
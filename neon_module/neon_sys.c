@@ -72,7 +72,9 @@ rqst_safe(unsigned int ctx_key,
   case RQST_PRE_MAPIN:
   case RQST_POST_MMAP:
     map = (neon_map_t *) arg;
+    map->ctx = ctx;
     list_add(&map->entry, &ctx->map_list.entry);
+    neon_ctx_index_map(ctx, map);
     neon_debug("ctx key 0x%x : dev key 0x%x : map key 0x%x : "
                "map \"offset\" 0x%lx : map enlisted",
                map->ctx_key, map->dev_key, map->key, map->offset);
@@ -80,11 +82,13 @@ rqst_safe(unsigned int ctx_key,
     break;
   case RQST_POST_MAPIN:
     map->offset = arg;
+    neon_ctx_index_map(ctx, map);
     neon_debug("map 0x%x : offset 0x%lx  now set",
                map_key, arg);
     break;
   case RQST_POST_GPUVIEW:
     map->mmio_gpu = arg;
+    neon_ctx_index_map(ctx, map);
     neon_debug("map 0x%x : mmio_gpu 0x%lx now set",
                map_key, arg);
     ret = 0;
@@ -389,8 +393,13 @@ neon_uptr_read(const unsigned int pid,
     return val;
   }
 
+  // huge mappings resolve to the small page holding ptr
   page     = neon_follow_page(vma, ptr);
   page_ofs = ptr & ~PAGE_MASK;
+  if(page == NULL) {
+    neon_error("%s : uv 0x%lx : no page mapped", __func__, ptr);
+    return 0;
+  }
   if(page_ofs + sizeof(int) <= PAGE_SIZE) {
     // we choose vm_map_ramp over get_user_pages+kmap only to be on the
     // safe side wrt availability of kernel logival addresses;
@@ -67,8 +67,11 @@ static void issue_timeslice(sched_dev_t  * const sched_dev,
 static void complete_timeslice(sched_dev_t  * const sched_dev,
                                sched_work_t * const sched_work,
                                sched_task_t * const sched_task);
-static void event_timeslice(void);
+static void event_timeslice(sched_dev_t * const sched_dev);
 static int  reengage_map_timeslice(const neon_map_t * const map);
+static void penalize_timeslice(sched_dev_t  * const sched_dev,
+                               sched_task_t * const sched_task,
+                               const unsigned long usec);
 
 neon_policy_face_t neon_policy_timeslice = {
   .init = init_timeslice,
@@ -82,7 +85,8 @@ neon_policy_face_t neon_policy_timeslice = {
   .issue = issue_timeslice,
   .complete = complete_timeslice,
   .event = event_timeslice,
-  .reengage_map = reengage_map_timeslice
+  .reengage_map = reengage_map_timeslice,
+  .penalize = penalize_timeslice
 };
 
 /****************************************************************************/
@@ -227,7 +231,7 @@ timeslice_timer_callback(struct hrtimer *timer)
         neon_debug("did %d : alarm timer callback @ %ld", sched_dev->id,
                    (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC));
       atomic_set(&timeslice_dev->action, 1);
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
+      neon_sched_wake(sched_dev->id);
     }
     read_unlock(&sched_dev->lock);
   }
@@ -440,7 +444,7 @@ stop_timeslice(sched_dev_t  * const sched_dev,
   if(hrtimer_try_to_cancel(&sched_dev->TS(token_timer)) != -1) {
     if(atomic_read(&neon_global.ctx_live) > 0) {
       atomic_set(&sched_dev->TS(action), 1);
-      wake_up_interruptible(&neon_kthread_event_wait_queue);
+      neon_sched_wake(sched_dev->id);
     }
   }
 
@@ -615,71 +619,61 @@ complete_timeslice(sched_dev_t  * const sched_dev,
 /**************************************************************************/
 // asynchronous event handler --- token alarm raised event handling
 static void
-event_timeslice(void)
+event_timeslice(sched_dev_t * const sched_dev)
 {
-  unsigned int i = 0;
-  struct timespec now_ts  = { 0 };
-  sched_dev_t  *sched_dev = NULL;
+  const unsigned int i           = sched_dev->id;
+  neon_dev_t        *neon_dev    = &neon_global.dev[i];
+  unsigned int       nchan       = neon_dev->nchan;
+  sched_task_t      *curr_holder = NULL;
+  sched_task_t      *last_holder = NULL;
+  unsigned int       retries     = 0;
+  struct timespec    now_ts      = { 0 };
+
+  if(atomic_cmpxchg(&sched_dev->TS(action), 1, 0) == 0)
+    return;
 
   getnstimeofday(&now_ts);
-  for(i = 0; i < neon_global.ndev; i++ ) {
-    neon_dev_t   *neon_dev    = &neon_global.dev[i];
-    unsigned int  nchan       = neon_dev->nchan;
-    sched_task_t *curr_holder = NULL;
-    sched_task_t *last_holder = NULL;
-    unsigned int  retries     = 0;
-
-    sched_dev = &sched_dev_array[i];
 
-    if(atomic_cmpxchg(&sched_dev->TS(action), 1, 0) == 0)
-      continue;
-    
-    /* if(!atomic_read(&sched_dev->TS(action))) */
-    /*   continue; */
-    /* else */
-    /*   atomic_set(&sched_dev->TS(action), 0); */
-
-    write_lock(&sched_dev->lock);
-    last_holder = sched_dev->TS(token_holder);
-    if(last_holder != NULL &&
-       !list_is_singular(&sched_dev->stask_list.entry)) {
-      if(disengage != 0 &&
-         !bitmap_empty(last_holder->bmp_start2stop, nchan))
-        neon_policy_update(sched_dev, last_holder);
-      if(!bitmap_empty(last_holder->bmp_issue2comp, nchan)) {
-        // there exists pending request from last task-holder,
-        // update will happen at the end of pending request
-        // but block already to make sure we don't have any request leaks
-        if(disengage != 0)
-          neon_policy_reengage_task(sched_dev, last_holder, 1);
-        sched_dev->TS(update_ts) = (unsigned long)      \
-          (timespec_to_ns(&now_ts) / NSEC_PER_USEC);        
-        neon_info("did %d : holder %d --- still busy @ alarm %ld",
-                  sched_dev->id, last_holder->pid,
-                  (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC));
-        write_unlock(&sched_dev->lock);
-        continue;
-      }
+  write_lock(&sched_dev->lock);
+  last_holder = sched_dev->TS(token_holder);
+  if(last_holder != NULL &&
+     !list_is_singular(&sched_dev->stask_list.entry)) {
+    if(disengage != 0 &&
+       !bitmap_empty(last_holder->bmp_start2stop, nchan))
+      neon_policy_update(sched_dev, last_holder);
+    if(!bitmap_empty(last_holder->bmp_issue2comp, nchan)) {
+      // there exists pending request from last task-holder,
+      // update will happen at the end of pending request
+      // but block already to make sure we don't have any request leaks
+      if(disengage != 0)
+        neon_policy_reengage_task(sched_dev, last_holder, 1);
+      sched_dev->TS(update_ts) = (unsigned long)      \
+        (timespec_to_ns(&now_ts) / NSEC_PER_USEC);        
+      neon_info("did %d : holder %d --- still busy @ alarm %ld",
+                sched_dev->id, last_holder->pid,
+                (unsigned long) (timespec_to_ns(&now_ts) / NSEC_PER_USEC));
+      write_unlock(&sched_dev->lock);
+      return;
     }
-    // get a task with no significant ( > T ) penalty
-    retries = update_token_holder(sched_dev);
-    curr_holder = sched_dev->TS(token_holder);
-    neon_debug("did %d : retries %d : holder %d --> %d : alarm UPDTd",
-               i, retries, last_holder == NULL ? 0 : last_holder->pid,
-               curr_holder == NULL ? 0 : curr_holder->pid);
-    write_unlock(&sched_dev->lock);
-
-    if(hrtimer_try_to_cancel(&sched_dev->TS(token_timer)) != -1) {
-      if(sched_dev->id == NEON_MAIN_GPU_DID)
-        neon_debug("did %d : alarm cancel @ %ld and restart", 
-                    sched_dev->id, (unsigned long)              \
-                    (timespec_to_ns(&now_ts) / NSEC_PER_USEC));
-      hrtimer_start(&sched_dev->TS(token_timer), timeslice_interval,
-                    HRTIMER_MODE_REL);
-    } else
-      neon_error("%s : could not cancel timeslice timer", __func__);
   }
-    
+  // get a task with no significant ( > T ) penalty
+  retries = update_token_holder(sched_dev);
+  curr_holder = sched_dev->TS(token_holder);
+  neon_debug("did %d : retries %d : holder %d --> %d : alarm UPDTd",
+             i, retries, last_holder == NULL ? 0 : last_holder->pid,
+             curr_holder == NULL ? 0 : curr_holder->pid);
+  write_unlock(&sched_dev->lock);
+
+  if(hrtimer_try_to_cancel(&sched_dev->TS(token_timer)) != -1) {
+    if(sched_dev->id == NEON_MAIN_GPU_DID)
+      neon_debug("did %d : alarm cancel @ %ld and restart", 
+                  sched_dev->id, (unsigned long)              \
+                  (timespec_to_ns(&now_ts) / NSEC_PER_USEC));
+    hrtimer_start(&sched_dev->TS(token_timer), timeslice_interval,
+                  HRTIMER_MODE_REL);
+  } else
+    neon_error("%s : could not cancel timeslice timer", __func__);
+
   return;
 }
 
@@ -725,3 +719,20 @@ reengage_map_timeslice(const neon_map_t * const map)
   // is not set in proc values
   return 1;
 }
+
+/**************************************************************************/
+// penalize_timeslice
+/**************************************************************************/
+// charge a task as overuse; it skips turns till it is paid off
+static void
+penalize_timeslice(sched_dev_t  * const sched_dev,
+                   sched_task_t * const sched_task,
+                   const unsigned long usec)
+{
+  sched_task->TS(overuse) += usec;
+
+  neon_info("did %d : pid %d : overuse %ld uSec : penalized",
+            sched_dev->id, sched_task->pid, sched_task->TS(overuse));
+
+  return;
+}
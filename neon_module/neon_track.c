@@ -8,20 +8,37 @@
 #include <linux/spinlock.h>  // required for pte_*#
 #include <linux/kdebug.h>    // DIE_NOTIFY
 #include <linux/slab.h>      // kfree
+#include <linux/percpu.h>    // pending-fault slots
+#include <linux/hash.h>      // hash_long
+#include <linux/string.h>    // memset
+#include <linux/timex.h>     // get_cycles
+#include <linux/hw_breakpoint.h> // write watchpoints
+#include <linux/uaccess.h>   // __copy_from_user_inatomic
+#include <linux/mutex.h>     // watch_mutex
+#include <linux/workqueue.h> // watched-store submissions
+#include <linux/kthread.h>   // self-test threads
+#include <linux/mman.h>      // self-test mappings
+#include <linux/mmu_context.h> // use_mm
+#include <linux/delay.h>     // msleep
 #include <asm/atomic.h>      // atomics
 #include <asm/pgtable.h>     // pte_* and friends
 #include <asm/tlbflush.h>    // __flush_tlb_one
+#include <asm/io.h>          // writel
 #include <asm/debugreg.h>    // DR_STEP
 #include <asm/pf_in.h>       // fault decoder
 #include "neon_sched.h"
 #include "neon_control.h"
 #include "neon_track.h"
+#include "neon_policy.h"
 #include "neon_help.h"
 // #include "neon_sched.h"
 
 /****************************************************************************/
 // Early declarations
 
+// watched-store submission
+static void watch_submit(struct work_struct *ws);
+
 // fault->step handler
 static int neon_trap_handler(unsigned long condition, struct pt_regs *regs);
 
@@ -38,6 +55,280 @@ struct notifier_block nb_die = {
   .notifier_call = neon_die_notifier
 };
 
+// sys/proc managed options
+unsigned int _track_emulate_ = NEON_TRACK_EMULATE_DEFAULT;
+unsigned int track_emulate   = NEON_TRACK_EMULATE_DEFAULT;
+unsigned int _track_ir_only_ = NEON_TRACK_IR_ONLY_DEFAULT;
+unsigned int track_ir_only   = NEON_TRACK_IR_ONLY_DEFAULT;
+unsigned int _track_wronly_  = NEON_TRACK_WRONLY_DEFAULT;
+unsigned int track_wronly    = NEON_TRACK_WRONLY_DEFAULT;
+unsigned int _track_watch_   = NEON_TRACK_WATCH_DEFAULT;
+unsigned int track_watch     = NEON_TRACK_WATCH_DEFAULT;
+char track_report[NEON_REPORT_LEN];
+
+// maps watched instead of armed, over all tasks; the mutex serializes
+// watchpoint setup and teardown
+static LIST_HEAD(watch_list);
+static DEFINE_MUTEX(watch_mutex);
+
+// tracking statistics, over all tasks
+static struct {
+  // decode cache
+  atomic_long_t hits;
+  atomic_long_t misses;
+  // cycles spent on lookups that hit, and on decoding misses
+  atomic_long_t hit_cycles;
+  atomic_long_t miss_cycles;
+  // tracked faults, those submitting work, and those on pages not
+  // holding an index register (avoided with track_ir_only)
+  atomic_long_t faults;
+  atomic_long_t submits;
+  atomic_long_t offreg;
+  // submissions caught by write watchpoints instead
+  atomic_long_t watched;
+} track_stats;
+
+// per-cpu slot of the fault awaiting its single-step trap
+typedef struct {
+  // faulting cpu-task
+  struct task_struct *task;
+  // fault pending on the trap
+  neon_fault_t *fault;
+  // protect this struct (from remote lookups)
+  spinlock_t lock;
+} neon_fault_slot_t;
+
+static DEFINE_PER_CPU(neon_fault_slot_t, fault_slot) = {
+  .task  = NULL,
+  .fault = NULL,
+  .lock  = __SPIN_LOCK_UNLOCKED(fault_slot.lock)
+};
+
+/**************************************************************************/
+// neon_fault_stash
+/**************************************************************************/
+// save the fault current is about to single-step over; called from
+// the fault handler with preemption disabled
+inline void
+neon_fault_stash(neon_fault_t * const fault)
+{
+  neon_fault_slot_t *slot = &__get_cpu_var(fault_slot);
+
+  fault->stepping = 1;
+
+  spin_lock(&slot->lock);
+  if(unlikely(slot->task != NULL && slot->task != current))
+    neon_debug("cpu %d : pid %d : pending fault of pid %d overwritten",
+               smp_processor_id(), current->pid, slot->task->pid);
+  slot->task  = current;
+  slot->fault = fault;
+  spin_unlock(&slot->lock);
+
+  return;
+}
+
+/**************************************************************************/
+// fault_slot_take
+/**************************************************************************/
+// take the fault stashed in a slot if it belongs to current and is
+// still being stepped over; a stale slot of current is cleared anyway
+static inline neon_fault_t *
+fault_slot_take(neon_fault_slot_t * const slot)
+{
+  neon_fault_t *fault = NULL;
+
+  spin_lock(&slot->lock);
+  if(slot->task == current) {
+    if(slot->fault->stepping != 0)
+      fault = slot->fault;
+    slot->task  = NULL;
+    slot->fault = NULL;
+  }
+  spin_unlock(&slot->lock);
+
+  return fault;
+}
+
+/**************************************************************************/
+// fault_unstash
+/**************************************************************************/
+// find the fault current is single-stepping over: normally in this
+// cpu's slot; if current has migrated between fault and trap (the
+// fault handler might block in submit), its own record if stepping;
+// NULL if the trap is not ours (e.g. a debugger's single-step)
+static neon_fault_t *
+fault_unstash(neon_task_t * const neon_task)
+{
+  neon_fault_t *fault = NULL;
+
+  fault = fault_slot_take(&__get_cpu_var(fault_slot));
+  if(likely(fault != NULL))
+    return fault;
+
+  fault = neon_thread_fault(&neon_task->faults, current->pid, NULL);
+  if(fault != NULL && fault->stepping == 0)
+    fault = NULL;
+
+  return fault;
+}
+
+/**************************************************************************/
+// fault_slots_clear
+/**************************************************************************/
+// forget a (exiting) task's stashed fault on all cpus
+static void
+fault_slots_clear(struct task_struct * const tsk)
+{
+  neon_fault_slot_t *slot = NULL;
+  unsigned int       cpu  = 0;
+
+  for_each_possible_cpu(cpu) {
+    slot = &per_cpu(fault_slot, cpu);
+    spin_lock(&slot->lock);
+    if(slot->task == tsk) {
+      slot->task  = NULL;
+      slot->fault = NULL;
+    }
+    spin_unlock(&slot->lock);
+  }
+
+  return;
+}
+
+/**************************************************************************/
+// fault_forget
+/**************************************************************************/
+// take a thread's own fault out of transit (its map, if any, is still
+// tracked while in transit); returns 1 if it was in transit
+static int
+fault_forget(neon_fault_t * const fault)
+{
+  neon_ctx_t *ctx = NULL;
+  int         ret = 0;
+
+  if(fault->addr == 0 || fault->map == NULL)
+    return 0;
+
+  ctx = fault->map->ctx;
+  spin_lock(&ctx->fault_lock);
+  if(!list_empty(&fault->entry)) {
+    list_del_init(&fault->entry);
+    ret = 1;
+  }
+  fault->addr = 0;
+  fault->map  = NULL;
+  spin_unlock(&ctx->fault_lock);
+
+  return ret;
+}
+
+/**************************************************************************/
+// neon_thread_faults_init
+/**************************************************************************/
+// prepare an empty table of per-thread fault records
+void
+neon_thread_faults_init(neon_thread_faults_t * const faults)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < NEON_THREAD_FAULTS_SIZE; i++)
+    INIT_HLIST_HEAD(&faults->bucket[i]);
+  spin_lock_init(&faults->lock);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_thread_fault
+/**************************************************************************/
+// find a thread's fault record; with a template, allocate it as a
+// copy of the template on the thread's first tracked fault (atomic,
+// called from the fault handler)
+neon_fault_t *
+neon_thread_fault(neon_thread_faults_t * const faults,
+                  const pid_t pid,
+                  const neon_fault_t * const tmpl)
+{
+  struct hlist_head *head  = NULL;
+  struct hlist_node *node  = NULL;
+  neon_fault_t      *fault = NULL;
+  neon_fault_t      *f     = NULL;
+
+  head = &faults->bucket[hash_long(pid, NEON_THREAD_FAULTS_BITS)];
+
+  spin_lock(&faults->lock);
+  hlist_for_each_entry(f, node, head, hash) {
+    if(f->pid == pid) {
+      fault = f;
+      break;
+    }
+  }
+  if(fault == NULL && tmpl != NULL) {
+    fault = (neon_fault_t *) neon_obj_alloc(NEON_OBJ_FAULT, GFP_ATOMIC);
+    if(fault != NULL) {
+      *fault = *tmpl;
+      fault->pid = pid;
+      INIT_LIST_HEAD(&fault->entry);
+      hlist_add_head(&fault->hash, head);
+    } else
+      neon_error("%s : pid %d : alloc fault record failed", __func__, pid);
+  }
+  spin_unlock(&faults->lock);
+
+  return fault;
+}
+
+/**************************************************************************/
+// neon_thread_fault_drop
+/**************************************************************************/
+// release the fault record of an exiting thread
+void
+neon_thread_fault_drop(neon_thread_faults_t * const faults,
+                       struct task_struct * const tsk)
+{
+  neon_fault_t *fault = NULL;
+
+  fault_slots_clear(tsk);
+
+  fault = neon_thread_fault(faults, tsk->pid, NULL);
+  if(fault == NULL)
+    return;
+
+  spin_lock(&faults->lock);
+  hlist_del(&fault->hash);
+  spin_unlock(&faults->lock);
+
+  if(fault_forget(fault) != 0)
+    neon_warning("pid %d : exiting with fault in transit", tsk->pid);
+  neon_obj_free(NEON_OBJ_FAULT, fault);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_thread_faults_fini
+/**************************************************************************/
+// release all fault records; contexts (and maps) must be gone
+void
+neon_thread_faults_fini(neon_thread_faults_t * const faults)
+{
+  struct hlist_node *node  = NULL;
+  struct hlist_node *tmp   = NULL;
+  neon_fault_t      *fault = NULL;
+  unsigned int       i     = 0;
+
+  spin_lock(&faults->lock);
+  for(i = 0; i < NEON_THREAD_FAULTS_SIZE; i++) {
+    hlist_for_each_entry_safe(fault, node, tmp, &faults->bucket[i], hash) {
+      hlist_del(&fault->hash);
+      neon_obj_free(NEON_OBJ_FAULT, fault);
+    }
+  }
+  spin_unlock(&faults->lock);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_die_notifier
 /**************************************************************************/
@@ -62,6 +353,226 @@ neon_die_notifier(struct notifier_block *nb,
   return NOTIFY_DONE;
 }
 
+/****************************************************************************/
+// neon_decode_cache_init
+/****************************************************************************/
+// prepare an empty decode cache
+void
+neon_decode_cache_init(neon_decode_cache_t * const cache)
+{
+  memset(cache->ip, 0, sizeof(cache->ip));
+  spin_lock_init(&cache->lock);
+
+  return;
+}
+
+/****************************************************************************/
+// neon_decode_cache_flush
+/****************************************************************************/
+// drop cached instructions in [start, end), e.g. of an unmapped vma
+void
+neon_decode_cache_flush(neon_decode_cache_t * const cache,
+                        const unsigned long start,
+                        const unsigned long end)
+{
+  unsigned int i = 0;
+
+  spin_lock(&cache->lock);
+  for(i = 0; i < NEON_DECODE_CACHE_SIZE; i++)
+    if(cache->ip[i] >= start && cache->ip[i] < end)
+      cache->ip[i] = 0;
+  spin_unlock(&cache->lock);
+
+  return;
+}
+
+/****************************************************************************/
+// decode_cache_fill
+/****************************************************************************/
+// cache the decoding desc of the n instruction bytes code at ip
+static void
+decode_cache_fill(neon_decode_cache_t * const cache,
+                  const unsigned long ip,
+                  const struct ins_desc * const desc,
+                  const unsigned char * const code,
+                  const unsigned int n)
+{
+  const unsigned int i = hash_long(ip, NEON_DECODE_CACHE_BITS);
+
+  spin_lock(&cache->lock);
+  cache->ip[i] = ip;
+  cache->desc[i] = *desc;
+  cache->ncode[i] = n;
+  memcpy(cache->code[i], code, n);
+  spin_unlock(&cache->lock);
+
+  return;
+}
+
+/****************************************************************************/
+// decode_cached
+/****************************************************************************/
+// decode the instruction at ip, through the cache; returns 0 if the
+// instruction is one the fault path can make sense of. A hit needs the
+// bytes at ip to be the ones decoded: code may be rewritten in place
+// (e.g. JIT, after mprotect) without the vma going away
+static int
+decode_cached(neon_decode_cache_t * const cache,
+              const unsigned long ip,
+              struct ins_desc * const desc)
+{
+  const unsigned int i     = hash_long(ip, NEON_DECODE_CACHE_BITS);
+  cycles_t           t0    = get_cycles();
+  unsigned char      code[NEON_DECODE_CODE_LEN];
+  unsigned int       n     = 0;
+  int                ret   = 0;
+
+  // the instruction was just fetched, but may end near an unmapped page
+  pagefault_disable();
+  n = NEON_DECODE_CODE_LEN -
+    __copy_from_user_inatomic(code, (const void __user *) ip, sizeof(code));
+  pagefault_enable();
+
+  spin_lock(&cache->lock);
+  if(likely(cache->ip[i] == ip && n >= cache->ncode[i] &&
+            memcmp(cache->code[i], code, cache->ncode[i]) == 0)) {
+    *desc = cache->desc[i];
+    spin_unlock(&cache->lock);
+    atomic_long_inc(&track_stats.hits);
+    atomic_long_add(get_cycles() - t0, &track_stats.hit_cycles);
+    return 0;
+  }
+  spin_unlock(&cache->lock);
+
+  // only instructions the fault path understands are cached, and
+  // only if all of the bytes to compare could be read
+  ret = get_ins_desc(ip, desc);
+  if(ret == 0 && n > 0 && desc->len <= n)
+    decode_cache_fill(cache, ip, desc, code, desc->len != 0 ? desc->len : n);
+  atomic_long_inc(&track_stats.misses);
+  atomic_long_add(get_cycles() - t0, &track_stats.miss_cycles);
+
+  return ret;
+}
+
+/****************************************************************************/
+// decode_stored
+/****************************************************************************/
+// tell the value of the 32-bit MOV store that just retired before
+// regs->ip (at a write watchpoint's trap) from its instruction: the
+// cached decoding that ends at regs->ip, else the decodings of the
+// bytes before regs->ip that end there, if they agree on the value;
+// returns 0 on success
+static int
+decode_stored(neon_decode_cache_t * const cache,
+              struct pt_regs * const regs,
+              u32 * const val)
+{
+  const unsigned long ip    = instruction_pointer(regs);
+  const unsigned int  max   = NEON_DECODE_CODE_LEN - 1;
+  unsigned char       code[2 * NEON_DECODE_CODE_LEN];
+  struct ins_desc     desc;
+  unsigned long       v     = 0;
+  unsigned int        k     = 0;
+  unsigned int        i     = 0;
+  unsigned int        found = 0;
+  unsigned int        nk    = 0;
+
+  // the longest instruction's worth of bytes before ip; decodings
+  // that do not end at ip may read on, into the zeroes after them
+  memset(code, 0, sizeof(code));
+  pagefault_disable();
+  k = __copy_from_user_inatomic(code, (const void __user *) (ip - max), max);
+  pagefault_enable();
+  if(k != 0)
+    return -1;
+
+  spin_lock(&cache->lock);
+  for(i = 0; i < NEON_DECODE_CACHE_SIZE; i++) {
+    k = cache->desc[i].len;
+    if(cache->ip[i] != 0 && k != 0 && k <= max && cache->ip[i] + k == ip &&
+       memcmp(cache->code[i], code + max - k, k) == 0) {
+      desc = cache->desc[i];
+      found = 1;
+      break;
+    }
+  }
+  spin_unlock(&cache->lock);
+  if(found != 0) {
+    if(desc.mem_width != sizeof(u32))
+      return -1;
+    *val = (u32) (desc.type == IMM_WRITE ? desc.imm :
+                  get_ins_desc_reg_val(&desc, regs));
+    return 0;
+  }
+
+  // a MOV store is at least 2 bytes long; of all the decodings that
+  // end at ip, the one of the store is among them
+  for(k = 2; k <= max; k++) {
+    if(get_ins_desc((unsigned long) (code + max - k), &desc) != 0 ||
+       desc.len != k || desc.mem_width != sizeof(u32))
+      continue;
+    v = desc.type == IMM_WRITE ? desc.imm :
+      get_ins_desc_reg_val(&desc, regs);
+    if(nk++ != 0 && (u32) v != *val)
+      return -1;
+    *val = (u32) v;
+    found = k;
+  }
+  if(nk == 0)
+    return -1;
+
+  // an unambiguous decoding is as good as a fault's
+  if(nk == 1 &&
+     get_ins_desc((unsigned long) (code + max - found), &desc) == 0)
+    decode_cache_fill(cache, ip - found, &desc, code + max - found, found);
+
+  return 0;
+}
+
+/****************************************************************************/
+// neon_track_report
+/****************************************************************************/
+// tracked faults per kind, decode cache hit rate and (estimated)
+// cycles saved
+int
+neon_track_report(char *buf,
+                  size_t len)
+{
+  unsigned long faults  = atomic_long_read(&track_stats.faults);
+  unsigned long submits = atomic_long_read(&track_stats.submits);
+  unsigned long offreg  = atomic_long_read(&track_stats.offreg);
+  unsigned long watched = atomic_long_read(&track_stats.watched);
+  unsigned long hits    = atomic_long_read(&track_stats.hits);
+  unsigned long misses  = atomic_long_read(&track_stats.misses);
+  unsigned long hit_c   = atomic_long_read(&track_stats.hit_cycles);
+  unsigned long miss_c  = atomic_long_read(&track_stats.miss_cycles);
+  unsigned long per_hit = hits == 0 ? 0 : hit_c / hits;
+  unsigned long per_miss = misses == 0 ? 0 : miss_c / misses;
+  unsigned long saved   = 0;
+  int           ofs     = 0;
+
+  if(per_miss > per_hit)
+    saved = hits * (per_miss - per_hit);
+
+  ofs += scnprintf(buf + ofs, len - ofs,
+                   "faults submits off-register faults/submit(x100) "
+                   "ir-only watched\n"
+                   "%6lu %7lu %12lu %20lu %7u %7lu\n",
+                   faults, submits, offreg,
+                   submits == 0 ? 0 : faults * 100 / submits,
+                   track_ir_only, watched);
+  ofs += scnprintf(buf + ofs, len - ofs,
+                   "decode-hits decode-misses hit-rate(%%) "
+                   "cycles/hit cycles/miss cycles-saved\n"
+                   "%11lu %13lu %11lu %10lu %11lu %12lu\n",
+                   hits, misses,
+                   (hits + misses) == 0 ? 0 : hits * 100 / (hits + misses),
+                   per_hit, per_miss, saved);
+
+  return ofs;
+}
+
 /****************************************************************************/
 // neon_fault_save_decode
 /****************************************************************************/
@@ -71,28 +582,38 @@ neon_fault_save_decode(struct pt_regs * regs,
                        unsigned long addr,
                        neon_map_t * const map,
                        unsigned long page_num,
+                       neon_decode_cache_t * const cache,
                        neon_fault_t * const fault)
 {
   const unsigned long instptr = instruction_pointer(regs);
-  const enum reason_type type = get_ins_type(instptr);
+  struct ins_desc     desc;
 
   fault->map = map;
   fault->page_num = page_num;
   fault->flags = regs->flags; // moved outside , at fault handler func
   fault->addr = addr;
   fault->ip = instptr;
-  switch (type) {
+  fault->width = 0;
+  fault->len = 0;
+  if(decode_cached(cache, instptr, &desc) != 0)
+    desc.type = OTHERS;
+  switch (desc.type) {
   case REG_READ:
     fault->op = 'R';
     fault->val = 0; // updated @ trap
+    fault->width = desc.mem_width;
     break;
   case REG_WRITE:
     fault->op = 'W';
-    fault->val = get_ins_reg_val(instptr, regs);
+    fault->val = get_ins_desc_reg_val(&desc, regs);
+    fault->width = desc.mem_width;
+    fault->len = desc.len;
     break;
   case IMM_WRITE:
     fault->op = 'W';
-    fault->val= get_ins_imm_val(instptr);
+    fault->val= desc.imm;
+    fault->width = desc.mem_width;
+    fault->len = desc.len;
     break;
   default:
     {
@@ -105,13 +626,57 @@ neon_fault_save_decode(struct pt_regs * regs,
   return;
 }
 
+/****************************************************************************/
+// neon_fault_emulable
+/****************************************************************************/
+// check whether a decoded fault is a plain 32-bit MOV store on the
+// index register of its map; returns the instruction length if so, 0
+// if the instruction has to be single-stepped instead
+unsigned int
+neon_fault_emulable(const neon_fault_t * const fault)
+{
+  if(track_emulate == 0 || fault->op != 'W')
+    return 0;
+
+  // any other register (of any page of the map) is left to the hardware
+  if(fault->map == NULL || fault->map->ir_addr == 0 ||
+     fault->addr != fault->map->ir_addr)
+    return 0;
+
+  // 8 and 16-bit stores, and 64-bit ones (REX.W), are never doorbells
+  if(fault->width != sizeof(u32))
+    return 0;
+
+  return fault->len;
+}
+
+/****************************************************************************/
+// neon_fault_emulate
+/****************************************************************************/
+// perform the faulting store through the kernel alias of the index
+// register and step the user over the instruction
+void
+neon_fault_emulate(struct pt_regs * regs,
+                   void * const kvaddr,
+                   const u32 val,
+                   const unsigned long ip_next)
+{
+  writel(val, kvaddr);
+  regs->ip = ip_next;
+
+  return;
+}
+
 /**************************************************************************/
-// neon_page_arming
+// page_arming
 /**************************************************************************/
-// arm page --- manually induced fault on every access
-void
-neon_page_arming(unsigned int arm,
-                 neon_page_t *page)
+// flip the page's presence (or writability, with track_wronly);
+// returns 1 if cached translations have to be shot down --- a
+// non-present pte is never cached, so disarming a not-present-armed
+// page needs no flush, while stale read-only entries would fault
+static unsigned int
+page_arming(unsigned int arm,
+            neon_page_t *page)
 {
   pteval_t ptev = 0;
 
@@ -121,17 +686,23 @@ neon_page_arming(unsigned int arm,
     if(page->armed == 1) {
       neon_warning("page 0x%p : pte 0x%p : saved ptev 0x%x : armed already",
                    page, page->pte, !!page->saved_ptev);
-      return;
+      return 0;
     }
+#ifndef NEON_TRACE_REPORT
+    page->mask = (track_wronly != 0) ? _PAGE_RW : _PAGE_PRESENT;
+#else
+    // reads are traced too
+    page->mask = _PAGE_PRESENT;
+#endif // NEON_TRACE_REPORT
     ptev = pte_val(*page->pte);
-    page->saved_ptev = ptev & _PAGE_PRESENT;
-    ptev &= ~_PAGE_PRESENT;
+    page->saved_ptev = ptev & page->mask;
+    ptev &= ~page->mask;
     page->armed = 1;
   } else { // disarm
     if(page->armed == 0) {
       neon_warning("page 0x%p : pte 0x%p : saved ptev 0x%x : disarmed already",
                    page, page->pte, !!page->saved_ptev);
-      return;
+      return 0;
     }
     ptev = pte_val(*page->pte);
     ptev |= page->saved_ptev;
@@ -139,11 +710,119 @@ neon_page_arming(unsigned int arm,
   }
 
   set_pte_atomic(page->pte, __pte(ptev));
+
+  return (arm == 1 || page->mask == _PAGE_RW);
+}
+
+/**************************************************************************/
+// neon_page_arming
+/**************************************************************************/
+// arm page --- manually induced fault on every access; flushes the
+// local tlb only, as fault/trap paths run with irqs off and cannot
+// wait on shootdown ipis (sets of pages go through neon_track_batch_*)
+void
+neon_page_arming(unsigned int arm,
+                 neon_page_t *page)
+{
+  page_arming(arm, page);
   __flush_tlb_one(page->addr);
 
   return;
 }
 
+/**************************************************************************/
+// neon_track_batch_init
+/**************************************************************************/
+// prepare an empty arming batch
+inline void
+neon_track_batch_init(neon_track_batch_t * const batch)
+{
+  batch->mm = NULL;
+  batch->start = 0;
+  batch->end = 0;
+  batch->npages = 0;
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_batch_arm
+/**************************************************************************/
+// arm/disarm all pages of the mapping; the local tlb is flushed right
+// away (as neon_page_arming does), only the shootdown of other cpus is
+// deferred to neon_track_batch_flush; a batch already holding pages of
+// another mm is flushed first, so batches filled under a lock must
+// stick to one
+void
+neon_track_batch_arm(unsigned int arm,
+                     neon_map_t * const map,
+                     neon_track_batch_t * const batch)
+{
+  unsigned int i  = 0;
+  unsigned int np = ROUND_DIV(map->size, PAGE_SIZE);
+
+  // watched maps are never armed
+  if(map->watch != NULL)
+    return;
+
+  if(batch->mm != NULL && batch->mm != map->vma->vm_mm)
+    neon_track_batch_flush(batch);
+
+  for(i = 0; i < np; i++) {
+    neon_page_t *page = &map->page[i];
+    if(page->armed == arm || (arm == 1 && page->skip != 0) ||
+       page_arming(arm, page) == 0)
+      continue;
+    __flush_tlb_one(page->addr);
+    if(batch->mm == NULL) {
+      batch->mm = map->vma->vm_mm;
+      atomic_inc(&batch->mm->mm_count);
+      batch->start = page->addr;
+      batch->end = page->addr + PAGE_SIZE;
+    } else {
+      batch->start = min(batch->start, page->addr);
+      batch->end = max(batch->end, page->addr + PAGE_SIZE);
+    }
+    batch->npages++;
+  }
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_batch_flush
+/**************************************************************************/
+// one shootdown for all pages armed in the batch, reaching only the
+// cpus the mm is live on (mm_cpumask); the range may cross vmas of
+// the same mm, which x86 flushes as a whole anyway. Waits on the
+// shootdown ipis: never call with irqs off or holding a lock that
+// irqs-off paths (fault, trap, policy submit) or timers may spin on
+void
+neon_track_batch_flush(neon_track_batch_t * const batch)
+{
+  if(batch->npages != 0)
+    neon_flush_tlb_range(batch->mm, batch->start, batch->end);
+  if(batch->mm != NULL)
+    mmdrop(batch->mm);
+  neon_track_batch_init(batch);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_batch_drop
+/**************************************************************************/
+// forget a batch without shooting it down (e.g. its task is gone)
+void
+neon_track_batch_drop(neon_track_batch_t * const batch)
+{
+  if(batch->mm != NULL)
+    mmdrop(batch->mm);
+  neon_track_batch_init(batch);
+
+  return;
+}
+
 /**************************************************************************/
 // neon_trap_handler
 /**************************************************************************/
@@ -153,7 +832,6 @@ neon_trap_handler(unsigned long condition, struct pt_regs *regs)
 {
   struct task_struct *cpu_task  = current;
   neon_task_t        *neon_task = NULL;
-  neon_ctx_t         *ctx       = NULL;
   neon_fault_t       *fault     = NULL;
   neon_map_t         *trap_map  = NULL;
   neon_ctx_t         *trap_ctx  = NULL;
@@ -165,39 +843,30 @@ neon_trap_handler(unsigned long condition, struct pt_regs *regs)
 
   neon_debug("TRY new trap : ip 0x%lx", instruction_pointer(regs));
 
-  // The scenario of multiple contexts and multiple maps in the same task
-  // suffering a fault at the same time has not been confirmed in practice.
-  // Hence we actually pick the first context and first fault available
-  // to handle.
-  list_for_each_entry(ctx, &neon_task->ctx_list.entry, entry) {
-    if(!list_empty(&ctx->fault_list.entry)) {
-      unsigned long instructions = 0;
-      unsigned long ip_next = instruction_pointer(regs);
-      fault = list_first_entry(&ctx->fault_list.entry, neon_fault_t, entry);
-      trap_ctx = ctx;
-      trap_map  = fault->map;
-      trap_page = &trap_map->page[fault->page_num];
-      instructions = (ip_next >> 8) - (fault->ip >> 8);
-      // yes, >1 instruction differnce from faults has been witnessed; legit
-      if(instructions > 1)
-        neon_debug("ctx fault \"jump\"");
-      break;
-    }
-  }
+  // The fault handler stashed the fault per cpu (and task), or it
+  // is found in the thread's own record
+  fault = fault_unstash(neon_task);
   if(fault == NULL) {
-    // Trap without a fault --- this can be legit as a debugging effort,
-    // or happen if we "manage" to exit between a fault and a trap,
-    // such a trap will have to be ignored
-    neon_warning("trap @ IP 0x%lx : can't find fault in list : ... ",
+    // Trap without a fault we step over --- legit as a debugging
+    // effort; leave it to whoever set the trap flag
+    neon_debug("trap @ IP 0x%lx : no fault stepped over : not ours",
+               instruction_pointer(regs));
+    return 1;
+  }
+  fault->stepping = 0;
+
+  // our step, but its map went away in the meantime (the fault was
+  // taken out of transit): nothing to re-arm
+  if(unlikely(fault->map == NULL)) {
+    neon_warning("trap @ IP 0x%lx : fault's map is gone : ignoring",
                  instruction_pointer(regs));
-    list_for_each_entry(ctx, &neon_task->ctx_list.entry, entry) {
-      list_for_each_entry(fault, &ctx->fault_list.entry, entry) 
-        neon_fault_print(fault);
-    }
     regs->flags &= ~X86_EFLAGS_TF;
-    neon_error("spurious trap : ignoring ... (PS> don't dbg with NEON!)");
+    regs->flags |= (fault->flags & (X86_EFLAGS_TF | X86_EFLAGS_IF));
     return 0;
   }
+  trap_map  = fault->map;
+  trap_ctx  = trap_map->ctx;
+  trap_page = &trap_map->page[fault->page_num];
 
 #ifdef NEON_TRACE_REPORT 
   if(fault->op == 'R' || fault->op == 'W') {
@@ -252,7 +921,10 @@ neon_trap_handler(unsigned long condition, struct pt_regs *regs)
 
   // mark fault info as handled and remove it from pending list
   fault->addr = 0;
+  spin_lock(&trap_ctx->fault_lock);
   list_del_init(&fault->entry);
+  fault->map = NULL;
+  spin_unlock(&trap_ctx->fault_lock);
 
   neon_debug("pid %d : ctx 0x%x : dev 0x%x : map 0x%x : "
              "addr 0x%lx : page %d : val 0x%x :  trap",
@@ -273,24 +945,22 @@ neon_track_init(neon_map_t * const map)
 
   np = ROUND_DIV(map->size, PAGE_SIZE);
 
-  // init fault entry
-  map->fault = (struct _neon_fault_t_ *)                \
-    kzalloc(sizeof(struct _neon_fault_t_), GFP_KERNEL);
-  if(map->fault == NULL) {
-    neon_error("%s: alloc map fault failed \n", __func__);
-    return -1;
-  }
-  INIT_LIST_HEAD(&map->fault->entry);  
-  
-  // init page structs to follow tracking
-  map->page = (struct _neon_page_t_ *)                          \
-    kzalloc(np * sizeof(struct _neon_page_t_), GFP_KERNEL);
+  // init page structs to follow tracking; only single-page maps fit in
+  // the map itself
+  if(np <= NEON_MAP_INLINE_PAGES) {
+    memset(map->page_inline, 0, sizeof(map->page_inline));
+    map->page = map->page_inline;
+  } else
+    map->page = (struct _neon_page_t_ *)                        \
+      kzalloc(np * sizeof(struct _neon_page_t_), GFP_KERNEL);
   if(map->page == NULL) {
-    kfree(map->fault);
     neon_error("%s: alloc map->page failed \n", __func__);
     return -1;
   }
 
+  INIT_LIST_HEAD(&map->watch_entry);
+  INIT_WORK(&map->watch_submit, watch_submit);
+
   neon_info("ctx 0x%x : dev 0x%x : map 0x%x : size 0x%lx : ofs 0x%lx : "
             "vma->start 0x%lx : track init",
             map->ctx_key, map->dev_key, map->key, map->size,
@@ -300,16 +970,334 @@ neon_track_init(neon_map_t * const map)
 }
 
 /**************************************************************************/
-// neon_track_start
+// neon_track_index_init
 /**************************************************************************/
-// follow a vma and and report accesses (R/W) to its pages
+// initialize an (empty) tracked range index
+void
+neon_track_index_init(neon_track_index_t * const index)
+{
+  index->root = RB_ROOT;
+  rwlock_init(&index->lock);
+
+  return;
+}
+
+/**************************************************************************/
+// track_index_insert
+/**************************************************************************/
+// enlist a tracked map's range in the index
+static void
+track_index_insert(neon_track_index_t * const index,
+                   neon_map_t * const map)
+{
+  struct rb_node **link   = &index->root.rb_node;
+  struct rb_node  *parent = NULL;
+
+  write_lock(&index->lock);
+  while(*link != NULL) {
+    neon_map_t *m = rb_entry(*link, neon_map_t, index_node);
+    parent = *link;
+    if(map->vma->vm_start < m->vma->vm_start)
+      link = &(*link)->rb_left;
+    else
+      link = &(*link)->rb_right;
+  }
+  rb_link_node(&map->index_node, parent, link);
+  rb_insert_color(&map->index_node, &index->root);
+  map->index = index;
+  write_unlock(&index->lock);
+
+  return;
+}
+
+/**************************************************************************/
+// track_index_remove
+/**************************************************************************/
+// remove a map's range from the index it is enlisted in
+static void
+track_index_remove(neon_map_t * const map)
+{
+  neon_track_index_t *index = map->index;
+
+  if(index == NULL)
+    return;
+
+  write_lock(&index->lock);
+  rb_erase(&map->index_node, &index->root);
+  RB_CLEAR_NODE(&map->index_node);
+  map->index = NULL;
+  write_unlock(&index->lock);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_lookup
+/**************************************************************************/
+// find the tracked map covering addr, NULL if addr is not tracked
+neon_map_t *
+neon_track_lookup(neon_track_index_t * const index,
+                  const unsigned long addr)
+{
+  struct rb_node *node = NULL;
+  neon_map_t     *map  = NULL;
+
+  read_lock(&index->lock);
+  node = index->root.rb_node;
+  while(node != NULL) {
+    neon_map_t *m = rb_entry(node, neon_map_t, index_node);
+    if(addr < m->vma->vm_start)
+      node = node->rb_left;
+    else if(addr >= m->vma->vm_start + m->size)
+      node = node->rb_right;
+    else {
+      map = m;
+      break;
+    }
+  }
+  read_unlock(&index->lock);
+
+  return map;
+}
+
+/**************************************************************************/
+// neon_track_focus
+/**************************************************************************/
+// mark the page holding the map's index register (user address addr);
+// with track_ir_only, it is the only page track start/restart arm
+void
+neon_track_focus(neon_map_t * const map,
+                 const unsigned long addr)
+{
+  unsigned int  np   = ROUND_DIV(map->size, PAGE_SIZE);
+  unsigned long pidx = (addr - map->vma->vm_start) >> PAGE_SHIFT;
+  unsigned int  i    = 0;
+
+  if(addr < map->vma->vm_start || pidx >= np) {
+    neon_warning("map key 0x%lx : ir @ 0x%lx out of map : tracking all",
+                 map->key, addr);
+    return;
+  }
+
+  map->ir_addr = addr;
+  for(i = 0; i < np; i++) {
+    map->page[i].ir = (i == pidx);
+    map->page[i].skip = (track_ir_only != 0 && i != pidx);
+  }
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_account
+/**************************************************************************/
+// account a tracked fault on page
+inline void
+neon_track_account(const neon_page_t * const page,
+                   const unsigned int submit)
+{
+  atomic_long_inc(&track_stats.faults);
+  if(submit != 0)
+    atomic_long_inc(&track_stats.submits);
+  if(page->ir == 0)
+    atomic_long_inc(&track_stats.offreg);
+
+  return;
+}
+
+/**************************************************************************/
+// watch_submit
+/**************************************************************************/
+// account for the store last caught by a map's watchpoint; runs in
+// process context, as submission takes locks and may block
+static void
+watch_submit(struct work_struct *ws)
+{
+  neon_map_t         *map  = container_of(ws, neon_map_t, watch_submit);
+  neon_ctx_t         *ctx  = map->ctx;
+  neon_work_t        *work = NULL;
+  neon_work_t        *w    = NULL;
+  struct perf_event  *bp   = NULL;
+  unsigned long       idx  = 0;
+  unsigned long       lost = 0;
+  neon_track_batch_t  batch;
+
+  // each caught value is submitted once; stores caught before it is
+  // taken are coalesced into its submit
+  idx = xchg(&map->watch_idx, 0);
+  lost = xchg(&map->watch_lost, 0);
+  if(idx == 0 && lost == 0)
+    return;
+
+  // a store not told from its instruction: arm the pages instead, so
+  // that the next stores fault with their values (the map stays on
+  // the watch list until its watch is stopped)
+  if(lost != 0 && (bp = xchg(&map->watch, NULL)) != NULL) {
+    unregister_hw_breakpoint(bp);
+    neon_track_batch_init(&batch);
+    neon_track_batch_arm(1, map, &batch);
+    neon_track_batch_flush(&batch);
+    neon_info("map key 0x%lx : store not decoded : watch --> arming",
+              map->key);
+  }
+
+  // a withdrawn work waits out this submission (neon_map_fini)
+  spin_lock(&ctx->work_lock);
+  list_for_each_entry(w, &ctx->work_list.entry, entry) {
+    if(w->ir == map) {
+      work = w;
+      break;
+    }
+  }
+  spin_unlock(&ctx->work_lock);
+  if(work == NULL)
+    return;
+
+  // the lost store's value is only left in the register
+  if(lost != 0)
+    idx = NEON_SHADOW_SET |
+      readl(neon_global.dev[work->did].chan[work->cid].ir_kvaddr);
+
+  atomic_long_inc(&track_stats.watched);
+#ifndef NEON_TRACE_REPORT
+  neon_work_defer(work, (u32) idx);
+  neon_work_submit(work, NEON_SUBMIT_OBSERVED);
+#endif // !NEON_TRACE_REPORT
+
+  return;
+}
+
+/**************************************************************************/
+// watch_triggered
+/**************************************************************************/
+// a watched index register has been written (the store has retired;
+// debug exception, irqs are off): capture the value from the store's
+// instruction (the register may already hold a later one, or not read
+// back at all) and leave the submission to process context
+static void
+watch_triggered(struct perf_event *bp,
+                struct perf_sample_data *data,
+                struct pt_regs *regs)
+{
+  neon_map_t  *map       = bp->overflow_handler_context;
+  neon_task_t *neon_task = current->neon_task;
+  u32          val       = 0;
+
+  if(neon_task != NULL &&
+     decode_stored(&neon_task->decode_cache, regs, &val) == 0)
+    xchg(&map->watch_idx, NEON_SHADOW_SET | val);
+  else
+    xchg(&map->watch_lost, 1);
+  schedule_work(&map->watch_submit);
+
+  return;
+}
+
+/**************************************************************************/
+// track_watch_start
+/**************************************************************************/
+// watch the map's index register with a write watchpoint of the
+// current thread; returns 0 on success, -1 if pages have to be armed
+static int
+track_watch_start(neon_map_t * const map)
+{
+  neon_task_t            *neon_task = current->neon_task;
+  struct perf_event_attr  attr;
+  struct perf_event      *bp        = NULL;
+
+  if(track_watch == 0 || map->ir_addr == 0 || neon_task == NULL ||
+     neon_task->sharers != 0 || neon_policy_nonblocking() == 0)
+    return -1;
+
+  hw_breakpoint_init(&attr);
+  attr.bp_addr = map->ir_addr;
+  attr.bp_len  = HW_BREAKPOINT_LEN_4;
+  attr.bp_type = HW_BREAKPOINT_W;
+
+  mutex_lock(&watch_mutex);
+  bp = register_user_hw_breakpoint(&attr, watch_triggered, map, current);
+  if(IS_ERR(bp)) {
+    mutex_unlock(&watch_mutex);
+    neon_info("map key 0x%lx : ir @ 0x%lx : no watchpoint (%ld) : arming",
+              map->key, map->ir_addr, PTR_ERR(bp));
+    return -1;
+  }
+  map->watch      = bp;
+  map->watch_task = neon_task;
+  list_add(&map->watch_entry, &watch_list);
+  mutex_unlock(&watch_mutex);
+
+  return 0;
+}
+
+/**************************************************************************/
+// track_watch_stop
+/**************************************************************************/
+// drop the map's watchpoint (if any, watch_submit may have dropped it
+// already) and wait out its submission; called with watch_mutex held
+static void
+track_watch_stop(neon_map_t * const map)
+{
+  struct perf_event *bp = NULL;
+
+  if(list_empty(&map->watch_entry))
+    return;
+
+  bp = xchg(&map->watch, NULL);
+  if(bp != NULL)
+    unregister_hw_breakpoint(bp);
+  cancel_work_sync(&map->watch_submit);
+  map->watch_task = NULL;
+  map->watch_idx  = 0;
+  map->watch_lost = 0;
+  list_del_init(&map->watch_entry);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_unwatch
+/**************************************************************************/
+// fall back to page arming for all watched maps of a task (any task if
+// NULL), e.g. since a new thread would not be covered by the
+// watchpoints, or the policy no longer is non-blocking
+void
+neon_track_unwatch(neon_task_t * const neon_task)
+{
+  neon_map_t         *map = NULL;
+  neon_map_t         *m   = NULL;
+  neon_track_batch_t  batch;
+
+  neon_track_batch_init(&batch);
+  mutex_lock(&watch_mutex);
+  list_for_each_entry_safe(map, m, &watch_list, watch_entry) {
+    if(neon_task != NULL && map->watch_task != neon_task)
+      continue;
+    track_watch_stop(map);
+    neon_track_batch_arm(1, map, &batch);
+    neon_info("map key 0x%lx : watch --> arming", map->key);
+  }
+  mutex_unlock(&watch_mutex);
+  neon_track_batch_flush(&batch);
+
+  return;
+}
+
+/**************************************************************************/
+// neon_track_start
+/**************************************************************************/
+// follow a vma and and report accesses (R/W) to its pages; the map
+// is enlisted in index for the fault handler to find
 int
-neon_track_start(neon_map_t *const map)
+neon_track_start(neon_map_t *const map,
+                 neon_track_index_t * const index)
 {
-  unsigned int i = 0;
-  unsigned int np = 0;
+  unsigned int       i     = 0;
+  unsigned int       np    = 0;
+  unsigned long      size  = 0;
+  neon_track_batch_t batch;
 
-  if(map->vma == NULL || map->page == NULL || map->fault == NULL) {
+  if(map->vma == NULL || map->page == NULL) {
     neon_error("%s : map 0x%lx : not fully initialized at track start",
                __func__, map->key);
     return -1;
@@ -321,14 +1309,28 @@ neon_track_start(neon_map_t *const map)
     map->page[i].addr = map->vma->vm_start + i * PAGE_SIZE;
     if(neon_follow_pte(map->vma,
                        map->page[i].addr,
-                       &map->page[i].pte) != 0) {
+                       &map->page[i].pte, &size) != 0) {
       neon_warning("map key 0x%lx : page %d table entry not found",
                    map->key, i);
       return -1;
-    } else {
-      neon_page_arming(1, &(map->page[i]));
     }
+    // pages are armed one by one; a huge entry would arm its neighbors
+    if(size != PAGE_SIZE) {
+      neon_warning("map key 0x%lx : page %d in a huge (0x%lx) mapping : "
+                   "cannot be tracked", map->key, i, size);
+      return -1;
+    }
+  }
+
+  // page tables are followed regardless, in case of a later fallback
+  if(track_watch_start(map) != 0) {
+    neon_track_batch_init(&batch);
+    neon_track_batch_arm(1, map, &batch);
+    neon_track_batch_flush(&batch);
   }
+
+  if(map->index == NULL)
+    track_index_insert(index, map);
   
   neon_info("map key 0x%lx : size 0x%lx : ofs 0x%lx : "
             " vma->start 0x%lx : track start",
@@ -344,25 +1346,40 @@ neon_track_start(neon_map_t *const map)
 int
 neon_track_stop(neon_map_t * const map)
 {
-  unsigned int np  = 0;
-  unsigned int i   = 0;
-  int          ret = 0;
+  unsigned int  np    = 0;
+  unsigned int  i     = 0;
+  int           ret   = 0;
+  neon_fault_t *fault = NULL;
+  neon_fault_t *f     = NULL;
+
+  // faults on this map are no longer ours
+  track_index_remove(map);
+  mutex_lock(&watch_mutex);
+  track_watch_stop(map);
+  mutex_unlock(&watch_mutex);
 
-  // disarm map's armed pages
+  // disarm map's armed pages; no shootdown, the map is going away
   np = ROUND_DIV(map->size, PAGE_SIZE);
   for(i = 0; i < np; i++) 
-    neon_page_arming(0, &(map->page[i]));
+    if(map->page[i].armed != 0)
+      page_arming(0, &(map->page[i]));
 
-  // if ctx has pending fault at fini, trap handler might complain
-  // if it gets to finish next instruction (shouldn't)
-  if(map->fault->addr != 0) {
-    neon_warning("ctx 0x%x : dev 0x%lx : map 0x%x : "
+  // if threads have pending faults on the map, their traps will find
+  // them detached and complain (shouldn't get to the next instruction)
+  spin_lock(&map->ctx->fault_lock);
+  list_for_each_entry_safe(fault, f, &map->ctx->fault_list.entry, entry) {
+    if(fault->map != map)
+      continue;
+    neon_warning("ctx 0x%x : dev 0x%lx : map 0x%x : pid %d : "
                  "stopping tracking with pending fault ...",
-                 map->ctx_key, map->dev_key, map->key);
-    neon_fault_print(map->fault);
-    map->fault->addr = 0;
+                 map->ctx_key, map->dev_key, map->key, fault->pid);
+    neon_fault_print(fault);
+    list_del_init(&fault->entry);
+    fault->addr = 0;
+    fault->map  = NULL;
     ret = -1;
   }
+  spin_unlock(&map->ctx->fault_lock);
   
   neon_info("ctx 0x%x : dev 0x%x : map 0x%x : track stop",
             map->ctx_key, map->dev_key, map->key);
@@ -377,11 +1394,8 @@ neon_track_stop(neon_map_t * const map)
 void
 neon_track_fini(neon_map_t * const map)
 {
-  if(map->fault != NULL)
-    kfree(map->fault);
-  if(map->page != NULL)
+  if(map->page != NULL && map->page != map->page_inline)
     kfree(map->page);
-  map->fault = NULL;
   map->page = NULL;
 
   neon_info("ctx 0x%x : dev 0x%x : map 0x%x : track fini",
@@ -398,14 +1412,11 @@ inline void
 neon_track_restart(unsigned int arm,
                    neon_map_t *map)
 {
-  unsigned int i   = 0;
-  unsigned int np  = ROUND_DIV(map->size, PAGE_SIZE);
+  neon_track_batch_t batch;
 
-  // arm/disarm all pages of the map
-  for(i = 0; i < np; i++) {
-    if (map->page[i].armed != arm)
-      neon_page_arming(arm, &(map->page[i]));
-  }
+  neon_track_batch_init(&batch);
+  neon_track_batch_arm(arm, map, &batch);
+  neon_track_batch_flush(&batch);
   
   return;
 }
@@ -417,9 +1428,10 @@ neon_track_restart(unsigned int arm,
 inline void
 neon_fault_print(const neon_fault_t * const fault)
 {
-  neon_info("fault : op %c : ip 0x%lx : addr 0x%lx : "
+  neon_info("fault : pid %d : op %c : ip 0x%lx : addr 0x%lx : "
             "val 0x%lx : flags 0x%lx",
-            fault->op, fault->ip, fault->addr, fault->val, fault->flags);
+            fault->pid, fault->op, fault->ip, fault->addr, fault->val,
+            fault->flags);
 
   return;
 }
@@ -437,3 +1449,546 @@ neon_page_print(const neon_page_t * const page)
 
   return;
 }
+
+#ifdef NEON_SELFTEST
+
+/**************************************************************************/
+// decode_tests
+/**************************************************************************/
+// stores the fault path emulates (x86-64), and instructions it must
+// leave to single-stepping (len 0) or not make sense of at all (ret -1)
+static const struct {
+  unsigned char     code[NEON_DECODE_CODE_LEN];
+  int               ret;
+  enum reason_type  type;
+  unsigned int      len;
+  unsigned int      mem_width;
+  unsigned int      reg;
+  unsigned long     imm;
+} decode_tests[] = {
+  // mov %ecx,(%rdi)
+  { { 0x89, 0x0f }, 0, REG_WRITE, 2, 4, 1, 0 },
+  // mov %eax,0x8(%rdi) --- disp8
+  { { 0x89, 0x47, 0x08 }, 0, REG_WRITE, 3, 4, 0, 0 },
+  // mov %eax,0x100(%rdi) --- disp32
+  { { 0x89, 0x87, 0x00, 0x01, 0x00, 0x00 }, 0, REG_WRITE, 6, 4, 0, 0 },
+  // mov %ebx,(%rsp) --- SIB
+  { { 0x89, 0x1c, 0x24 }, 0, REG_WRITE, 3, 4, 3, 0 },
+  // mov %eax,0x8(%rsp) --- SIB, disp8
+  { { 0x89, 0x44, 0x24, 0x08 }, 0, REG_WRITE, 4, 4, 0, 0 },
+  // mov %eax,0x1000 --- SIB without base, disp32
+  { { 0x89, 0x04, 0x25, 0x00, 0x10, 0x00, 0x00 }, 0, REG_WRITE, 7, 4, 0, 0 },
+  // mov %eax,0x0(%rip)
+  { { 0x89, 0x05, 0x00, 0x00, 0x00, 0x00 }, 0, REG_WRITE, 6, 4, 0, 0 },
+  // mov %r8d,(%rdi) --- REX.R
+  { { 0x44, 0x89, 0x07 }, 0, REG_WRITE, 3, 4, 8, 0 },
+  // mov %rax,(%rdi) --- REX.W
+  { { 0x48, 0x89, 0x07 }, 0, REG_WRITE, 3, 8, 0, 0 },
+  // mov %ax,(%rdi)
+  { { 0x66, 0x89, 0x07 }, 0, REG_WRITE, 3, 2, 0, 0 },
+  // mov %al,(%rdi)
+  { { 0x88, 0x07 }, 0, REG_WRITE, 2, 1, 0, 0 },
+  // movl $0x12345678,(%rdi)
+  { { 0xc7, 0x07, 0x78, 0x56, 0x34, 0x12 }, 0, IMM_WRITE, 6, 4, 0,
+    0x12345678 },
+  // movw $0x1234,(%rdi)
+  { { 0x66, 0xc7, 0x07, 0x34, 0x12 }, 0, IMM_WRITE, 5, 2, 0, 0x1234 },
+  // movb $0x7f,0x4(%rdi)
+  { { 0xc6, 0x47, 0x04, 0x7f }, 0, IMM_WRITE, 4, 1, 0, 0x7f },
+  // movq $-1,(%rdi) --- imm32, sign-extended to the 64-bit store
+  { { 0x48, 0xc7, 0x07, 0xff, 0xff, 0xff, 0xff }, 0, IMM_WRITE, 7, 8, 0,
+    ~0UL },
+  // movl $0x12345678,(%rsp) --- the immediate follows the SIB byte
+  { { 0xc7, 0x04, 0x24, 0x78, 0x56, 0x34, 0x12 }, 0, IMM_WRITE, 7, 4, 0,
+    0x12345678 },
+  // data16 mov %rax,(%rdi) --- REX.W wins over 66
+  { { 0x66, 0x48, 0x89, 0x07 }, 0, REG_WRITE, 4, 8, 0, 0 },
+  // stos %eax,%es:(%rdi)
+  { { 0xab }, 0, REG_WRITE, 0, 4, 0, 0 },
+  // rep stos %eax,%es:(%rdi)
+  { { 0xf3, 0xab }, 0, REG_WRITE, 0, 4, 0, 0 },
+  // rep stos %rax,%es:(%rdi)
+  { { 0xf3, 0x48, 0xab }, 0, REG_WRITE, 0, 8, 0, 0 },
+  // mov %eax,%eax --- no memory operand
+  { { 0x89, 0xc0 }, 0, REG_WRITE, 0, 4, 0, 0 },
+  // mov (%rdi),%eax --- loads are never emulated
+  { { 0x8b, 0x07 }, 0, REG_READ, 0, 4, 0, 0 },
+  // nop
+  { { 0x90 }, -1, OTHERS, 0, 0, 0, 0 },
+};
+
+/**************************************************************************/
+// decode_selftest
+/**************************************************************************/
+// check decoded types, lengths, widths and operands; returns the
+// number of failed cases
+static int
+decode_selftest(void)
+{
+  struct ins_desc desc;
+  unsigned long   ip     = 0;
+  unsigned int    i      = 0;
+  int             failed = 0;
+  int             ret    = 0;
+
+  for(i = 0; i < ARRAY_SIZE(decode_tests); i++) {
+    ip = (unsigned long) decode_tests[i].code;
+    ret = get_ins_desc(ip, &desc);
+    if(ret != decode_tests[i].ret ||
+       desc.type != decode_tests[i].type ||
+       (ret == 0 &&
+        (desc.len != decode_tests[i].len ||
+         get_ins_len(ip) != decode_tests[i].len ||
+         desc.mem_width != decode_tests[i].mem_width ||
+         (desc.type == REG_WRITE && desc.reg != decode_tests[i].reg) ||
+         (desc.type == IMM_WRITE && desc.imm != decode_tests[i].imm)))) {
+      neon_error("%s : case %u (%02x %02x %02x) : ret %d type %d len %u "
+                 "width %u reg %u imm 0x%lx", __func__, i,
+                 decode_tests[i].code[0], decode_tests[i].code[1],
+                 decode_tests[i].code[2], ret, desc.type, desc.len,
+                 desc.mem_width, desc.reg, desc.imm);
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+/**************************************************************************/
+// track_index_selftest
+/**************************************************************************/
+// enlist, look up and withdraw a few ranges; returns the number of
+// failed checks
+static int
+track_index_selftest(void)
+{
+  static struct vm_area_struct vma[3];
+  neon_track_index_t  index;
+  neon_map_t         *map[3] = { NULL, NULL, NULL };
+  unsigned int        i      = 0;
+  int                 failed = 0;
+
+  neon_track_index_init(&index);
+  for(i = 0; i < ARRAY_SIZE(map); i++) {
+    map[i] = neon_map_init(0, 0, i + 1);
+    if(map[i] == NULL) {
+      failed++;
+      goto track_index_selftest_out;
+    }
+    // ranges of 2 pages, a page apart, enlisted out of order
+    vma[i].vm_start = 0x10000000UL + (2 - i) * 3 * PAGE_SIZE;
+    map[i]->vma = &vma[i];
+    map[i]->size = 2 * PAGE_SIZE;
+    RB_CLEAR_NODE(&map[i]->index_node);
+    track_index_insert(&index, map[i]);
+  }
+
+  for(i = 0; i < ARRAY_SIZE(map); i++) {
+    unsigned long start = vma[i].vm_start;
+    if(neon_track_lookup(&index, start) != map[i] ||
+       neon_track_lookup(&index, start + PAGE_SIZE + 8) != map[i] ||
+       neon_track_lookup(&index, start + 2 * PAGE_SIZE - 1) != map[i] ||
+       neon_track_lookup(&index, start + 2 * PAGE_SIZE) != NULL ||
+       neon_track_lookup(&index, start - 1) != NULL) {
+      neon_error("%s : lookup of range %u failed", __func__, i);
+      failed++;
+    }
+  }
+
+  track_index_remove(map[1]);
+  if(neon_track_lookup(&index, vma[1].vm_start) != NULL ||
+     neon_track_lookup(&index, vma[0].vm_start) != map[0] ||
+     neon_track_lookup(&index, vma[2].vm_start) != map[2]) {
+    neon_error("%s : lookup after remove failed", __func__);
+    failed++;
+  }
+
+ track_index_selftest_out:
+  for(i = 0; i < ARRAY_SIZE(map); i++) {
+    if(map[i] == NULL)
+      continue;
+    track_index_remove(map[i]);
+    neon_obj_free(NEON_OBJ_MAP, map[i]);
+  }
+  if(!RB_EMPTY_ROOT(&index.root)) {
+    neon_error("%s : index not empty", __func__);
+    failed++;
+  }
+
+  return failed;
+}
+
+/**************************************************************************/
+// fault hand-off stress: threads of one task look up their fault
+// record, save a fault in it and stash it, then take it back the way
+// the fault handler and the step trap do, on every cpu at once and
+// hopping cpus between the two now and then (as a fault handler
+// blocked in submit may); each must get its own record back, with the
+// fault state it saved. Real doorbell faults need a GPU client, so the
+// page fault and the single-step themselves are not exercised here
+#define NEON_STRESS_THREADS 16    // at most, two per online cpu
+#define NEON_STRESS_ROUNDS  20000 // hand-offs per thread
+#define NEON_STRESS_HOP     64    // hop cpus every that many hand-offs
+
+typedef struct {
+  // the task the threads share
+  neon_task_t       *task;
+  atomic_t           running;
+  atomic_long_t      handoffs;
+  atomic_long_t      hopped;
+  atomic_long_t      failed;
+  struct completion  done;
+} fault_stress_t;
+
+/**************************************************************************/
+// fault_stress_save
+/**************************************************************************/
+// save a fault state particular to a thread and round
+static inline void
+fault_stress_save(neon_fault_t * const fault,
+                  const unsigned int round)
+{
+  const unsigned long key = ((unsigned long) fault->pid << 32) | round;
+
+  fault->op       = 'W';
+  fault->ip       = key;
+  fault->val      = ~key;
+  fault->width    = 1U << (round & 3);
+  fault->page_num = round;
+  fault->siamese  = key ^ 0x5a5a5a5aUL;
+
+  return;
+}
+
+/**************************************************************************/
+// fault_stress_check
+/**************************************************************************/
+// whether a fault taken back holds the state saved for thread and round
+static inline int
+fault_stress_check(const neon_fault_t * const fault,
+                   const unsigned int round)
+{
+  const unsigned long key = ((unsigned long) current->pid << 32) | round;
+
+  return fault->pid == current->pid && fault->op == 'W' &&
+    fault->ip == key && fault->val == ~key &&
+    fault->width == 1U << (round & 3) && fault->page_num == round &&
+    fault->siamese == (key ^ 0x5a5a5a5aUL);
+}
+
+/**************************************************************************/
+// fault_stress_thread
+/**************************************************************************/
+static int
+fault_stress_thread(void *arg)
+{
+  fault_stress_t * const s     = arg;
+  neon_fault_t           tmpl;
+  neon_fault_t          *first = NULL;
+  neon_fault_t          *fault = NULL;
+  neon_fault_t          *f     = NULL;
+  unsigned long          hops  = 0;
+  unsigned long          fails = 0;
+  unsigned int           round = 0;
+  unsigned int           cpu   = 0;
+  unsigned int           next  = 0;
+
+  memset(&tmpl, 0, sizeof(tmpl));
+
+  for(round = 1; round <= NEON_STRESS_ROUNDS; round++) {
+    // as the fault handler: the record is found (made on the first
+    // fault) by pid, while the other threads look up theirs
+    preempt_disable();
+    fault = neon_thread_fault(&s->task->faults, current->pid, &tmpl);
+    if(fault == NULL || (first != NULL && fault != first)) {
+      preempt_enable();
+      fails++;
+      break;
+    }
+    first = fault;
+    cpu = smp_processor_id();
+    fault_stress_save(fault, round);
+    neon_fault_stash(fault);
+    if(round % NEON_STRESS_HOP == 0) {
+      preempt_enable();
+      next = cpumask_next(cpu, cpu_online_mask);
+      if(next >= nr_cpu_ids)
+        next = cpumask_first(cpu_online_mask);
+      set_cpus_allowed_ptr(current, cpumask_of(next));
+      preempt_disable();
+    }
+    // as the step trap
+    f = fault_unstash(s->task);
+    if(f != fault || fault_stress_check(f, round) == 0)
+      fails++;
+    else if(smp_processor_id() != cpu)
+      hops++;
+    if(f != NULL)
+      f->stepping = 0;
+    preempt_enable();
+    if(round % NEON_STRESS_HOP == 0)
+      cond_resched();
+  }
+  neon_thread_fault_drop(&s->task->faults, current);
+
+  atomic_long_add(round - 1, &s->handoffs);
+  atomic_long_add(hops, &s->hopped);
+  atomic_long_add(fails, &s->failed);
+  if(atomic_dec_and_test(&s->running))
+    complete(&s->done);
+
+  return 0;
+}
+
+/**************************************************************************/
+// fault_stress
+/**************************************************************************/
+// run the hand-off stress; returns the number of failed checks
+static int
+fault_stress(void)
+{
+  fault_stress_t      s;
+  struct task_struct *tsk      = NULL;
+  unsigned int        nthreads = 0;
+  unsigned int        cpu      = 0;
+  unsigned int        i        = 0;
+  int                 failed   = 0;
+
+  memset(&s, 0, sizeof(s));
+  s.task = kzalloc(sizeof(neon_task_t), GFP_KERNEL);
+  if(s.task == NULL)
+    return 1;
+  neon_thread_faults_init(&s.task->faults);
+  init_completion(&s.done);
+
+  nthreads = min(2 * num_online_cpus(), (unsigned int) NEON_STRESS_THREADS);
+  // hold the count up till every thread is started
+  atomic_set(&s.running, 1);
+  cpu = cpumask_first(cpu_online_mask);
+  for(i = 0; i < nthreads; i++) {
+    tsk = kthread_create(fault_stress_thread, &s, "neon_stress/%u", i);
+    if(IS_ERR(tsk)) {
+      failed++;
+      break;
+    }
+    kthread_bind(tsk, cpu);
+    atomic_inc(&s.running);
+    wake_up_process(tsk);
+    cpu = cpumask_next(cpu, cpu_online_mask);
+    if(cpu >= nr_cpu_ids)
+      cpu = cpumask_first(cpu_online_mask);
+  }
+  if(!atomic_dec_and_test(&s.running))
+    wait_for_completion(&s.done);
+
+  for(i = 0; i < NEON_THREAD_FAULTS_SIZE; i++)
+    if(!hlist_empty(&s.task->faults.bucket[i])) {
+      neon_error("%s : fault records left behind", __func__);
+      failed++;
+      break;
+    }
+  neon_thread_faults_fini(&s.task->faults);
+  kfree(s.task);
+
+  neon_report("fault stress : %u threads on %u cpus : %ld hand-offs : "
+              "%ld across cpus : %ld failed", nthreads, num_online_cpus(),
+              atomic_long_read(&s.handoffs), atomic_long_read(&s.hopped),
+              atomic_long_read(&s.failed));
+  if(atomic_long_read(&s.failed) != 0) {
+    neon_error("%s : %ld hand-offs took a wrong or clobbered fault",
+               __func__, atomic_long_read(&s.failed));
+    failed++;
+  }
+
+  return failed;
+}
+
+/**************************************************************************/
+// arming bench: re-engage a task of NEON_BENCH_MAPS one-page channel
+// maps, the pages of a scratch mapping of the loading process, with
+// the process's mm live on up to NEON_BENCH_PEERS other cpus (kthreads
+// borrowing it), so shootdowns have somewhere to go
+#define NEON_BENCH_MAPS   64   // channel maps re-engaged per round
+#define NEON_BENCH_PEERS  3    // other cpus the mm is live on, at most
+#define NEON_BENCH_ROUNDS 200  // re-engagements per arming method
+
+/**************************************************************************/
+// arming_bench_peer
+/**************************************************************************/
+// keep an mm live on this cpu (in its mm_cpumask) till stopped
+static int
+arming_bench_peer(void *arg)
+{
+  struct mm_struct * const mm = arg;
+
+  use_mm(mm);
+  while(!kthread_should_stop())
+    cpu_relax();
+  unuse_mm(mm);
+
+  return 0;
+}
+
+/**************************************************************************/
+// arming_bench_round
+/**************************************************************************/
+// arm all maps one way, then disarm them (untimed); returns nSec spent
+// arming: per page with a local flush (the old, single-cpu way), per
+// page with a shootdown each, or batched behind a single shootdown
+static unsigned long
+arming_bench_round(neon_map_t ** const map,
+                   const unsigned int how)
+{
+  neon_track_batch_t batch;
+  ktime_t            t0 = ktime_get();
+  ktime_t            t1;
+  unsigned int       i  = 0;
+
+  neon_track_batch_init(&batch);
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    neon_page_t * const page = &map[i]->page[0];
+    if(how == 0)
+      neon_page_arming(1, page);
+    else if(how == 1) {
+      page_arming(1, page);
+      neon_flush_tlb_range(map[i]->vma->vm_mm, page->addr,
+                           page->addr + PAGE_SIZE);
+    } else
+      neon_track_batch_arm(1, map[i], &batch);
+  }
+  neon_track_batch_flush(&batch);
+  t1 = ktime_get();
+
+  for(i = 0; i < NEON_BENCH_MAPS; i++)
+    neon_track_batch_arm(0, map[i], &batch);
+  neon_track_batch_flush(&batch);
+
+  return ktime_to_ns(ktime_sub(t1, t0));
+}
+
+/**************************************************************************/
+// arming_bench
+/**************************************************************************/
+// time re-engaging a many-channel task with each arming method;
+// returns the number of failed checks (setup failures, or pages not
+// left present)
+static int
+arming_bench(void)
+{
+  static const char * const  hows[] = {
+    "per page, local flush", "per page, shootdown", "batched" };
+  struct mm_struct * const   mm     = current->mm;
+  const unsigned long        len    = NEON_BENCH_MAPS * PAGE_SIZE;
+  struct task_struct        *peer[NEON_BENCH_PEERS];
+  neon_map_t                *map[NEON_BENCH_MAPS];
+  struct vm_area_struct     *vma    = NULL;
+  unsigned long              addr   = 0;
+  unsigned long              size   = 0;
+  unsigned long              ns     = 0;
+  unsigned int               npeers = 0;
+  unsigned int               cpu    = 0;
+  unsigned int               how    = 0;
+  unsigned int               i      = 0;
+  int                        failed = 0;
+
+  memset(map, 0, sizeof(map));
+  if(mm == NULL) {
+    neon_report("arming bench : no user mm to arm : skipped");
+    return 0;
+  }
+
+  addr = vm_mmap(NULL, 0, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, 0);
+  if(IS_ERR_VALUE(addr)) {
+    neon_error("%s : scratch mapping failed", __func__);
+    return 1;
+  }
+
+  down_read(&mm->mmap_sem);
+  vma = find_vma(mm, addr);
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    map[i] = neon_map_init(0, 0, i + 1);
+    if(map[i] == NULL || vma == NULL) {
+      failed++;
+      goto arming_bench_out;
+    }
+    map[i]->vma = vma;
+    map[i]->size = PAGE_SIZE;
+    map[i]->page = map[i]->page_inline;
+    map[i]->page[0].addr = addr + i * PAGE_SIZE;
+    if(neon_follow_pte(vma, map[i]->page[0].addr,
+                       &map[i]->page[0].pte, &size) != 0 ||
+       size != PAGE_SIZE) {
+      neon_error("%s : page %u of the scratch mapping not found",
+                 __func__, i);
+      failed++;
+      goto arming_bench_out;
+    }
+  }
+
+  for_each_online_cpu(cpu) {
+    if(npeers == NEON_BENCH_PEERS)
+      break;
+    if(cpu == raw_smp_processor_id())
+      continue;
+    peer[npeers] = kthread_create(arming_bench_peer, mm, "neon_bench/%u",
+                                  cpu);
+    if(IS_ERR(peer[npeers]))
+      break;
+    kthread_bind(peer[npeers], cpu);
+    wake_up_process(peer[npeers]);
+    npeers++;
+  }
+  // let the peers switch to the mm
+  msleep(10);
+
+  for(how = 0; how < ARRAY_SIZE(hows); how++) {
+    ns = 0;
+    for(i = 0; i < NEON_BENCH_ROUNDS; i++)
+      ns += arming_bench_round(map, how);
+    neon_report("arming bench : %s : %u channels : %u other cpus : "
+                "nsec/re-engagement %lu", hows[how], NEON_BENCH_MAPS,
+                npeers, ns / NEON_BENCH_ROUNDS);
+  }
+
+  for(i = 0; i < npeers; i++)
+    kthread_stop(peer[i]);
+
+ arming_bench_out:
+  for(i = 0; i < NEON_BENCH_MAPS; i++) {
+    if(map[i] == NULL)
+      continue;
+    // never unmap an armed page
+    if(map[i]->page != NULL && map[i]->page[0].armed != 0) {
+      neon_error("%s : page %u left armed", __func__, i);
+      neon_page_arming(0, &map[i]->page[0]);
+      failed++;
+    }
+    neon_obj_free(NEON_OBJ_MAP, map[i]);
+  }
+  up_read(&mm->mmap_sem);
+  vm_munmap(addr, len);
+
+  return failed;
+}
+
+/**************************************************************************/
+// neon_track_selftest
+/**************************************************************************/
+// check the fault decoder, the tracked range index and the fault
+// hand-off to the step trap, and time page arming; 0 on success
+int
+neon_track_selftest(void)
+{
+  int failed = decode_selftest() + track_index_selftest() + fault_stress() +
+    arming_bench();
+
+  if(failed != 0) {
+    neon_error("%s : %d checks failed", __func__, failed);
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif // NEON_SELFTEST
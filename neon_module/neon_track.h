@@ -9,10 +9,18 @@
 #define __NEON_TRACK_H__
 
 #include <linux/semaphore.h> // sempahore for multi-fault control
+#include <linux/rbtree.h>    // tracked range index
+#include <linux/spinlock.h>  // rwlock
+#include <linux/list.h>      // hlist
+#include <linux/sched.h>     // pid_t, task_struct
+#include <asm/ptrace.h>      // pt_regs
+#include <asm/pf_in.h>       // ins_desc
 
 /**************************************************************************/
 // external declarations
 struct _neon_map_t_; // control.h
+struct _neon_task_t_; // control.h
+struct vm_area_struct;
 extern struct notifier_block nb_die; // track.c
 
 /**************************************************************************/
@@ -22,16 +30,23 @@ typedef struct _neon_page_t_ {
   pte_t *pte;
   // associated vaddr
   unsigned long addr;
+  // pte bit cleared while armed (_PAGE_PRESENT, or _PAGE_RW)
+  pteval_t mask;
   // per-cpu saved presence manipulation
   pteval_t saved_ptev;
   // boolean status (re-entrant)
   unsigned int armed;
-  // boolean status (re-entrant)
+  // page holds the channel's index register
+  unsigned int ir;
+  // page left present by track start/restart (see track_ir_only)
+  unsigned int skip;
 } neon_page_t;
 
 /**************************************************************************/
-// page fault handling information
+// page fault handling information, one record per faulting thread
 typedef struct _neon_fault_t_ {
+  // faulting thread
+  pid_t pid;
   // instruction mnemonic
   char op;
   // faulting instruction pointer
@@ -40,35 +55,210 @@ typedef struct _neon_fault_t_ {
   unsigned long addr;
   // R/W value of faulting operation
   unsigned long val;
+  // bytes accessed in memory
+  unsigned int width;
+  // length of the instruction if a plain MOV store, 0 otherwise
+  unsigned int len;
   // saved flags to restore at mapping
   unsigned long flags;
   // back-pointer to associated page
   unsigned long page_num;
   // 2-fault at page-boundary : rearm after handling
   unsigned long siamese;
-  // back-pointer to associated map
+  // back-pointer to associated map (NULL once trapped, or the map is
+  // gone)
   struct _neon_map_t_ *map;
-  // entry in ctx's list of faulting maps
+  // set from stashing till the trap: the thread single-steps over
+  // this fault, so its next step trap is ours
+  unsigned int stepping;
+  // entry in ctx's list of faults in transit (fault->trap)
   struct list_head entry;
+  // entry in task's fault records
+  struct hlist_node hash;
 } neon_fault_t;
 
+/**************************************************************************/
+// per-task fault records, hashed by thread pid; threads of a task
+// fault and single-step concurrently, each on a record of its own
+#define NEON_THREAD_FAULTS_BITS 4
+#define NEON_THREAD_FAULTS_SIZE (1 << NEON_THREAD_FAULTS_BITS)
+
+typedef struct _neon_thread_faults_t_ {
+  // records by hash_long(pid)
+  struct hlist_head bucket[NEON_THREAD_FAULTS_SIZE];
+  // protect this struct
+  spinlock_t lock;
+} neon_thread_faults_t;
+
+/**************************************************************************/
+// per-task index of tracked (armed) map ranges, used by the fault
+// handler to tell tracked from untracked addresses in O(log n)
+typedef struct _neon_track_index_t_ {
+  // maps ordered by vma->vm_start; ranges never overlap
+  struct rb_root root;
+  // protect this struct
+  rwlock_t lock;
+} neon_track_index_t;
+
+/**************************************************************************/
+// pages (re-)armed together, awaiting a single ranged tlb shootdown;
+// a batch never spans more than one mm
+typedef struct _neon_track_batch_t_ {
+  // mm of the pages armed, pinned (mm_count) until flushed
+  struct mm_struct *mm;
+  // range covering all pages armed
+  unsigned long start;
+  unsigned long end;
+  // number of pages armed since last flush
+  unsigned int npages;
+} neon_track_batch_t;
+
+/**************************************************************************/
+// per-task cache of decoded faulting instructions, direct-mapped by
+// user ip; drivers touch the registers from a handful of fixed sites.
+// Entries keep the instruction bytes they were decoded from, so that
+// code rewritten in place (JIT) is decoded anew
+#define NEON_DECODE_CACHE_BITS 3
+#define NEON_DECODE_CACHE_SIZE (1 << NEON_DECODE_CACHE_BITS)
+#define NEON_DECODE_CODE_LEN   16 // longest x86 instruction is 15 bytes
+
+typedef struct _neon_decode_cache_t_ {
+  // user ip of each entry's instruction (0 if empty)
+  unsigned long ip[NEON_DECODE_CACHE_SIZE];
+  // decoded instruction
+  struct ins_desc desc[NEON_DECODE_CACHE_SIZE];
+  // instruction bytes decoded (the whole instruction for MOV stores)
+  unsigned char code[NEON_DECODE_CACHE_SIZE][NEON_DECODE_CODE_LEN];
+  unsigned int ncode[NEON_DECODE_CACHE_SIZE];
+  // protect this struct
+  spinlock_t lock;
+} neon_decode_cache_t;
+
+/**************************************************************************/
+// sys/proc managed options
+
+// emulate 32-bit MOV stores to a channel's index register in the
+// fault handler (page stays armed), instead of single-stepping them
+#define NEON_TRACK_EMULATE_DEFAULT 1 // 1=true/0=false
+
+// arm only the page of an index register map that holds the index
+// register, leaving neighboring registers' pages present
+#define NEON_TRACK_IR_ONLY_DEFAULT 1 // 1=true/0=false
+
+// arm pages by making them read-only instead of not-present, so that
+// only stores fault; reads go straight to the register
+#define NEON_TRACK_WRONLY_DEFAULT  1 // 1=true/0=false
+
+// watch index registers with hardware write watchpoints (debug
+// registers) instead of arming their pages, for single-threaded tasks
+// under a non-blocking policy; maps beyond the available slots (or of
+// a task that turns multi-threaded, or whose stores cannot be decoded
+// at the watchpoint's trap) fall back to page arming
+#define NEON_TRACK_WATCH_DEFAULT   0 // 1=true/0=false
+
+extern unsigned int _track_emulate_;
+extern unsigned int track_emulate;
+
+extern unsigned int _track_ir_only_;
+extern unsigned int track_ir_only;
+
+extern unsigned int _track_wronly_;
+extern unsigned int track_wronly;
+
+extern unsigned int _track_watch_;
+extern unsigned int track_watch;
+
+extern char track_report[];
+int neon_track_report(char *buf, size_t len);
+
+#define NEON_TRACK_EMULATE_KNOB  {              \
+    .procname = "track_emulate",                \
+      .data = &_track_emulate_,                 \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_TRACK_IR_ONLY_KNOB  {              \
+    .procname = "track_ir_only",                \
+      .data = &_track_ir_only_,                 \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_TRACK_WRONLY_KNOB  {               \
+    .procname = "track_wronly",                 \
+      .data = &_track_wronly_,                  \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_TRACK_WATCH_KNOB  {                \
+    .procname = "track_watch",                  \
+      .data = &_track_watch_,                   \
+      .maxlen = sizeof(int),                    \
+      .mode = 0666,                             \
+      .proc_handler = &proc_dointvec,           \
+      }
+#define NEON_TRACK_REPORT_KNOB                                  \
+  NEON_REPORT_KNOB("track_stats", track_report, neon_track_report)
+
 /**************************************************************************/
 // page-access tracking and management calls
 
+void neon_track_index_init(neon_track_index_t * const index);
+struct _neon_map_t_ *neon_track_lookup(neon_track_index_t * const index,
+                                       const unsigned long addr);
+
 int  neon_track_init(struct _neon_map_t_ * const map);
-int  neon_track_start(struct _neon_map_t_ * const map);
+void neon_track_focus(struct _neon_map_t_ * const map,
+                      const unsigned long addr);
+void neon_track_account(const neon_page_t * const page,
+                        const unsigned int submit);
+int  neon_track_start(struct _neon_map_t_ * const map,
+                      neon_track_index_t * const index);
 int  neon_track_stop(struct _neon_map_t_ * const map);
+void neon_track_unwatch(struct _neon_task_t_ * const neon_task);
 void neon_track_restart(unsigned int arm, struct _neon_map_t_ *map);
+void neon_track_batch_init(neon_track_batch_t * const batch);
+void neon_track_batch_arm(unsigned int arm,
+                          struct _neon_map_t_ * const map,
+                          neon_track_batch_t * const batch);
+void neon_track_batch_flush(neon_track_batch_t * const batch);
+void neon_track_batch_drop(neon_track_batch_t * const batch);
 void neon_track_fini(struct _neon_map_t_ * const map);
 
 void neon_page_arming(unsigned int arm, neon_page_t *page);
 void neon_page_print(const neon_page_t * const page);
 
+void neon_decode_cache_init(neon_decode_cache_t * const cache);
+void neon_decode_cache_flush(neon_decode_cache_t * const cache,
+                             const unsigned long start,
+                             const unsigned long end);
+
 void neon_fault_save_decode(struct pt_regs * regs,
                             unsigned long addr,
                             struct _neon_map_t_ * const map,
                             unsigned long page_num,
+                            neon_decode_cache_t * const cache,
                             neon_fault_t * const fault);
 void neon_fault_print(const neon_fault_t * const fault);
+void neon_fault_stash(neon_fault_t * const fault);
+
+void neon_thread_faults_init(neon_thread_faults_t * const faults);
+neon_fault_t *neon_thread_fault(neon_thread_faults_t * const faults,
+                                const pid_t pid,
+                                const neon_fault_t * const tmpl);
+void neon_thread_fault_drop(neon_thread_faults_t * const faults,
+                            struct task_struct * const tsk);
+void neon_thread_faults_fini(neon_thread_faults_t * const faults);
+unsigned int neon_fault_emulable(const neon_fault_t * const fault);
+void neon_fault_emulate(struct pt_regs * regs,
+                        void * const kvaddr,
+                        const u32 val,
+                        const unsigned long ip_next);
+
+#ifdef NEON_SELFTEST
+int  neon_track_selftest(void);
+#endif // NEON_SELFTEST
 
 #endif // __NEON_TRACK_H__
@@ -20,7 +20,21 @@
 
 static ctl_table knob_neon_options[] = {
   NEON_POLLING_KNOB,
+  NEON_POLLING_FLOOR_KNOB,
+  NEON_POLLING_CPUS_KNOB,
+  NEON_POLLING_REPORT_KNOB,
+  NEON_PREDICT_KNOB,
+  NEON_POLLING_MWAIT_KNOB,
+  NEON_SUBMIT_DEFER_KNOB,
   NEON_MALICIOUS_KNOB,
+  NEON_MALICIOUS_HOLD_KNOB,
+  NEON_MALICIOUS_KILL_KNOB,
+  NEON_TRACK_EMULATE_KNOB,
+  NEON_TRACK_IR_ONLY_KNOB,
+  NEON_TRACK_WRONLY_KNOB,
+  NEON_TRACK_WATCH_KNOB,
+  NEON_TRACK_REPORT_KNOB,
+  NEON_ALLOC_REPORT_KNOB,
   NEON_POLICY_KNOB,
   NEON_POLICY_TIMESLICE_KNOB,
   NEON_POLICY_FCFS_KNOB,
@@ -0,0 +1,170 @@
+/**************************************************************************/
+/*!
+  \brief  Time the fault-path decoding of a tracked store: the calls the
+          fault handler used to make with the pre-table decoder
+          (pf_in_ref.c: get_ins_type, then get_ins_reg_val or
+          get_ins_imm_val), the same calls on the table-driven decoder,
+          one get_ins_desc (a decode cache miss), and the value read
+          from a cached descriptor (a hit). x86-64 only.
+*/
+/**************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pf_in_ref.h"
+
+#define ROUNDS  200000  // passes over the instruction mix per run
+#define RUNS    5       // best of
+
+// a mix of doorbell stores, other stores, loads and a non-access
+static const unsigned char mix[][8] = {
+  { 0x89, 0x0f },                                 // mov %ecx,(%rdi)
+  { 0x89, 0x47, 0x08 },                           // mov %eax,0x8(%rdi)
+  { 0x44, 0x89, 0x07 },                           // mov %r8d,(%rdi)
+  { 0xc7, 0x07, 0x78, 0x56, 0x34, 0x12 },         // movl $imm,(%rdi)
+  { 0x89, 0x44, 0x24, 0x08 },                     // mov %eax,0x8(%rsp)
+  { 0x48, 0x89, 0x07 },                           // mov %rax,(%rdi)
+  { 0x66, 0x89, 0x07 },                           // mov %ax,(%rdi)
+  { 0x88, 0x07 },                                 // mov %al,(%rdi)
+  { 0x8b, 0x07 },                                 // mov (%rdi),%eax
+  { 0x0f, 0xb6, 0x07 },                           // movzbl (%rdi),%eax
+  { 0xf3, 0xab },                                 // rep stos
+  { 0x01, 0x07 },                                 // add %eax,(%rdi)
+};
+#define MIX_LEN  (sizeof(mix) / sizeof(mix[0]))
+
+static struct pt_regs         regs;
+static struct ins_desc        descs[MIX_LEN];
+static volatile unsigned long sink = 0;
+
+/**************************************************************************/
+// now_ns
+/**************************************************************************/
+static unsigned long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**************************************************************************/
+// decode passes, one per way of decoding
+/**************************************************************************/
+static void
+pass_ref(void)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < MIX_LEN; i++) {
+    const unsigned long ip = (unsigned long) mix[i];
+    switch(ref_get_ins_type(ip)) {
+    case REG_WRITE:
+      sink += ref_get_ins_reg_val(ip, &regs);
+      break;
+    case IMM_WRITE:
+      sink += ref_get_ins_imm_val(ip);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void
+pass_table(void)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < MIX_LEN; i++) {
+    const unsigned long ip = (unsigned long) mix[i];
+    switch(get_ins_type(ip)) {
+    case REG_WRITE:
+      sink += get_ins_reg_val(ip, &regs);
+      break;
+    case IMM_WRITE:
+      sink += get_ins_imm_val(ip);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void
+pass_desc(void)
+{
+  struct ins_desc desc;
+  unsigned int    i = 0;
+
+  for(i = 0; i < MIX_LEN; i++) {
+    if(get_ins_desc((unsigned long) mix[i], &desc) != 0)
+      continue;
+    if(desc.type == REG_WRITE)
+      sink += get_ins_desc_reg_val(&desc, &regs);
+    else if(desc.type == IMM_WRITE)
+      sink += desc.imm;
+  }
+}
+
+static void
+pass_cached(void)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < MIX_LEN; i++) {
+    if(descs[i].type == REG_WRITE)
+      sink += get_ins_desc_reg_val(&descs[i], &regs);
+    else if(descs[i].type == IMM_WRITE)
+      sink += descs[i].imm;
+  }
+}
+
+/**************************************************************************/
+// bench
+/**************************************************************************/
+// best ns per instruction of pass over RUNS runs
+static double
+bench(void (*pass)(void))
+{
+  unsigned long best = ~0UL;
+  unsigned long t    = 0;
+  unsigned int  run  = 0;
+  unsigned int  r    = 0;
+
+  for(run = 0; run < RUNS; run++) {
+    t = now_ns();
+    for(r = 0; r < ROUNDS; r++)
+      pass();
+    t = now_ns() - t;
+    if(t < best)
+      best = t;
+  }
+
+  return (double) best / ((double) ROUNDS * MIX_LEN);
+}
+
+/**************************************************************************/
+// main
+/**************************************************************************/
+int
+main(void)
+{
+  unsigned int i = 0;
+
+  memset(&regs, 0x5a, sizeof(regs));
+  for(i = 0; i < MIX_LEN; i++)
+    get_ins_desc((unsigned long) mix[i], &descs[i]);
+
+  printf("ns per instruction, %u instruction mix, best of %u\n",
+         (unsigned int) MIX_LEN, RUNS);
+  printf("  old decoder, type + value  : %6.1f\n", bench(pass_ref));
+  printf("  table decoder, type + value: %6.1f\n", bench(pass_table));
+  printf("  get_ins_desc + value       : %6.1f\n", bench(pass_desc));
+  printf("  cached descriptor value    : %6.1f\n", bench(pass_cached));
+
+  return 0;
+}
@@ -0,0 +1,316 @@
+/**************************************************************************/
+/*!
+  \brief  Check the table-driven pf_in decoder against the one it
+          replaced (pf_in_ref.c): every one- and two-byte opcode behind
+          no prefix, each prefix and each ordered pair of prefixes, and
+          for the opcodes the decoders know every ModRM byte (and a
+          spread of SIB bytes), must decode to the same type, memory
+          width, register value and immediate.
+
+          Three differences are deliberate fixes, and are counted
+          rather than failed, as long as the new decoding is the right
+          one:
+          - REX.W wins over a 66 prefix: 66 48 89 is an 8-byte store,
+            not a 2-byte one;
+          - C7 under REX.W stores 8 bytes from an imm32, sign-extended;
+            the old decoder took a 4-byte store of an imm64;
+          - the immediate of C6/C7 follows the SIB byte and a SIB-base
+            disp32; the old decoder read it from right after the ModRM
+            byte (or its disp32).
+          x86-64 only.
+*/
+/**************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "pf_in_ref.h"
+
+/****************************************************************************/
+// instruction bytes
+
+#define CODE_SIZE  32   // longest decoding reads 2+2+1+1+4+8 bytes
+
+static const unsigned char prefixes[] = {
+  0x66, 0x67, 0x2e, 0x3e, 0x26, 0x64, 0x65, 0x36, 0xf0, 0xf3, 0xf2,
+  0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+  0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+};
+
+// SIB bytes: every base, with assorted index and scale
+static const unsigned char sibs[] = {
+  0x20, 0x61, 0xa2, 0xe3, 0x24, 0x65, 0xa6, 0xe7, 0x25, 0x05,
+};
+
+struct prefix_set {
+  unsigned int shorted;   // 66
+  unsigned int enlarged;  // REX.W
+  unsigned int rexr;      // REX.R
+};
+
+/****************************************************************************/
+// counters
+static unsigned long compared   = 0;
+static unsigned long identical  = 0;
+static unsigned long rexw_o16   = 0;
+static unsigned long c7_imm32   = 0;
+static unsigned long sib_imm    = 0;
+static unsigned long failed     = 0;
+
+static unsigned long  gpr[16];
+static struct pt_regs regs;
+
+/**************************************************************************/
+// regs_fill
+/**************************************************************************/
+// distinct values in every byte of every register
+static void
+regs_fill(void)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < 16; i++)
+    gpr[i] = 0x8070605040302010UL ^ (i * 0x0101010101010101UL);
+
+  regs.ax  = gpr[0];  regs.cx  = gpr[1];  regs.dx  = gpr[2];
+  regs.bx  = gpr[3];  regs.sp  = gpr[4];  regs.bp  = gpr[5];
+  regs.si  = gpr[6];  regs.di  = gpr[7];  regs.r8  = gpr[8];
+  regs.r9  = gpr[9];  regs.r10 = gpr[10]; regs.r11 = gpr[11];
+  regs.r12 = gpr[12]; regs.r13 = gpr[13]; regs.r14 = gpr[14];
+  regs.r15 = gpr[15];
+}
+
+/**************************************************************************/
+// is_prefix
+/**************************************************************************/
+static unsigned int
+is_prefix(const unsigned int byte)
+{
+  unsigned int i = 0;
+
+  for(i = 0; i < sizeof(prefixes); i++)
+    if(prefixes[i] == byte)
+      return 1;
+  return 0;
+}
+
+/**************************************************************************/
+// spec_imm
+/**************************************************************************/
+// the immediate of a C6/C7 whose ModRM byte is at mpos
+static unsigned long
+spec_imm(const unsigned char *code,
+         const unsigned int mpos,
+         const unsigned int opcode,
+         const struct prefix_set *prf)
+{
+  const unsigned char mod = code[mpos] >> 6;
+  const unsigned char rm  = code[mpos] & 7;
+  const unsigned char *p  = code + mpos + 1;
+  int                  i32 = 0;
+
+  if(mod != 3 && rm == 4) {
+    if(mod == 0 && (*p & 7) == 5)
+      p += 4;
+    p++;
+  } else if(mod == 0 && rm == 5) {
+    p += 4;
+  }
+  if(mod == 1)
+    p += 1;
+  else if(mod == 2)
+    p += 4;
+
+  if(opcode == 0xc6)
+    return *p;
+  if(prf->shorted && !prf->enlarged)
+    return *(unsigned short *) p;
+  memcpy(&i32, p, 4);
+  return prf->enlarged ? (unsigned long) (long) i32 : (unsigned int) i32;
+}
+
+/**************************************************************************/
+// check_one
+/**************************************************************************/
+// decode code with both decoders and compare (mpos: ModRM byte offset)
+static void
+check_one(const unsigned char *code,
+          const unsigned int len,
+          const unsigned int mpos,
+          const unsigned int opcode,
+          const struct prefix_set *prf)
+{
+  const unsigned long     ip   = (unsigned long) code;
+  const unsigned char     mod  = code[mpos] >> 6;
+  const unsigned char     rm   = code[mpos] & 7;
+  const enum reason_type  type = ref_get_ins_type(ip);
+  struct ins_desc         desc;
+  unsigned long           old  = 0;
+  unsigned long           val  = 0;
+  unsigned int            diff = 0;
+  unsigned int            i    = 0;
+  unsigned int            reg  = 0;
+  const char             *what = "type";
+
+  compared++;
+  if(get_ins_desc(ip, &desc) != 0)
+    desc.type = OTHERS;
+  if(desc.type != type)
+    goto fail;
+  if(type == OTHERS) {
+    identical++;
+    return;
+  }
+
+  // memory width
+  what = "width";
+  if(desc.mem_width != ref_get_ins_mem_width(ip)) {
+    if(desc.mem_width != 8 || !prf->enlarged ||
+       (!prf->shorted && opcode != 0xc7))
+      goto fail;
+    diff |= (prf->shorted ? 1 : 0) | (opcode == 0xc7 ? 2 : 0);
+  }
+
+  // register operand
+  if(type == REG_READ || type == REG_WRITE) {
+    what = "register";
+    old = ref_get_ins_reg_val(ip, &regs);
+    val = get_ins_desc_reg_val(&desc, &regs);
+    reg = (opcode == 0xaa || opcode == 0xab) ? 0 :
+      (((code[mpos] >> 3) & 7) | (prf->rexr << 3));
+    if(val != old) {
+      if(!prf->shorted || !prf->enlarged || desc.reg_width != 8 ||
+         val != gpr[reg])
+        goto fail;
+      diff |= 1;
+    }
+  }
+
+  // immediate; the new one must also be the right one
+  if(type == IMM_WRITE) {
+    what = "immediate";
+    old = ref_get_ins_imm_val(ip);
+    val = desc.imm;
+    if(val != spec_imm(code, mpos, opcode, prf))
+      goto fail;
+    if(val != old) {
+      if(mod != 3 && rm == 4)
+        diff |= 4;
+      if(opcode == 0xc7 && prf->enlarged)
+        diff |= 2;
+      if((diff & 6) == 0)
+        goto fail;
+    }
+  }
+
+  if(diff == 0)
+    identical++;
+  rexw_o16 += (diff & 1) != 0;
+  c7_imm32 += (diff & 2) != 0;
+  sib_imm  += (diff & 4) != 0;
+  return;
+
+fail:
+  if(++failed <= 20) {
+    printf("FAIL %s : ", what);
+    for(i = 0; i < len; i++)
+      printf("%02x ", code[i]);
+    printf(": type %d/%d width %u imm/reg 0x%lx/0x%lx\n", desc.type, type,
+           desc.mem_width, val, old);
+  }
+}
+
+/**************************************************************************/
+// check_opcode
+/**************************************************************************/
+// one opcode behind the prefixes at code[0..n)
+static void
+check_opcode(unsigned char *code,
+             const unsigned int n,
+             const unsigned int opcode,
+             const struct prefix_set *prf)
+{
+  unsigned int mpos  = n;
+  unsigned int modrm = 0;
+  unsigned int s     = 0;
+  unsigned int i     = 0;
+
+  if(opcode > 0xff)
+    code[mpos++] = 0x0f;
+  code[mpos] = opcode & 0xff;
+  mpos++;
+
+  // distinct bytes after the ModRM byte, some with the top bit set
+  for(i = mpos; i < CODE_SIZE; i++)
+    code[i] = 0x81 + (i - mpos) * 0x0b;
+
+  code[mpos] = 0x07;
+  if(ref_get_ins_type((unsigned long) code) == OTHERS) {
+    check_one(code, mpos + 1, mpos, opcode, prf);
+    return;
+  }
+
+  for(modrm = 0; modrm < 0x100; modrm++) {
+    code[mpos] = modrm;
+    if((modrm >> 6) == 3 || (modrm & 7) != 4) {
+      check_one(code, mpos + 1, mpos, opcode, prf);
+      continue;
+    }
+    for(s = 0; s < sizeof(sibs); s++) {
+      code[mpos + 1] = sibs[s];
+      check_one(code, mpos + 2, mpos, opcode, prf);
+    }
+  }
+}
+
+/**************************************************************************/
+// main
+/**************************************************************************/
+int
+main(void)
+{
+  const int         np = (int) sizeof(prefixes);
+  unsigned char     code[CODE_SIZE];
+  struct prefix_set prf;
+  unsigned int      n      = 0;
+  unsigned int      opcode = 0;
+  unsigned int      i      = 0;
+  int               a      = 0;
+  int               b      = 0;
+
+  regs_fill();
+
+  // no prefix, each prefix, then each ordered pair
+  for(a = -1; a < np; a++)
+    for(b = -1; b < np; b++) {
+      if(a < 0 && b >= 0)
+        continue;
+      n = 0;
+      if(a >= 0)
+        code[n++] = prefixes[a];
+      if(b >= 0)
+        code[n++] = prefixes[b];
+
+      memset(&prf, 0, sizeof(prf));
+      for(i = 0; i < n; i++) {
+        if(code[i] == 0x66)
+          prf.shorted = 1;
+        if((code[i] & 0xf8) == 0x48)
+          prf.enlarged = 1;
+        if((code[i] & 0xf4) == 0x44)
+          prf.rexr = 1;
+      }
+
+      for(opcode = 0; opcode < 0x200; opcode++) {
+        // prefix and escape bytes are not opcodes of their own
+        if(opcode < 0x100 && (opcode == 0x0f || is_prefix(opcode)))
+          continue;
+        check_opcode(code, n, opcode, &prf);
+      }
+    }
+
+  printf("compared %lu : identical %lu : rex.w over 66 %lu : "
+         "c7 imm32 under rex.w %lu : sib immediate %lu : failed %lu\n",
+         compared, identical, rexw_o16, c7_imm32, sib_imm, failed);
+
+  return failed != 0;
+}
@@ -0,0 +1,374 @@
+/**************************************************************************/
+/*!
+  \brief  Check doorbell-store emulation against real execution: every
+          store form the pf_in decoder knows is run on the cpu and
+          emulated from its decoding (as neon_fault_save_decode and
+          neon_fault_emulate do), and the memory both leave behind, and
+          the instruction length, must agree. Forms the fault path has
+          to single-step (loads, string stores, register operands) must
+          decode to length 0. x86-64 only.
+*/
+/**************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/module.h>
+#include "pf_in.h"
+
+/****************************************************************************/
+// register numbers (mod/rm), their values and where stores go
+
+#define REG_SP   4
+#define REG_SI   6
+#define REG_DI   7
+#define REG_R12  12
+#define REG_R14  14
+#define REG_R15  15
+
+#define AREA_SIZE  4096
+#define CODE_OFS   0x000
+#define DATA_OFS   0x800
+#define DATA_SIZE  0x100
+#define BASE_OFS   0x40     // base register value, within data
+#define INDEX_VAL  3UL      // index register value
+
+static unsigned char *area = NULL;  // code and data, below 2GB
+static unsigned long  gpr[16];
+
+// run code (ending in ret) with all but sp of gpr[] loaded
+void run_code(const unsigned long *regs, const void *code);
+__asm__(
+  "  .text\n"
+  "  .globl run_code\n"
+  "run_code:\n"
+  "  push %rbx\n  push %rbp\n  push %r12\n"
+  "  push %r13\n  push %r14\n  push %r15\n"
+  "  push %rsi\n"
+  "  mov 0x00(%rdi), %rax\n  mov 0x08(%rdi), %rcx\n"
+  "  mov 0x10(%rdi), %rdx\n  mov 0x18(%rdi), %rbx\n"
+  "  mov 0x28(%rdi), %rbp\n  mov 0x30(%rdi), %rsi\n"
+  "  mov 0x40(%rdi), %r8\n   mov 0x48(%rdi), %r9\n"
+  "  mov 0x50(%rdi), %r10\n  mov 0x58(%rdi), %r11\n"
+  "  mov 0x60(%rdi), %r12\n  mov 0x68(%rdi), %r13\n"
+  "  mov 0x70(%rdi), %r14\n  mov 0x78(%rdi), %r15\n"
+  "  mov 0x38(%rdi), %rdi\n"
+  "  call *(%rsp)\n"
+  "  pop %rsi\n"
+  "  pop %r15\n  pop %r14\n  pop %r13\n"
+  "  pop %r12\n  pop %rbp\n  pop %rbx\n"
+  "  ret\n");
+
+/****************************************************************************/
+// memory operand forms
+typedef enum {
+  FORM_BASE,          // (base)
+  FORM_DISP8,         // disp8(base)
+  FORM_DISP32,        // disp32(base)
+  FORM_SIB,           // (base) through a SIB byte, no index
+  FORM_SIB_INDEX,     // disp8(base, index, 4)
+  FORM_SIB_ABS,       // disp32, SIB without base
+  FORM_RIP,           // disp32(%rip)
+  FORMS
+} form_t;
+
+static const char *form_name[FORMS] = {
+  "base", "disp8", "disp32", "sib", "sib-index", "sib-abs", "rip"
+};
+
+/****************************************************************************/
+// counters
+static unsigned long executed    = 0;
+static unsigned long emulable    = 0;
+static unsigned long stepped     = 0;
+static unsigned long failed      = 0;
+
+/**************************************************************************/
+// regs_fill
+/**************************************************************************/
+// distinct values in every byte of every register; base registers
+// (either REX.B half) point into the data area, index registers hold
+// INDEX_VAL (under REX.X, SIB index 4 is %r12 rather than none)
+static void
+regs_fill(struct pt_regs *regs)
+{
+  unsigned long base = (unsigned long) area + DATA_OFS + BASE_OFS;
+  unsigned int  i    = 0;
+
+  for(i = 0; i < 16; i++)
+    gpr[i] = 0x8070605040302010UL ^ (i * 0x0101010101010101UL);
+  gpr[REG_DI] = gpr[REG_R15] = base;
+  gpr[REG_SI] = gpr[REG_R14] = gpr[REG_R12] = INDEX_VAL;
+
+  memset(regs, 0, sizeof(*regs));
+  regs->ax  = gpr[0];  regs->cx  = gpr[1];  regs->dx  = gpr[2];
+  regs->bx  = gpr[3];  regs->sp  = gpr[4];  regs->bp  = gpr[5];
+  regs->si  = gpr[6];  regs->di  = gpr[7];  regs->r8  = gpr[8];
+  regs->r9  = gpr[9];  regs->r10 = gpr[10]; regs->r11 = gpr[11];
+  regs->r12 = gpr[12]; regs->r13 = gpr[13]; regs->r14 = gpr[14];
+  regs->r15 = gpr[15];
+}
+
+/**************************************************************************/
+// encode
+/**************************************************************************/
+// encode prefixes, opcode, ModRM (reg field reg), the memory operand
+// in form and an immediate of imm_len bytes at code; returns the
+// length, *target gets the address stored to (rexx: REX.X is set)
+static unsigned int
+encode(unsigned char *code,
+       const unsigned char *prefix,
+       const unsigned int nprefix,
+       const unsigned int rexx,
+       const unsigned char opcode,
+       const unsigned int reg,
+       const form_t form,
+       const unsigned int imm_len,
+       unsigned long *target)
+{
+  const unsigned long base = (unsigned long) area + DATA_OFS + BASE_OFS;
+  unsigned char      *p    = code;
+  unsigned char      *disp = NULL;
+  unsigned int        i    = 0;
+  int                 d    = 0;
+
+  memcpy(p, prefix, nprefix);
+  p += nprefix;
+  *p++ = opcode;
+
+  switch(form) {
+  case FORM_BASE:
+    *p++ = (reg & 7) << 3 | 7;
+    *target = base;
+    break;
+  case FORM_DISP8:
+    *p++ = 1 << 6 | (reg & 7) << 3 | 7;
+    *p++ = 0x08;
+    *target = base + 0x08;
+    break;
+  case FORM_DISP32:
+    *p++ = 2 << 6 | (reg & 7) << 3 | 7;
+    d = 0x20;
+    memcpy(p, &d, 4);
+    p += 4;
+    *target = base + 0x20;
+    break;
+  case FORM_SIB:
+    *p++ = (reg & 7) << 3 | 4;
+    *p++ = 4 << 3 | 7;
+    *target = base + (rexx ? INDEX_VAL : 0);
+    break;
+  case FORM_SIB_INDEX:
+    *p++ = 1 << 6 | (reg & 7) << 3 | 4;
+    *p++ = 2 << 6 | (REG_SI & 7) << 3 | 7;
+    *p++ = 0x04;
+    *target = base + INDEX_VAL * 4 + 0x04;
+    break;
+  case FORM_SIB_ABS:
+    *p++ = (reg & 7) << 3 | 4;
+    *p++ = 4 << 3 | 5;
+    *target = base + 0x30;
+    d = (int) (*target - (rexx ? INDEX_VAL : 0));
+    memcpy(p, &d, 4);
+    p += 4;
+    break;
+  case FORM_RIP:
+    *p++ = (reg & 7) << 3 | 5;
+    disp = p;
+    p += 4;
+    *target = base + 0x38;
+    break;
+  default:
+    break;
+  }
+
+  // immediates sign-extend (C7 under REX.W) if the top bit is set
+  for(i = 0; i < imm_len; i++)
+    *p++ = (i == imm_len - 1) ? 0x9c : 0x21 + i;
+
+  if(disp != NULL) {
+    d = (int) (*target - (unsigned long) p);
+    memcpy(disp, &d, 4);
+  }
+
+  return p - code;
+}
+
+/**************************************************************************/
+// check_store
+/**************************************************************************/
+// run one store form and emulate it from its decoding; compare
+static void
+check_store(const unsigned char *prefix,
+            const unsigned int nprefix,
+            const unsigned int rexx,
+            const unsigned char opcode,
+            const unsigned int reg,
+            const form_t form,
+            const unsigned int imm_len)
+{
+  unsigned char   *code = area + CODE_OFS;
+  unsigned char   *data = area + DATA_OFS;
+  unsigned char    real[DATA_SIZE];
+  unsigned char    emul[DATA_SIZE];
+  unsigned long    target = 0;
+  unsigned long    val    = 0;
+  unsigned int     len    = 0;
+  unsigned int     i      = 0;
+  struct pt_regs   regs;
+  struct ins_desc  desc;
+
+  regs_fill(&regs);
+  len = encode(code, prefix, nprefix, rexx, opcode, reg, form, imm_len,
+               &target);
+  code[len] = 0xc3;  // ret
+
+  memset(data, 0xa5, DATA_SIZE);
+  memcpy(emul, data, DATA_SIZE);
+
+  // emulate first, as the fault path does (the store not yet done)
+  if(get_ins_desc((unsigned long) code, &desc) != 0 ||
+     (desc.type != REG_WRITE && desc.type != IMM_WRITE)) {
+    printf("FAIL %s : opcode %02x reg %u : not decoded as a store\n",
+           form_name[form], opcode, reg);
+    failed++;
+    return;
+  }
+  val = (desc.type == IMM_WRITE) ? desc.imm :
+    get_ins_desc_reg_val(&desc, &regs);
+  memcpy(emul + (target - (unsigned long) data), &val, desc.mem_width);
+
+  run_code(gpr, code);
+  memcpy(real, data, DATA_SIZE);
+  executed++;
+
+  if(desc.len != len || memcmp(real, emul, DATA_SIZE) != 0) {
+    printf("FAIL %s : ", form_name[form]);
+    for(i = 0; i < len; i++)
+      printf("%02x ", code[i]);
+    printf(": len %u (decoded %u) : width %u : val 0x%lx\n",
+           len, desc.len, desc.mem_width, val);
+    failed++;
+    return;
+  }
+
+  // same criteria as neon_fault_emulable, the register address aside
+  if(desc.len != 0 && desc.mem_width == 4)
+    emulable++;
+  else
+    stepped++;
+}
+
+/**************************************************************************/
+// check_stepped
+/**************************************************************************/
+// a form the fault path must single-step: length 0, whatever it is
+static void
+check_stepped(const unsigned char *code,
+              const unsigned int len)
+{
+  struct ins_desc desc;
+  unsigned int    i = 0;
+
+  if(get_ins_desc((unsigned long) code, &desc) == 0 && desc.len != 0) {
+    printf("FAIL stepped : ");
+    for(i = 0; i < len; i++)
+      printf("%02x ", code[i]);
+    printf(": decoded len %u\n", desc.len);
+    failed++;
+    return;
+  }
+  stepped++;
+}
+
+/**************************************************************************/
+// main
+/**************************************************************************/
+int
+main(void)
+{
+  static const unsigned char loads[][2] = {
+    { 0x8a, 0 }, { 0x8b, 0 }, { 0x0f, 0xb6 }, { 0x0f, 0xb7 },
+    { 0x0f, 0xbe }, { 0x0f, 0xbf },
+  };
+  static const unsigned char stores[] = { 0x88, 0x89, 0xc6, 0xc7 };
+  unsigned char prefix[2];
+  unsigned char code[16];
+  unsigned int  o16  = 0;
+  unsigned int  rex  = 0;
+  unsigned int  op   = 0;
+  unsigned int  reg  = 0;
+  unsigned int  form = 0;
+
+  area = mmap(NULL, AREA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if(area == MAP_FAILED) {
+    perror("mmap");
+    return 2;
+  }
+
+  // no REX, then each of 0x40-0x4f; with and without 0x66 ahead
+  for(o16 = 0; o16 < 2; o16++)
+    for(rex = 0x3f; rex <= 0x4f; rex++) {
+      unsigned int n = 0;
+      if(o16 != 0)
+        prefix[n++] = 0x66;
+      if(rex != 0x3f)
+        prefix[n++] = rex;
+
+      for(op = 0; op < sizeof(stores); op++) {
+        unsigned int imm_len = 0;
+        unsigned int rexw    = (rex != 0x3f && (rex & 0x08) != 0);
+        if(stores[op] == 0xc6)
+          imm_len = 1;
+        else if(stores[op] == 0xc7)
+          imm_len = (o16 != 0 && rexw == 0) ? 2 : 4;
+
+        for(reg = 0; reg < 8; reg++) {
+          unsigned int r = reg | ((rex != 0x3f && (rex & 0x04)) ? 8 : 0);
+          // C6/C7 take /0 only; %rsp/%spl never hold a doorbell value
+          if(imm_len != 0 && reg != 0)
+            continue;
+          if(imm_len == 0 && r == REG_SP &&
+             (stores[op] != 0x88 || rex != 0x3f))
+            continue;
+          for(form = 0; form < FORMS; form++)
+            check_store(prefix, n, rex != 0x3f && (rex & 0x02) != 0,
+                        stores[op], r, form, imm_len);
+        }
+
+        // register destination
+        memcpy(code, prefix, n);
+        code[n] = stores[op];
+        code[n + 1] = 0xc0;
+        check_stepped(code, n + 2);
+      }
+
+      for(op = 0; op < sizeof(loads) / sizeof(loads[0]); op++) {
+        unsigned int l = n;
+        memcpy(code, prefix, n);
+        code[l++] = loads[op][0];
+        if(loads[op][0] == 0x0f)
+          code[l++] = loads[op][1];
+        code[l++] = 0x07;
+        check_stepped(code, l);
+      }
+
+      // string stores, plain and repeated
+      for(op = 0xaa; op <= 0xab; op++) {
+        memcpy(code, prefix, n);
+        code[n] = op;
+        check_stepped(code, n + 1);
+        code[0] = 0xf3;
+        memcpy(code + 1, prefix, n);
+        code[n + 1] = op;
+        check_stepped(code, n + 2);
+      }
+    }
+
+  printf("executed %lu : emulable %lu : single-stepped %lu : failed %lu\n",
+         executed, emulable, stepped, failed);
+
+  return failed != 0;
+}
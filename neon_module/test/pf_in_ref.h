@@ -0,0 +1,19 @@
+/**************************************************************************/
+/*!
+  \brief  the reference (pre-table) pf_in decoder, see pf_in_ref.c
+*/
+/**************************************************************************/
+
+#ifndef __NEON_TEST_PF_IN_REF_H__
+#define __NEON_TEST_PF_IN_REF_H__
+
+#include <linux/module.h>
+#include "pf_in.h"
+
+enum reason_type ref_get_ins_type(unsigned long ins_addr);
+unsigned int ref_get_ins_mem_width(unsigned long ins_addr);
+unsigned long ref_get_ins_reg_val(unsigned long ins_addr,
+                                  struct pt_regs *regs);
+unsigned long ref_get_ins_imm_val(unsigned long ins_addr);
+
+#endif // __NEON_TEST_PF_IN_REF_H__
@@ -0,0 +1,26 @@
+/**************************************************************************/
+/*!
+  \brief  user-space stand-ins for what arch/x86/mm/pf_in.c takes from
+          the kernel, so that the decoder builds into the checks here
+*/
+/**************************************************************************/
+
+#ifndef __NEON_TEST_SHIM_MODULE_H__
+#define __NEON_TEST_SHIM_MODULE_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#define KERN_ERR           ""
+#define printk(fmt, ...)   ((void) 0)
+#define EXPORT_SYMBOL(sym)
+#define ARRAY_SIZE(a)      (sizeof(a) / sizeof((a)[0]))
+
+// x86-64 register frame, as laid out by the kernel
+struct pt_regs {
+  unsigned long r15, r14, r13, r12, bp, bx;
+  unsigned long r11, r10, r9, r8, ax, cx, dx, si, di;
+  unsigned long orig_ax, ip, cs, flags, sp, ss;
+};
+
+#endif // __NEON_TEST_SHIM_MODULE_H__